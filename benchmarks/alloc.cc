@@ -0,0 +1,186 @@
+/* a benchmark comparing the builtin allocators
+ *
+ * the allocation functions are called directly, the same way the library
+ * calls them, once with plain malloc and once with the slab allocator;
+ * the cases are churn on a set of live blocks with the sizes typical for
+ * the library (strings, idents, small buffers), the same from several
+ * threads at once, and freeing blocks allocated by other threads
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "cs_alloc.hh"
+
+namespace cs = cubescript;
+
+using clock_type = std::chrono::steady_clock;
+
+static constexpr std::size_t NLIVE = 4096;
+
+static double elapsed(clock_type::time_point start) {
+    return std::chrono::duration<double, std::milli>{
+        clock_type::now() - start
+    }.count();
+}
+
+/* mostly small sizes with the occasional bigger buffer */
+static std::size_t next_size(unsigned int &seed) {
+    seed = seed * 1103515245 + 12345;
+    auto r = (seed >> 16) & 0x7FFF;
+    if ((r & 15) == 0) {
+        return 256 + (r % 2048);
+    }
+    return 8 + (r % 120);
+}
+
+struct block {
+    void *p = nullptr;
+    std::size_t size = 0;
+};
+
+struct allocator {
+    cs::alloc_func func;
+    void *data;
+
+    void *alloc(std::size_t n) {
+        auto *p = func(data, nullptr, 0, n);
+        if (!p) {
+            std::abort();
+        }
+        /* touch it, like the library would */
+        *static_cast<char *>(p) = 0;
+        return p;
+    }
+
+    void free(block &b) {
+        func(data, b.p, b.size, 0);
+        b.p = nullptr;
+    }
+};
+
+static void churn(allocator a, long iters, unsigned int seed) {
+    std::vector<block> live(NLIVE);
+    for (long i = 0; i < iters; ++i) {
+        auto sz = next_size(seed);
+        auto &b = live[(seed >> 4) % NLIVE];
+        if (b.p) {
+            a.free(b);
+        }
+        b.p = a.alloc(sz);
+        b.size = sz;
+    }
+    for (auto &b: live) {
+        if (b.p) {
+            a.free(b);
+        }
+    }
+}
+
+static void fill(allocator a, std::vector<block> &blocks, unsigned int seed) {
+    for (auto &b: blocks) {
+        b.size = next_size(seed);
+        b.p = a.alloc(b.size);
+    }
+}
+
+static void drop(allocator a, std::vector<block> &blocks) {
+    for (auto &b: blocks) {
+        a.free(b);
+    }
+}
+
+static void bench(char const *name, allocator a, long iters) {
+    unsigned int nthr = std::thread::hardware_concurrency();
+    if (nthr < 2) {
+        nthr = 2;
+    }
+
+    std::printf("%s:\n", name);
+
+    {
+        auto start = clock_type::now();
+        churn(a, iters, 1);
+        auto dur = elapsed(start);
+        std::printf(
+            "  churn:              %.3f ms, %.2f Mops/s\n",
+            dur, double(iters) / dur / 1000.0
+        );
+    }
+
+    {
+        std::vector<std::thread> thrs;
+        auto start = clock_type::now();
+        for (unsigned int i = 0; i < nthr; ++i) {
+            thrs.emplace_back(churn, a, iters, i + 1);
+        }
+        for (auto &t: thrs) {
+            t.join();
+        }
+        auto dur = elapsed(start);
+        std::printf(
+            "  churn, %2u threads:  %.3f ms, %.2f Mops/s\n",
+            nthr, dur, double(iters) * nthr / dur / 1000.0
+        );
+    }
+
+    {
+        /* every thread frees what its neighbour allocated */
+        std::vector<std::vector<block>> blocks(nthr);
+        for (auto &bl: blocks) {
+            bl.resize(std::size_t(iters) / 16);
+        }
+        auto start = clock_type::now();
+        for (int round = 0; round < 16; ++round) {
+            std::vector<std::thread> thrs;
+            for (unsigned int i = 0; i < nthr; ++i) {
+                thrs.emplace_back(fill, a, std::ref(blocks[i]), i + 1);
+            }
+            for (auto &t: thrs) {
+                t.join();
+            }
+            thrs.clear();
+            for (unsigned int i = 0; i < nthr; ++i) {
+                thrs.emplace_back(
+                    drop, a, std::ref(blocks[(i + 1) % nthr])
+                );
+            }
+            for (auto &t: thrs) {
+                t.join();
+            }
+        }
+        auto dur = elapsed(start);
+        std::printf(
+            "  remote frees:       %.3f ms, %.2f Mops/s\n",
+            dur, double(iters) * nthr / dur / 1000.0
+        );
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        std::fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    long iters = 2000000;
+    if (argc == 2) {
+        iters = std::strtol(argv[1], nullptr, 10);
+        if (iters <= 0) {
+            std::fprintf(stderr, "error: invalid number of iterations\n");
+            return 1;
+        }
+    }
+
+    bench("malloc", allocator{cs::malloc_alloc, nullptr}, iters);
+
+    auto *h = cs::slab_heap_new();
+    bench("slab", allocator{cs::slab_alloc, h}, iters);
+    cs::slab_heap_free(h);
+
+    return 0;
+}
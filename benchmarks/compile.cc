@@ -0,0 +1,94 @@
+/* a benchmark for batch compilation
+ *
+ * a set of generated scripts, resembling a tree of configuration files
+ * (aliases, menus, loops, some of them referring to aliases the others
+ * define), is compiled with compile_all() with an increasing number of
+ * threads, printing the total throughput for each
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cubescript/cubescript.hh>
+
+namespace cs = cubescript;
+
+static std::string make_script(std::size_t n) {
+    std::string ret;
+    for (std::size_t i = 0; i < 40; ++i) {
+        auto id = std::to_string(n) + "_" + std::to_string(i);
+        ret += "item" + id + " = [\n";
+        ret += "    loop i 10 [\n";
+        ret += "        if (> $i 5) [echo (concat \"item\" $i \"of " + id;
+        ret += "\")] [result (+ $i (* $arg1 3))]\n";
+        ret += "    ]\n";
+        ret += "    looplist x \"a b c d\" [val" + id + " = (concatword $x $x)]\n";
+        ret += "]\n";
+        /* refer to what another file defines */
+        ret += "shared" + std::to_string(i) + " = [item" + id + " 2]\n";
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        std::fprintf(stderr, "usage: %s [files]\n", argv[0]);
+        return 1;
+    }
+
+    long nfiles = 256;
+    if (argc == 2) {
+        nfiles = std::strtol(argv[1], nullptr, 10);
+        if (nfiles <= 0) {
+            std::fprintf(stderr, "error: invalid number of files\n");
+            return 1;
+        }
+    }
+
+    std::vector<std::string> srcs;
+    std::vector<std::string> names;
+    std::size_t total = 0;
+    for (long i = 0; i < nfiles; ++i) {
+        srcs.push_back(make_script(std::size_t(i)));
+        names.push_back("file" + std::to_string(i) + ".cfg");
+        total += srcs.back().size();
+    }
+    std::vector<cs::compile_input> inputs;
+    for (long i = 0; i < nfiles; ++i) {
+        inputs.push_back(cs::compile_input{srcs[i], names[i]});
+    }
+
+    using clock = std::chrono::steady_clock;
+
+    unsigned int maxthr = std::thread::hardware_concurrency();
+    if (maxthr < 4) {
+        maxthr = 4;
+    }
+
+    for (unsigned int nthr = 1; nthr <= maxthr; nthr *= 2) {
+        /* a fresh state every time, so the aliases are created each run */
+        cs::state gcs;
+        cs::std_init_all(gcs);
+        std::vector<cs::bcode_ref> ret(inputs.size());
+        auto start = clock::now();
+        gcs.compile_all(inputs, ret, nthr);
+        auto dur = std::chrono::duration<double, std::milli>{
+            clock::now() - start
+        }.count();
+        for (auto &r: ret) {
+            if (!r) {
+                std::abort();
+            }
+        }
+        std::printf(
+            "%2u threads: %.3f ms, %.2f MB/s\n", nthr, dur,
+            double(total) / dur / 1000.0
+        );
+    }
+
+    return 0;
+}
@@ -0,0 +1,314 @@
+/* microbenchmarks for the hot paths of the library
+ *
+ * every case is run with a doubling number of iterations until it takes
+ * long enough to be measured, and the time per operation is reported; the
+ * output is JSON, so that runs of different versions can be compared by
+ * a script, e.g. to track regressions
+ *
+ * the bytecode cases repeat a small body many times within one block, so
+ * that the cost of the instructions in it is not lost in the call overhead
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <cubescript/cubescript.hh>
+
+namespace cs = cubescript;
+
+using clock_type = std::chrono::steady_clock;
+
+/* how many times a bytecode body is repeated within the block */
+static constexpr long CODE_REPEAT = 100;
+
+/* how long a case has to run to be measured, in milliseconds */
+static double min_time = 100.0;
+
+/* avoid optimizing away results */
+static volatile long sink = 0;
+
+struct bench_case {
+    char const *name;
+    /* operations done per iteration */
+    long ops;
+    void (*prepare)(cs::state &cs);
+    void (*run)(cs::state &cs, long long iters);
+};
+
+/* bytecode cases; the body is repeated and then called as a block */
+
+static cs::bcode_ref code_block{};
+
+static void prepare_code(cs::state &cs, char const *setup, char const *body) {
+    cs.compile(setup).call(cs);
+    std::string src;
+    for (long i = 0; i < CODE_REPEAT; ++i) {
+        src += body;
+        src += '\n';
+    }
+    code_block = cs.compile(src);
+}
+
+static void run_code(cs::state &cs, long long iters) {
+    for (long long i = 0; i < iters; ++i) {
+        code_block.call(cs);
+    }
+}
+
+#define CODE_CASE(cname, setup, body) \
+    bench_case{ \
+        cname, CODE_REPEAT, \
+        [](cs::state &cs) { prepare_code(cs, setup, body); }, \
+        run_code \
+    }
+
+/* a list of numbers in descending order, for the list cases */
+static std::string make_list(long n) {
+    std::string ret;
+    for (long i = n; i > 0; --i) {
+        ret += std::to_string(i * 7919 % 1000);
+        ret += (i % 3) ? " " : " [nested item] ";
+    }
+    return ret;
+}
+
+static std::string list_str{};
+
+/* a script resembling a configuration file, for the compiler */
+static std::string make_script() {
+    std::string ret;
+    for (int i = 0; i < 50; ++i) {
+        auto n = std::to_string(i);
+        ret += "item" + n + " = [\n";
+        ret += "    loop i 10 [if (> $i 5) [echo (concat \"item\" $i)]]\n";
+        ret += "    looplist x \"a b c\" [val" + n + " = (concatword $x $x)]\n";
+        ret += "]\n";
+        ret += "bind" + n + " = [item" + n + " 2; result (+ 1 (* 2 $arg1))]\n";
+    }
+    return ret;
+}
+
+static std::string script_str{};
+
+static std::vector<std::string> pool_strs{};
+
+static bench_case const cases[] = {
+    /* opcode dispatch, per instruction class */
+    CODE_CASE("dispatch/constant", "", "result 12345"),
+    CODE_CASE("dispatch/lookup", "x = 5", "result $x"),
+    CODE_CASE("dispatch/assign", "x = 5", "x = 6"),
+    CODE_CASE("dispatch/var", "", "result $numargs"),
+    CODE_CASE("dispatch/arith", "x = 5", "result (+ $x 3)"),
+    CODE_CASE("dispatch/compare", "x = 5", "result (< $x 3)"),
+    CODE_CASE("dispatch/branch", "x = 5", "if (< $x 3) [x = 5] [x = 5]"),
+    CODE_CASE("dispatch/string", "s = abc", "result (concatword $s $s)"),
+    CODE_CASE(
+        "dispatch/dynamic", "x = 5; n = x", "result (getalias $n)"
+    ),
+    /* calls */
+    CODE_CASE(
+        "call/alias", "f = [result (+ $arg1 $arg2)]", "f 1 2"
+    ),
+    CODE_CASE(
+        "call/alias_large",
+        "f = [local a b c; a = $arg1; b = $arg2; c = (+ $a $b); "
+        "c = (* $c $c); c = (- $c $a); c = (+ $c $b); result $c]",
+        "f 1 2"
+    ),
+    CODE_CASE("call/builtin", "", "nop 1 2.5 abc"),
+    CODE_CASE("call/builtin_dynamic", "cmd = nop", "$cmd 1 2.5 abc"),
+    /* the string pool, with a hot and a large set of strings */
+    bench_case{
+        "strings/add_same", 1,
+        [](cs::state &) {},
+        [](cs::state &cs, long long iters) {
+            for (long long i = 0; i < iters; ++i) {
+                cs::string_ref s{cs, "a string that is interned often"};
+                sink = sink + long(s.size());
+            }
+        }
+    },
+    bench_case{
+        "strings/add_many", 1,
+        [](cs::state &) {
+            pool_strs.clear();
+            for (int i = 0; i < 4096; ++i) {
+                pool_strs.push_back("pooled string " + std::to_string(i));
+            }
+        },
+        [](cs::state &cs, long long iters) {
+            for (long long i = 0; i < iters; ++i) {
+                cs::string_ref s{cs, pool_strs[std::size_t(i) & 4095]};
+                sink = sink + long(s.size());
+            }
+        }
+    },
+    /* any_value conversions */
+    bench_case{
+        "value/int_to_string", 1,
+        [](cs::state &) {},
+        [](cs::state &cs, long long iters) {
+            cs::any_value v{};
+            for (long long i = 0; i < iters; ++i) {
+                v.set_integer(cs::integer_type(i & 0xFFFF));
+                sink = sink + long(v.get_string(cs).size());
+            }
+        }
+    },
+    bench_case{
+        "value/float_to_string", 1,
+        [](cs::state &) {},
+        [](cs::state &cs, long long iters) {
+            cs::any_value v{};
+            for (long long i = 0; i < iters; ++i) {
+                v.set_float(cs::float_type(i & 0xFFFF) * cs::float_type(0.25));
+                sink = sink + long(v.get_string(cs).size());
+            }
+        }
+    },
+    bench_case{
+        "value/string_to_int", 1,
+        [](cs::state &) {},
+        [](cs::state &cs, long long iters) {
+            cs::any_value v{};
+            v.set_string("123456", cs);
+            for (long long i = 0; i < iters; ++i) {
+                sink = sink + long(v.get_integer());
+            }
+        }
+    },
+    bench_case{
+        "value/string_to_float", 1,
+        [](cs::state &) {},
+        [](cs::state &cs, long long iters) {
+            cs::any_value v{};
+            v.set_string("1234.5625", cs);
+            for (long long i = 0; i < iters; ++i) {
+                sink = sink + long(v.get_float());
+            }
+        }
+    },
+    /* lists, per item */
+    bench_case{
+        "list/parse", 100,
+        [](cs::state &) { list_str = make_list(100); },
+        [](cs::state &cs, long long iters) {
+            for (long long i = 0; i < iters; ++i) {
+                cs::list_parser p{cs, list_str};
+                long n = 0;
+                while (p.parse()) {
+                    ++n;
+                }
+                sink = sink + n;
+            }
+        }
+    },
+    bench_case{
+        "list/sortlist", 100,
+        [](cs::state &cs) {
+            list_str = make_list(100);
+            cs.new_var("biglist", list_str);
+            code_block = cs.compile("sortlist $biglist x y [< $x $y]");
+        },
+        run_code
+    },
+    /* the compiler, per byte of source */
+    bench_case{
+        "compile/script", 0,
+        [](cs::state &) { script_str = make_script(); },
+        [](cs::state &cs, long long iters) {
+            for (long long i = 0; i < iters; ++i) {
+                auto code = cs.compile(script_str);
+                sink = sink + long(!!code);
+            }
+        }
+    },
+};
+
+static void init_state(cs::state &cs) {
+    cs::std_init_all(cs);
+    cs.new_command("nop", "ifs", [](auto &, auto, auto &) {});
+}
+
+/* runs the case until it takes at least min_time, returning the time
+ * of the last run in milliseconds
+ */
+static double measure(
+    bench_case const &bc, cs::state &cs, long long &iters
+) {
+    /* warm up, so that lazily compiled aliases are not counted */
+    bc.run(cs, 1);
+    for (iters = 1;; iters *= 2) {
+        auto start = clock_type::now();
+        bc.run(cs, iters);
+        auto dur = std::chrono::duration<double, std::milli>{
+            clock_type::now() - start
+        }.count();
+        if ((dur >= min_time) || (iters >= (1LL << 40))) {
+            return dur;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    char const *filter = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--min-time") && ((i + 1) < argc)) {
+            min_time = std::strtod(argv[++i], nullptr);
+            if (min_time <= 0) {
+                std::fprintf(stderr, "error: invalid minimum time\n");
+                return 1;
+            }
+        } else if (!filter && (argv[i][0] != '-')) {
+            filter = argv[i];
+        } else {
+            std::fprintf(
+                stderr, "usage: %s [--min-time ms] [filter]\n", argv[0]
+            );
+            return 1;
+        }
+    }
+
+    std::printf("{\n  \"min_time_ms\": %.1f,\n  \"benchmarks\": [", min_time);
+    bool first = true;
+    for (auto &bc: cases) {
+        if (filter && !std::strstr(bc.name, filter)) {
+            continue;
+        }
+        /* every case gets a fresh state, so they do not affect each other */
+        cs::state gcs;
+        init_state(gcs);
+        long long iters = 0;
+        double dur = 0;
+        try {
+            bc.prepare(gcs);
+            dur = measure(bc, gcs, iters);
+        } catch (cs::error const &e) {
+            std::fprintf(
+                stderr, "error: %s: %.*s\n", bc.name,
+                int(e.what().size()), e.what().data()
+            );
+            /* the code belongs to the state, which goes away first */
+            code_block = cs::bcode_ref{};
+            return 1;
+        }
+        code_block = cs::bcode_ref{};
+        long ops = bc.ops ? bc.ops : long(script_str.size());
+        double nops = double(iters) * double(ops);
+        std::printf(
+            "%s\n    {\"name\": \"%s\", \"iterations\": %lld, "
+            "\"ops_per_iteration\": %ld, \"total_ms\": %.3f, "
+            "\"ns_per_op\": %.3f}",
+            first ? "" : ",", bc.name, iters, ops, dur, dur * 1e6 / nops
+        );
+        first = false;
+    }
+    std::printf("\n  ]\n}\n");
+
+    return 0;
+}
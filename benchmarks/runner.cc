@@ -0,0 +1,93 @@
+/* a rudimentary benchmark runner for cubescript files
+ *
+ * the file is compiled once and the resulting bytecode is then called
+ * the given number of times, so the measurement covers execution only
+ */
+
+#ifdef _MSC_VER
+/* avoid silly complaints about fopen */
+#  define _CRT_SECURE_NO_WARNINGS 1
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
+#include <string_view>
+
+#include <cubescript/cubescript.hh>
+
+namespace cs = cubescript;
+
+static bool read_file(char const *fname, std::unique_ptr<char[]> &buf, long &len) {
+    FILE *f = std::fopen(fname, "rb");
+    if (!f) {
+        return false;
+    }
+
+    std::fseek(f, 0, SEEK_END);
+    len = std::ftell(f);
+    std::fseek(f, 0, SEEK_SET);
+
+    buf = std::make_unique<char[]>(len + 1);
+    if (std::fread(buf.get(), 1, len, f) != std::size_t(len)) {
+        std::fclose(f);
+        return false;
+    }
+
+    buf[len] = '\0';
+    std::fclose(f);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if ((argc < 2) || (argc > 3)) {
+        std::fprintf(stderr, "usage: %s file.cube [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    long iters = 10;
+    if (argc == 3) {
+        iters = std::strtol(argv[2], nullptr, 10);
+        if (iters <= 0) {
+            std::fprintf(stderr, "error: invalid number of iterations\n");
+            return 1;
+        }
+    }
+
+    std::unique_ptr<char[]> buf;
+    long len;
+    if (!read_file(argv[1], buf, len)) {
+        std::fprintf(stderr, "error: could not read '%s'\n", argv[1]);
+        return 1;
+    }
+
+    cs::state gcs;
+    cs::std_init_all(gcs);
+
+    using clock = std::chrono::steady_clock;
+
+    try {
+        auto code = gcs.compile(
+            std::string_view{buf.get(), std::size_t(len)}, argv[1]
+        );
+        /* warm up, so that lazily compiled aliases are not counted */
+        code.call(gcs);
+        auto start = clock::now();
+        for (long i = 0; i < iters; ++i) {
+            code.call(gcs);
+        }
+        auto dur = std::chrono::duration<double, std::milli>{
+            clock::now() - start
+        }.count();
+        std::printf(
+            "%s: %ld iterations, %.3f ms total, %.3f ms/iteration\n",
+            argv[1], iters, dur, dur / double(iters)
+        );
+    } catch (cs::error const &e) {
+        std::fprintf(stderr, "error: %s\n", e.what().data());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+/* a multithreaded benchmark for the string pool
+ *
+ * every thread repeatedly interns strings from a shared set, copies the
+ * resulting references around and drops them again; this is run with an
+ * increasing number of threads, printing the total throughput for each
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cubescript/cubescript.hh>
+
+namespace cs = cubescript;
+
+static constexpr std::size_t NSTRINGS = 256;
+
+static void worker(
+    cs::state &cs, std::vector<std::string> const &strs,
+    std::size_t first, long iters
+) {
+    for (long i = 0; i < iters; ++i) {
+        auto &s = strs[(first + std::size_t(i) * 7) % strs.size()];
+        cs::string_ref ref{cs, s};
+        /* intern the same string again, then copy it a few times */
+        cs::string_ref ref2{cs, s};
+        cs::string_ref ref3 = ref;
+        ref3 = ref2;
+        cs::string_ref ref4 = ref3;
+        if (ref4.data() != ref.data()) {
+            std::abort();
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        std::fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    long iters = 200000;
+    if (argc == 2) {
+        iters = std::strtol(argv[1], nullptr, 10);
+        if (iters <= 0) {
+            std::fprintf(stderr, "error: invalid number of iterations\n");
+            return 1;
+        }
+    }
+
+    std::vector<std::string> strs;
+    for (std::size_t i = 0; i < NSTRINGS; ++i) {
+        strs.push_back("string pool entry " + std::to_string(i));
+    }
+
+    cs::state gcs;
+
+    using clock = std::chrono::steady_clock;
+
+    unsigned int maxthr = std::thread::hardware_concurrency();
+    if (maxthr < 4) {
+        maxthr = 4;
+    }
+
+    for (unsigned int nthr = 1; nthr <= maxthr; nthr *= 2) {
+        std::vector<cs::state> states;
+        for (unsigned int i = 0; i < nthr; ++i) {
+            states.push_back(gcs.new_thread());
+        }
+        std::vector<std::thread> thrs;
+        auto start = clock::now();
+        for (unsigned int i = 0; i < nthr; ++i) {
+            thrs.emplace_back(
+                worker, std::ref(states[i]), std::cref(strs),
+                std::size_t(i) * 31, iters
+            );
+        }
+        for (auto &t: thrs) {
+            t.join();
+        }
+        auto dur = std::chrono::duration<double, std::milli>{
+            clock::now() - start
+        }.count();
+        std::printf(
+            "%u threads: %ld iterations each, %.3f ms total, "
+            "%.2f Mops/s\n",
+            nthr, iters, dur, double(iters) * nthr / dur / 1000.0
+        );
+    }
+
+    return 0;
+}
@@ -25,6 +25,41 @@ namespace cubescript {
 
 struct state;
 
+/** @brief The state of the dead string cache
+ *
+ * Strings which are no longer referenced anywhere are kept around for a
+ * while, so that creating the same string again can reuse them. This
+ * describes the limits of that cache and how well it works, which can be
+ * used to tune the limits for a specific workload.
+ *
+ * @see cubescript::state::string_cache()
+ */
+struct string_cache_info {
+    /** @brief The maximum number of strings kept. */
+    std::size_t max_entries;
+    /** @brief The maximum number of bytes kept, including overhead. */
+    std::size_t max_bytes;
+    /** @brief The number of strings currently kept. */
+    std::size_t entries;
+    /** @brief The number of bytes currently kept, including overhead. */
+    std::size_t bytes;
+    /** @brief How many times a kept string was reused. */
+    std::size_t hits;
+    /** @brief How many times a string had to be newly created. */
+    std::size_t misses;
+};
+
+/** @brief A string to compile as part of a batch
+ *
+ * @see cubescript::state::compile_all()
+ */
+struct compile_input {
+    /** @brief The code to compile. */
+    std::string_view code;
+    /** @brief The filename for debug information, may be empty. */
+    std::string_view source;
+};
+
 /** @brief The allocator function signature
  *
  * This is the signature of the function pointer passed to do allocations.
@@ -54,6 +89,25 @@ struct state;
  */
 using alloc_func = void *(*)(void *, void *, size_t, size_t);
 
+/** @brief The builtin allocators
+ *
+ * A state may be created with one of these instead of a custom allocation
+ * function (see the `state` constructors).
+ *
+ * The slab allocator serves small allocations out of slabs of fixed-size
+ * blocks, which are kept in per-thread caches. Blocks freed by a different
+ * thread are returned to the thread that owns them. Memory held by the
+ * slabs is only given back to the system once the state is destroyed.
+ * Larger allocations are passed on to `malloc`.
+ *
+ * The malloc allocator simply uses `realloc` and `free`, like the example
+ * allocation function above.
+ */
+enum class builtin_alloc {
+    SLAB = 0, /**< @brief Size-classed slabs, the default. */
+    MALLOC    /**< @brief Plain `realloc` and `free`. */
+};
+
 /** @brief A call hook function
  *
  * It is possible to set up a call hook for each thread, which is called
@@ -81,10 +135,16 @@ struct LIBCUBESCRIPT_EXPORT state {
     /** @brief Create a new Cubescript main thread
      *
      * This creates a main thread without specifying an allocation function,
-     * using a simple, builtin implementation. Otherwise it is the same.
+     * using the builtin slab allocator. Otherwise it is the same.
      */
     state();
 
+    /** @brief Create a new Cubescript main thread
+     *
+     * This creates a main thread with one of the builtin allocators.
+     */
+    state(builtin_alloc a);
+
     /** @brief Create a new Cubescript main thread
      *
      * For this variant you have to specify a function used to allocate memory.
@@ -401,6 +461,98 @@ struct LIBCUBESCRIPT_EXPORT state {
         std::string_view v, std::string_view source = std::string_view{}
     );
 
+    /** @brief Compile many strings at once.
+     *
+     * This compiles each of the inputs like compile() does, writing the
+     * result for each into the matching slot of `ret`, which must be at
+     * least as long as `inputs`. The work is split between this thread and
+     * up to `nthreads - 1` side threads, or as many as there are hardware
+     * threads if `nthreads` is zero; in builds that are not thread safe,
+     * everything is compiled by this thread.
+     *
+     * This thread is blocked until all inputs are done. No other thread
+     * may change the state in the meantime.
+     *
+     * All inputs are compiled even if some of them fail.
+     *
+     * @throw cubescript::error for the first input that fails to compile
+     */
+    void compile_all(
+        span_type<compile_input const> inputs, span_type<bcode_ref> ret,
+        std::size_t nthreads = 0
+    );
+
+    /** @brief Serialize compiled bytecode.
+     *
+     * This turns the bytecode into an image that can be loaded into any
+     * state later with load_code(), without compiling again. The image is
+     * binary data (possibly containing zero bytes) and is meant to be
+     * written to a file by the caller; the library does no saving.
+     *
+     * The `v` argument is the source the bytecode was compiled from. Its
+     * hash is stored in the image, so that outdated images are detected.
+     *
+     * The image refers to idents by name, so it may be loaded into a fresh
+     * state, provided that the same commands exist in it, as the compiler
+     * specializes the code for them. Images are specific to the platform
+     * and version of the library.
+     *
+     * @return the image
+     */
+    string_ref save_code(bcode_ref const &code, std::string_view v);
+
+    /** @brief Load serialized bytecode.
+     *
+     * This loads an image made by save_code(), without involving the
+     * parser at all. Aliases the code refers to are created as needed.
+     *
+     * If the image was made from a source other than `v`, by a different
+     * platform or version, or with a different set of commands, or if any
+     * ident it refers to has a different type now, or if it is damaged,
+     * a null reference is returned and `v` is to be compiled as usual.
+     *
+     * @return a bytecode reference, possibly null
+     */
+    bcode_ref load_code(std::string_view image, std::string_view v);
+
+    /** @brief Serialize the state.
+     *
+     * This makes an image of everything scripts have set up: all variables
+     * with their values and flags, and all aliases with their values and
+     * their compiled code. Loading it with load_snapshot() into a state that
+     * was only given its commands skips running the setup scripts again.
+     *
+     * Commands are only recorded by name and argument list, as their native
+     * functions cannot be saved; the host has to register them again before
+     * loading. Like with save_code(), the library does no saving itself,
+     * and the image is specific to the platform and version of the library.
+     *
+     * Only the global values of aliases are saved, never the ones pushed
+     * by a thread.
+     *
+     * @return the image
+     */
+    string_ref save_snapshot();
+
+    /** @brief Load a serialized state.
+     *
+     * This restores the variables and aliases from an image made by
+     * save_snapshot(), creating them as needed. The image is only read
+     * while loading and need not be copied first, so it may for instance
+     * be a memory mapping of a file.
+     *
+     * Variable change hooks are not called. This should be done before any
+     * side threads are created.
+     *
+     * If the image is damaged, was made by a different platform or version,
+     * or does not match the state (the commands are not exactly the ones
+     * the snapshot was made with, or an ident exists with a different type),
+     * the state is left alone and `false` is returned.
+     *
+     * @return whether the snapshot was loaded
+     */
+    bool load_snapshot(std::string_view image);
+
     /** @brief Get if the thread is in override mode
      *
      * If the thread is in override mode, any assigned alias or variable will
@@ -440,13 +592,17 @@ struct LIBCUBESCRIPT_EXPORT state {
     /** @brief Get the maximum call depth of the VM
      *
      * If zero, it is unlimited, otherwise it specifies how much the VM is
-     * allowed to recurse. By default, it is 1024.
+     * allowed to recurse. By default, it is 65536.
+     *
+     * Blocks and alias calls do not recurse on the native stack, so this
+     * can be set high; nesting the VM through commands is limited to 1024
+     * levels regardless of this setting.
      */
     std::size_t max_call_depth() const;
 
     /** @brief Set the maximum call depth ov the VM
      *
-     * If zero, it is unlimited (the default is 1024). You can limit how much
+     * If zero, it is unlimited (the default is 65536). You can limit how much
      * the VM is allowed to recurse if you have specific constraints to adhere
      * to.
      *
@@ -454,6 +610,24 @@ struct LIBCUBESCRIPT_EXPORT state {
      */
     std::size_t max_call_depth(std::size_t v);
 
+    /** @brief Get the state of the dead string cache
+     *
+     * The cache is shared by all threads of the state. The hit and miss
+     * counters are cumulative since the creation of the state.
+     */
+    string_cache_info string_cache() const;
+
+    /** @brief Set the limits of the dead string cache
+     *
+     * Strings that are no longer referenced are retained until either
+     * limit is exceeded, at which point the least recently dropped ones
+     * are freed. Setting either limit to zero disables the cache. By
+     * default, up to 1024 strings or 64 KiB are kept.
+     *
+     * Setting the limits empties the cache.
+     */
+    void string_cache(std::size_t max_entries, std::size_t max_bytes);
+
 private:
     friend struct state_p;
 
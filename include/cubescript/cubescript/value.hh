@@ -161,6 +161,10 @@ private:
  * that all string references you are holding are gone by the time the
  * main thread calls its destructor.
  *
+ * Very long strings, as well as temporary results of some string building
+ * functions, are not interned, so that they do not need to be hashed. They
+ * behave the same otherwise, but may exist in more than one copy.
+ *
  * For compatibility, all strings that are pointed to by string references
  * are null terminated and therefore can be used with C-style APIs.
  */
@@ -251,15 +255,15 @@ struct LIBCUBESCRIPT_EXPORT string_ref {
 
     /** @brief Check if the string equals another.
      *
-     * This is effectively a `data() == s.data()` address comparison, and
-     * therefore always has constant time complexity.
+     * For interned strings, this is effectively a `data() == s.data()`
+     * address comparison, and therefore has constant time complexity.
+     * If either string is not interned, the contents are compared.
      */
     bool operator==(string_ref const &s) const;
 
     /** @brief Check if the string does not equal another.
      *
-     * This is effectively a `data() != s.data()` address comparison, and
-     * therefore always has constant time complexity.
+     * Like `!(*this == s)`.
      */
     bool operator!=(string_ref const &s) const;
 
@@ -295,7 +299,15 @@ enum class value_type {
  * more efficient storage and greater convenience.
  *
  * When the value contains a string or bytecode, it holds a reference like
- * cubescript::string_ref or cubescript::bcode_ref would.
+ * cubescript::string_ref or cubescript::bcode_ref would. Very short strings
+ * are an exception; those are kept inline in the value itself, and only
+ * become a reference once you ask a non-const value for one with
+ * get_string().
+ *
+ * Const member functions never modify the value, so a value may be read
+ * from several threads at once as long as none of them modifies it. Like
+ * with any other object, this includes calling non-const members such as
+ * the non-const get_string().
  *
  * Upon setting different types, the old type will get cleared, which may
  * include a reference count decrease.
@@ -382,6 +394,9 @@ struct LIBCUBESCRIPT_EXPORT any_value {
      * The type becomes value_type::STRING. The string will be allocated
      * (if non-existent) like a cubescript::string_ref, and its reference
      * count will be increased. This is why it is necessary to provide a state.
+     *
+     * Strings short enough to fit in the value are stored inline instead,
+     * without touching the string pool.
      */
     void set_string(std::string_view val, state &cs);
 
@@ -416,8 +431,21 @@ struct LIBCUBESCRIPT_EXPORT any_value {
      * will occur. This will not affect the contained type, all conversions
      * are only intermediate.
      *
+     * If the value holds a short inline string, it is interned at this
+     * point, and the value will refer to the interned string from then on.
+     * Therefore, views of the returned reference stay valid for as long as
+     * the value holds the string, even once the reference is gone.
+     *
      * If the type is not convertible, an empty string is used.
      */
+    string_ref get_string(state &cs);
+
+    /** @brief Get the value as a string reference.
+     *
+     * Like the non-const version, except the value is never modified. A
+     * short inline string is returned as a new reference instead, so views
+     * of it are only valid for as long as the reference is kept around.
+     */
     string_ref get_string(state &cs) const;
 
     /** @brief Get the value as an integer.
@@ -506,9 +534,10 @@ struct LIBCUBESCRIPT_EXPORT any_value {
 
     /** @brief Force the type to value_type::STRING.
      *
-     * Like `set_string(get_string(cs))`.
+     * Like `set_string(get_string(cs))`, except short strings are kept
+     * inline rather than interned.
      *
-     * @return A view to the string.
+     * @return A view to the string, valid until the value is changed.
      */
     std::string_view force_string(state &cs);
 
@@ -537,14 +566,22 @@ struct LIBCUBESCRIPT_EXPORT any_value {
     ident &force_ident(state &cs);
 
 private:
+    friend struct any_value_p;
+
+    void set_small(std::string_view val);
+    std::string_view get_view() const;
+
     union {
         integer_type i;
         float_type f;
         char const *s;
         struct bcode *b;
         ident *v;
+        char c[sizeof(void *)];
     } p_stor;
     value_type p_type;
+    /* for strings, zero if interned, otherwise the inline length plus one */
+    unsigned char p_sinl = 0;
 };
 
 } /* namespace cubescript */
@@ -0,0 +1,347 @@
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "cs_alloc.hh"
+#include "cs_lock.hh"
+
+namespace cubescript {
+
+void *malloc_alloc(void *, void *p, std::size_t, std::size_t ns) {
+    if (!ns) {
+        std::free(p);
+        return nullptr;
+    }
+    return std::realloc(p, ns);
+}
+
+/* slabs are aligned to their size, so that the header of the slab a block
+ * belongs to can be found by masking the block address
+ */
+static constexpr std::size_t SLAB_SIZE = 1 << 16;
+
+/* the size classes go in steps of 16 bytes up to 128, then each doubling
+ * of the size is split into four classes, up to SLAB_MAX
+ */
+static constexpr std::size_t SLAB_CLASSES = 20;
+static constexpr std::size_t SLAB_MAX = 1024;
+
+static constexpr std::size_t slab_class_size(std::size_t c) {
+    if (c < 8) {
+        return (c + 1) * 16;
+    }
+    c -= 8;
+    return (std::size_t(128) << (c / 4)) + (c % 4 + 1) * (32 << (c / 4));
+}
+
+static_assert(
+    slab_class_size(SLAB_CLASSES - 1) == SLAB_MAX, "bad slab size classes"
+);
+
+static inline std::size_t slab_class(std::size_t n) {
+    if (n <= 128) {
+        return (n - !!n) >> 4;
+    }
+    std::size_t g = 0;
+    std::size_t lim = 256;
+    while (n > lim) {
+        lim <<= 1;
+        ++g;
+    }
+    return 8 + g * 4 + (n - (lim >> 1) - 1) / (std::size_t(32) << g);
+}
+
+struct slab_cache;
+
+struct alignas(16) slab_hdr {
+    slab_cache *owner;
+    slab_hdr *next;
+    std::size_t cls;
+};
+
+struct slab_node {
+    slab_node *next;
+};
+
+struct slab_cache {
+    slab_heap *heap;
+    slab_cache *next = nullptr;
+    /* all slabs allocated by this cache, freed with the heap */
+    slab_hdr *slabs = nullptr;
+    /* free blocks per size class, plus the unused part of the last slab */
+    slab_node *free[SLAB_CLASSES] = {};
+    unsigned char *bump[SLAB_CLASSES] = {};
+    unsigned char *bend[SLAB_CLASSES] = {};
+    /* blocks given back by other threads, of any size class */
+    atomic_type<slab_node *> remote{nullptr};
+    /* no thread uses the cache, it may be adopted by a new one */
+    bool orphan = false;
+
+    slab_cache(slab_heap *h): heap{h} {}
+};
+
+struct slab_heap {
+    std::size_t id;
+    slab_heap *next = nullptr;
+    mutex_type mtx{};
+    slab_cache *caches = nullptr;
+};
+
+/* the registry of live heaps; threads refer to heaps by id, so that
+ * a thread exiting after a heap is gone does not touch its caches
+ */
+static mutex_type slab_reg_mtx{};
+static slab_heap *slab_heaps = nullptr;
+static std::size_t slab_next_id = 0;
+
+static void slab_release(std::size_t id, slab_cache *c) {
+    mtx_guard l{slab_reg_mtx};
+    for (auto *h = slab_heaps; h; h = h->next) {
+        if (h->id == id) {
+            mtx_guard hl{h->mtx};
+            c->orphan = true;
+            return;
+        }
+    }
+}
+
+/* the caches of the current thread, for the most recently used heaps;
+ * kept trivial so that accessing it is cheap, the caches are released
+ * on thread exit by a separate object set up on first use
+ */
+static constexpr std::size_t SLAB_TLS_CACHES = 4;
+
+struct slab_tls {
+    std::size_t ids[SLAB_TLS_CACHES];
+    slab_cache *caches[SLAB_TLS_CACHES];
+    std::size_t evict;
+};
+
+static thread_local slab_tls slab_local{};
+
+struct slab_tls_exit {
+    ~slab_tls_exit() {
+        for (std::size_t i = 0; i < SLAB_TLS_CACHES; ++i) {
+            if (slab_local.ids[i]) {
+                slab_release(slab_local.ids[i], slab_local.caches[i]);
+            }
+        }
+    }
+};
+
+static slab_cache *slab_acquire(slab_heap *h) {
+    mtx_guard l{h->mtx};
+    for (auto *c = h->caches; c; c = c->next) {
+        if (c->orphan) {
+            c->orphan = false;
+            return c;
+        }
+    }
+    auto *mem = std::malloc(sizeof(slab_cache));
+    if (!mem) {
+        return nullptr;
+    }
+    auto *c = new (mem) slab_cache{h};
+    c->next = h->caches;
+    h->caches = c;
+    return c;
+}
+
+static slab_cache *slab_get_cache(slab_heap *h) {
+    auto &tl = slab_local;
+    for (std::size_t i = 0; i < SLAB_TLS_CACHES; ++i) {
+        if (tl.ids[i] == h->id) {
+            return tl.caches[i];
+        }
+    }
+    static thread_local slab_tls_exit tl_exit;
+    static_cast<void>(tl_exit);
+    auto *c = slab_acquire(h);
+    if (!c) {
+        return nullptr;
+    }
+    auto i = tl.evict++ % SLAB_TLS_CACHES;
+    if (tl.ids[i]) {
+        slab_release(tl.ids[i], tl.caches[i]);
+    }
+    tl.ids[i] = h->id;
+    tl.caches[i] = c;
+    return c;
+}
+
+static inline slab_hdr *slab_of(void *p) {
+    return reinterpret_cast<slab_hdr *>(
+        reinterpret_cast<std::uintptr_t>(p) & ~std::uintptr_t(SLAB_SIZE - 1)
+    );
+}
+
+static void *slab_map() {
+#ifdef _WIN32
+    return _aligned_malloc(SLAB_SIZE, SLAB_SIZE);
+#else
+    return std::aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+#endif
+}
+
+static void slab_unmap(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+static bool slab_new(slab_cache *c, std::size_t cls) {
+    auto *mem = static_cast<unsigned char *>(slab_map());
+    if (!mem) {
+        return false;
+    }
+    auto *hdr = new (mem) slab_hdr{c, c->slabs, cls};
+    c->slabs = hdr;
+    auto sz = slab_class_size(cls);
+    c->bump[cls] = mem + sizeof(slab_hdr);
+    c->bend[cls] = c->bump[cls] + ((SLAB_SIZE - sizeof(slab_hdr)) / sz) * sz;
+    return true;
+}
+
+static void slab_drain(slab_cache *c) {
+    auto *n = c->remote.exchange(nullptr);
+    while (n) {
+        auto *next = n->next;
+        auto cls = slab_of(n)->cls;
+        n->next = c->free[cls];
+        c->free[cls] = n;
+        n = next;
+    }
+}
+
+static void *slab_get(slab_heap *h, std::size_t n) {
+    if (n > SLAB_MAX) {
+        return std::malloc(n);
+    }
+    auto *c = slab_get_cache(h);
+    if (!c) {
+        return nullptr;
+    }
+    auto cls = slab_class(n);
+    if (!c->free[cls]) {
+        slab_drain(c);
+    }
+    if (auto *fn = c->free[cls]; fn) {
+        c->free[cls] = fn->next;
+        return fn;
+    }
+    auto sz = slab_class_size(cls);
+    if (std::size_t(c->bend[cls] - c->bump[cls]) < sz) {
+        if (!slab_new(c, cls)) {
+            return nullptr;
+        }
+    }
+    auto *ret = c->bump[cls];
+    c->bump[cls] += sz;
+    return ret;
+}
+
+static void slab_put(slab_heap *h, void *p, std::size_t os) {
+    if (os > SLAB_MAX) {
+        std::free(p);
+        return;
+    }
+    auto *hdr = slab_of(p);
+    auto *n = static_cast<slab_node *>(p);
+    auto *c = slab_get_cache(h);
+    if (hdr->owner == c) {
+        n->next = c->free[hdr->cls];
+        c->free[hdr->cls] = n;
+        return;
+    }
+    /* return to owner */
+    auto *o = hdr->owner;
+    auto *head = o->remote.load();
+    do {
+        n->next = head;
+    } while (!o->remote.compare_exchange_weak(head, n));
+}
+
+slab_heap *slab_heap_new() {
+    auto *mem = std::malloc(sizeof(slab_heap));
+    if (!mem) {
+        throw std::bad_alloc{};
+    }
+    auto *h = new (mem) slab_heap{};
+    mtx_guard l{slab_reg_mtx};
+    h->id = ++slab_next_id;
+    h->next = slab_heaps;
+    slab_heaps = h;
+    return h;
+}
+
+void slab_heap_free(slab_heap *h) {
+    {
+        mtx_guard l{slab_reg_mtx};
+        for (auto **hp = &slab_heaps; *hp; hp = &(*hp)->next) {
+            if (*hp == h) {
+                *hp = h->next;
+                break;
+            }
+        }
+    }
+    /* stale entries of this thread would never match again anyway */
+    auto &tl = slab_local;
+    for (std::size_t i = 0; i < SLAB_TLS_CACHES; ++i) {
+        if (tl.ids[i] == h->id) {
+            tl.ids[i] = 0;
+            tl.caches[i] = nullptr;
+        }
+    }
+    auto *c = h->caches;
+    while (c) {
+        auto *s = c->slabs;
+        while (s) {
+            auto *ns = s->next;
+            slab_unmap(s);
+            s = ns;
+        }
+        auto *nc = c->next;
+        c->~slab_cache();
+        std::free(c);
+        c = nc;
+    }
+    h->~slab_heap();
+    std::free(h);
+}
+
+void *slab_alloc(void *ud, void *p, std::size_t os, std::size_t ns) {
+    auto *h = static_cast<slab_heap *>(ud);
+    if (!ns) {
+        if (p) {
+            slab_put(h, p, os);
+        }
+        return nullptr;
+    }
+    if (!p) {
+        return slab_get(h, ns);
+    }
+    if ((os > SLAB_MAX) && (ns > SLAB_MAX)) {
+        return std::realloc(p, ns);
+    }
+    if ((os <= SLAB_MAX) && (ns <= SLAB_MAX) && (
+        slab_class(os) == slab_class(ns)
+    )) {
+        return p;
+    }
+    auto *np = slab_get(h, ns);
+    if (!np) {
+        return nullptr;
+    }
+    std::memcpy(np, p, (os < ns) ? os : ns);
+    slab_put(h, p, os);
+    return np;
+}
+
+} /* namespace cubescript */
@@ -0,0 +1,33 @@
+#ifndef LIBCUBESCRIPT_ALLOC_HH
+#define LIBCUBESCRIPT_ALLOC_HH
+
+#include <cubescript/cubescript.hh>
+
+#include <cstddef>
+
+namespace cubescript {
+
+/* the builtin allocators; plain realloc and free */
+void *malloc_alloc(void *, void *p, std::size_t os, std::size_t ns);
+
+/* size-classed slab allocator
+ *
+ * small allocations are served from slabs of a single size class, which
+ * belong to a per-thread cache; the sizes come from the allocator hook,
+ * so the blocks need no headers, and a block freed by a thread other
+ * than the owner of its slab is handed back to the owner through a
+ * lock-free list, which the owner drains when it runs out of blocks;
+ * larger allocations go straight to malloc
+ *
+ * the heap is the user data of the hook and outlives the state
+ */
+struct slab_heap;
+
+slab_heap *slab_heap_new();
+void slab_heap_free(slab_heap *h);
+
+void *slab_alloc(void *ud, void *p, std::size_t os, std::size_t ns);
+
+} /* namespace cubescript */
+
+#endif
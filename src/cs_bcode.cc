@@ -1,6 +1,11 @@
+#include <algorithm>
+#include <functional>
+
 #include "cs_bcode.hh"
 #include "cs_state.hh"
 #include "cs_vm.hh"
+#include "cs_strman.hh"
+#include "cs_parser.hh"
 
 namespace cubescript {
 
@@ -56,19 +61,42 @@ LIBCUBESCRIPT_EXPORT loop_state bcode_ref::call_loop(
     state &cs, any_value &ret
 ) const {
     auto &ts = state_p{cs}.ts();
+    auto oldnat = ts.loop_native;
+    auto oldframe = ts.loop_frame;
+    /* the body signals break/continue without unwinding when it is
+     * not nested any further, see vm_exec
+     */
+    ts.loop_native = ts.native_depth + 1;
+    ts.loop_frame = 0;
     ++ts.loop_level;
+    any_value v{};
     try {
-        ret = call(cs);
+        vm_exec(ts, p_code->raw(), v);
     } catch (break_exception) {
         --ts.loop_level;
+        ts.loop_native = oldnat;
+        ts.loop_frame = oldframe;
         return loop_state::BREAK;
     } catch (continue_exception) {
         --ts.loop_level;
+        ts.loop_native = oldnat;
+        ts.loop_frame = oldframe;
         return loop_state::CONTINUE;
     } catch (...) {
         --ts.loop_level;
+        ts.loop_native = oldnat;
+        ts.loop_frame = oldframe;
         throw;
     }
+    --ts.loop_level;
+    ts.loop_native = oldnat;
+    ts.loop_frame = oldframe;
+    if (ts.loop_signal != loop_state::NORMAL) {
+        auto st = ts.loop_signal;
+        ts.loop_signal = loop_state::NORMAL;
+        return st;
+    }
+    ret = std::move(v);
     return loop_state::NORMAL;
 }
 
@@ -82,26 +110,92 @@ LIBCUBESCRIPT_EXPORT loop_state bcode_ref::call_loop(state &cs) const {
 struct bcode_hdr {
     internal_state *cs; /* needed to construct the allocator */
     std::size_t asize; /* alloc size of the bytecode block */
+    char const **strs; /* the string constants, stored after the code */
+    std::size_t nstrs;
+    std::size_t csize; /* length of the code, including BC_INST_START */
     bcode bc; /* BC_INST_START + refcount */
 };
 
-/* returned address is the 'init' member of the header */
-std::uint32_t *bcode_alloc(internal_state *cs, std::size_t sz) {
+/* returned address is the 'init' member of the header; the string
+ * constant table takes over the references from the caller
+ */
+std::uint32_t *bcode_alloc(
+    internal_state *cs, std::size_t sz,
+    char const * const *strs, std::size_t nstrs
+) {
     auto a = std_allocator<std::uint32_t>{cs};
     std::size_t hdrs = sizeof(bcode_hdr) / sizeof(std::uint32_t);
-    auto p = a.allocate(sz + hdrs - 1);
+    constexpr std::size_t pwords = bc_store_size<char const *>;
+    /* the table goes after the code, aligned for pointers */
+    std::size_t tpos = (sz + hdrs - 1 + pwords - 1) / pwords * pwords;
+    std::size_t asize = tpos + nstrs * pwords;
+    auto p = a.allocate(asize);
     bcode_hdr *hdr;
     std::memcpy(&hdr, &p, sizeof(hdr));
     hdr->cs = cs;
-    hdr->asize = sz + hdrs - 1;
+    hdr->asize = asize;
+    auto *tp = p + tpos;
+    std::memcpy(&hdr->strs, &tp, sizeof(tp));
+    hdr->nstrs = nstrs;
+    hdr->csize = sz;
+    if (nstrs) {
+        std::memcpy(hdr->strs, strs, nstrs * sizeof(char const *));
+    }
     return p + hdrs - 1;
 }
 
+static std::size_t bcode_val_len(std::uint32_t op) {
+    if ((op & BC_INST_OP_MASK) == BC_INST_VAL_INT) {
+        return 1;
+    }
+    switch (op & BC_INST_RET_MASK) {
+        case BC_RET_STRING:
+            return bc_store_size<char const *> + 1;
+        case BC_RET_INT:
+            return bc_store_size<integer_type> + 1;
+        case BC_RET_FLOAT:
+            return bc_store_size<float_type> + 1;
+        default:
+            break;
+    }
+    return 1;
+}
+
+std::size_t bcode_inst_len(std::uint32_t const *code) {
+    switch (*code & BC_INST_OP_MASK) {
+        case BC_INST_VAL:
+            return bcode_val_len(*code);
+        case BC_INST_CALL:
+        case BC_INST_COM_V:
+        case BC_INST_IDENT_U:
+        case BC_INST_LOOKUP_U:
+        case BC_INST_ALIAS_U:
+        case BC_INST_CALL_U:
+        case BC_INST_CALL_Q:
+        case BC_INST_LOOP:
+        case BC_INST_INLINE:
+            return 2;
+        case BC_INST_VAL_ALIAS:
+        case BC_INST_VAL_COM:
+            return bcode_val_len(code[1]) + 1;
+        case BC_INST_VAL_COM_V:
+            return bcode_val_len(code[1]) + 2;
+        case BC_INST_LOOKUP_VAL_COM_V:
+            return bcode_val_len(code[2]) + 3;
+        default:
+            break;
+    }
+    return 1;
+}
+
 /* bc's address must be the 'init' member of the header */
 static inline void bcode_free(std::uint32_t *bc) {
     auto *rp = bc + 1 - (sizeof(bcode_hdr) / sizeof(std::uint32_t));
     bcode_hdr *hdr;
     std::memcpy(&hdr, &rp, sizeof(hdr));
+    for (std::size_t i = 0; i < hdr->nstrs; ++i) {
+        str_managed_unref(hdr->strs[i]);
+    }
     std_allocator<std::uint32_t>{hdr->cs}.deallocate(rp, hdr->asize);
 }
 
@@ -178,4 +272,579 @@ bcode *bcode_get_empty(empty_block *empty, std::size_t val) {
     return &empty[val >> BC_INST_RET].init + 1;
 }
 
+/* bytecode images
+ *
+ * an image holds the code of a single bytecode allocation, the idents it
+ * refers to and its string constants; ident indices in the code become
+ * positions in a table of ident names, resolved again on load, and string
+ * pointers become positions in a table of strings; whatever the VM caches
+ * in the code (resolved names, quickened instructions, generations of
+ * inlined aliases) is reset
+ *
+ * inlined alias bodies that are current on save are flagged in place of
+ * the generation and come with a hash of the alias body in a table after
+ * the strings; on load, they are made current again if the alias has the
+ * same body, and are left stale otherwise
+ *
+ * the code is stored as is, so images only load on the same kind of
+ * platform; besides that, the source hash and a hash of the commands the
+ * compiler could see must match, as the generated code depends on both
+ */
+
+static constexpr char BCODE_IMAGE_MAGIC[4] = {'C', 'S', 'B', 'C'};
+static constexpr std::uint32_t BCODE_IMAGE_VERSION = 2;
+static constexpr std::uint32_t BCODE_IMAGE_ORDER = 0x01020304;
+
+struct bcode_image_hdr {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t order;
+    std::uint8_t isize, fsize, psize, pad;
+    std::uint64_t srchash;
+    std::uint64_t cmdhash;
+    std::uint64_t sum; /* of everything following the header */
+    std::uint32_t ncode;
+    std::uint32_t entry;
+    std::uint32_t nidents;
+    std::uint32_t nstrs;
+};
+
+/* FNV-1a; std::hash is not guaranteed to be the same across builds */
+std::uint64_t image_hash(std::string_view v, std::uint64_t h) {
+    for (unsigned char c: v) {
+        h ^= c;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* what the compiler knows about commands decides which code it generates
+ * (argument conversions, folding, inlining, inline loops and arithmetic),
+ * so all of it goes in; the hashes are summed, so the order of creation
+ * is irrelevant
+ */
+std::uint64_t image_cmd_hash(internal_state *cs) {
+    std::uint64_t ret = 0;
+    cs->foreach_ident([](ident *id, void *data) {
+        if (id->type() != ident_type::COMMAND) {
+            return;
+        }
+        auto *cmd = static_cast<command_impl *>(id);
+        std::int64_t info[6] = {
+            cmd->p_type, cmd->p_numargs, cmd->p_builtin,
+            cmd->p_pure, std::int64_t(cmd->p_loop), cmd->p_byname
+        };
+        char ibuf[sizeof(info)];
+        std::memcpy(ibuf, info, sizeof(info));
+        auto h = image_hash(cmd->name());
+        h = image_hash(cmd->args(), h);
+        h = image_hash(std::string_view{ibuf, sizeof(ibuf)}, h);
+        *static_cast<std::uint64_t *>(data) += h;
+    }, &ret);
+    return ret;
+}
+
+/* instructions with an ident index in D */
+static bool image_inst_ident(std::uint32_t op) {
+    switch (op & BC_INST_OP_MASK) {
+        case BC_INST_IDENT:
+        case BC_INST_LOOKUP:
+        case BC_INST_VAR:
+        case BC_INST_ALIAS:
+        case BC_INST_CALL:
+        case BC_INST_COM:
+        case BC_INST_COM_V:
+        case BC_INST_LOOKUP_RESULT:
+        case BC_INST_VAL_ALIAS:
+        case BC_INST_VAL_COM:
+        case BC_INST_VAL_COM_V:
+        case BC_INST_LOOKUP_VAL_COM_V:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+/* the position of the string pointer within the instruction, or zero */
+static std::size_t image_inst_str(std::uint32_t const *code) {
+    std::size_t vpos;
+    switch (*code & BC_INST_OP_MASK) {
+        case BC_INST_VAL:
+            vpos = 0;
+            break;
+        case BC_INST_VAL_ALIAS:
+        case BC_INST_VAL_COM:
+        case BC_INST_VAL_COM_V:
+            vpos = 1;
+            break;
+        case BC_INST_LOOKUP_VAL_COM_V:
+            vpos = 2;
+            break;
+        default:
+            return 0;
+    }
+    auto vop = code[vpos];
+    if (
+        ((vop & BC_INST_OP_MASK) != BC_INST_VAL) ||
+        ((vop & BC_INST_RET_MASK) != BC_RET_STRING)
+    ) {
+        return 0;
+    }
+    return vpos + 1;
+}
+
+/* instructions followed by a name cache word */
+static bool image_inst_cache(std::uint32_t op) {
+    switch (op & BC_INST_OP_MASK) {
+        case BC_INST_IDENT_U:
+        case BC_INST_LOOKUP_U:
+        case BC_INST_ALIAS_U:
+        case BC_INST_CALL_U:
+        case BC_INST_CALL_Q:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+/* the hash of the body the alias would be inlined with by the calling
+ * thread, under the same conditions as in gen_inline
+ */
+static bool image_inline_hash(
+    thread_state &ts, alias_impl *a, std::uint64_t &h
+) {
+    if (a->is_arg() || a->p_shadows) {
+        return false;
+    }
+    auto &ast = ts.get_astack(a);
+    if ((ast.node != &a->p_initial) || ast.flags) {
+        return false;
+    }
+    auto const &val = a->p_initial.val_s;
+    if (val.type() != value_type::STRING) {
+        return false;
+    }
+    h = image_hash(val.get_string(*ts.pstate).view());
+    return true;
+}
+
+void image_put(charbuf &buf, void const *p, std::size_t n) {
+    auto *cp = static_cast<char const *>(p);
+    buf.append(cp, cp + n);
+}
+
+void image_put_str(charbuf &buf, std::string_view v) {
+    std::uint32_t len = std::uint32_t(v.size());
+    image_put(buf, &len, sizeof(len));
+    buf.append(v);
+}
+
+bool image_reader::get(void *p, std::size_t n) {
+    if (data.size() < n) {
+        return false;
+    }
+    std::memcpy(p, data.data(), n);
+    data.remove_prefix(n);
+    return true;
+}
+
+bool image_reader::get_str(std::string_view &v) {
+    std::uint32_t len;
+    if (!get(&len, sizeof(len)) || (data.size() < len)) {
+        return false;
+    }
+    v = data.substr(0, len);
+    data.remove_prefix(len);
+    return true;
+}
+
+void bcode_save(
+    thread_state &ts, bcode *bc, std::string_view src,
+    std::uint64_t cmdhash, charbuf &buf
+) {
+    auto *cs = ts.istate;
+    if (!bc) {
+        bc = bcode_get_empty(cs->empty, BC_RET_NULL);
+    }
+    /* find the start of the allocation, like bcode_addref */
+    auto *code = bc->raw();
+    auto *top = code;
+    if ((*code & BC_INST_OP_MASK) != BC_INST_START) {
+        if ((code[-1] & BC_INST_OP_MASK) == BC_INST_START) {
+            top = code - 1;
+        } else {
+            top = code - std::ptrdiff_t(code[-1] >> 8);
+        }
+    }
+    std::size_t csize = 2;
+    char const * const *tstrs = nullptr;
+    std::size_t ntstrs = 0;
+    bool is_empty = false;
+    for (std::size_t i = 0; i < VAL_ANY; ++i) {
+        if (top == cs->empty[i].init.raw()) {
+            is_empty = true;
+            break;
+        }
+    }
+    if (!is_empty) {
+        auto *rp = top + 1 - (sizeof(bcode_hdr) / sizeof(std::uint32_t));
+        bcode_hdr *hdr;
+        std::memcpy(&hdr, &rp, sizeof(hdr));
+        csize = hdr->csize;
+        tstrs = hdr->strs;
+        ntstrs = hdr->nstrs;
+    }
+    /* the VM may be rewriting cache words meanwhile */
+    valbuf<std::uint32_t> ncode{cs};
+    ncode.resize(csize);
+    ncode[0] = BC_INST_START;
+    for (std::size_t i = 1; i < csize; ++i) {
+        ncode[i] = atomic_word_load(&top[i]);
+    }
+    /* the strings in order of appearance, without duplicates; they are
+     * looked up in a copy of the table sorted by address
+     */
+    valbuf<std::pair<char const *, std::uint32_t>> smap{cs};
+    for (std::size_t i = 0; i < ntstrs; ++i) {
+        smap.emplace_back(tstrs[i], 0);
+    }
+    std::sort(smap.buf.begin(), smap.buf.end(), [](auto &a, auto &b) {
+        return std::less<char const *>{}(a.first, b.first);
+    });
+    valbuf<char const *> strs{cs};
+    /* ident index -> position in the ident table + 1 */
+    valbuf<std::uint32_t> idmap{cs};
+    idmap.resize(cs->identnum.load(), 0);
+    valbuf<ident *> ids{cs};
+    valbuf<std::uint64_t> ihashes{cs};
+    auto reloc = [&](std::uint32_t &op) {
+        auto idx = op >> 8;
+        if (!idmap[idx]) {
+            ids.push_back(cs->lookup_ident(idx));
+            idmap[idx] = std::uint32_t(ids.size());
+        }
+        op = (op & 0xFF) | ((idmap[idx] - 1) << 8);
+    };
+    for (std::size_t i = 1; i < csize; i += bcode_inst_len(&ncode[i])) {
+        auto *ip = &ncode[i];
+        auto op = *ip;
+        if ((op & BC_INST_OP_MASK) == BC_INST_CALL_Q) {
+            *ip = (op & ~std::uint32_t(BC_INST_OP_MASK)) | BC_INST_CALL_U;
+        }
+        if (image_inst_cache(op)) {
+            ip[1] &= BC_CACHE_LITERAL;
+        } else if ((op & BC_INST_OP_MASK) == BC_INST_INLINE) {
+            /* the call after the body is not relocated yet */
+            auto *a = static_cast<alias_impl *>(static_cast<alias *>(
+                cs->lookup_ident(ip[(op >> 8) + 2] >> 8)
+            ));
+            std::uint64_t h;
+            bool cur = (a->p_gen.load() == ip[1]);
+            ip[1] = cur && image_inline_hash(ts, a, h);
+            if (ip[1]) {
+                ihashes.push_back(h);
+            }
+        }
+        if (image_inst_ident(op)) {
+            reloc(ip[0]);
+        }
+        if ((op & BC_INST_OP_MASK) == BC_INST_LOOKUP_VAL_COM_V) {
+            reloc(ip[1]);
+        }
+        if (auto spos = image_inst_str(ip); spos) {
+            char const *str;
+            std::memcpy(&str, &ip[spos], sizeof(str));
+            auto &sm = *std::lower_bound(
+                smap.buf.begin(), smap.buf.end(), str, [](auto &a, auto b) {
+                    return std::less<char const *>{}(a.first, b);
+                }
+            );
+            if (!sm.second) {
+                strs.push_back(str);
+                sm.second = std::uint32_t(strs.size());
+            }
+            std::uintptr_t sidx = sm.second - 1;
+            std::memcpy(&ip[spos], &sidx, sizeof(sidx));
+        }
+    }
+    /* header last, once the rest is summed up */
+    auto start = buf.size();
+    buf.resize(start + sizeof(bcode_image_hdr));
+    image_put(buf, ncode.data(), csize * sizeof(std::uint32_t));
+    for (auto *id: ids.buf) {
+        std::uint32_t tp[2] = {std::uint32_t(id->type()), 0};
+        if (id->type() == ident_type::VAR) {
+            tp[1] = std::uint32_t(static_cast<var_impl *>(id)->p_storage.type());
+        }
+        image_put(buf, tp, sizeof(tp));
+        image_put_str(buf, id->name());
+    }
+    for (auto *str: strs.buf) {
+        image_put_str(buf, str_managed_view(str));
+    }
+    image_put(buf, ihashes.data(), ihashes.size() * sizeof(std::uint64_t));
+    bcode_image_hdr hdr;
+    std::memcpy(hdr.magic, BCODE_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = BCODE_IMAGE_VERSION;
+    hdr.order = BCODE_IMAGE_ORDER;
+    hdr.isize = sizeof(integer_type);
+    hdr.fsize = sizeof(float_type);
+    hdr.psize = sizeof(void *);
+    hdr.pad = 0;
+    hdr.srchash = image_hash(src);
+    hdr.cmdhash = cmdhash;
+    hdr.sum = image_hash(buf.str().substr(start + sizeof(hdr)));
+    hdr.ncode = std::uint32_t(csize);
+    hdr.entry = std::uint32_t(code - top);
+    hdr.nidents = std::uint32_t(ids.size());
+    hdr.nstrs = std::uint32_t(strs.size());
+    std::memcpy(buf.data() + start, &hdr, sizeof(hdr));
+}
+
+/* checks that the code can be run safely, i.e. that all instructions,
+ * jumps and table references stay in bounds; the code has a few words of
+ * padding at the end, so that instruction lengths can be read
+ */
+static bool image_check(
+    std::uint32_t const *code, std::size_t ncode,
+    std::size_t nids, std::size_t nstrs
+) {
+    for (std::size_t i = 1; i < ncode;) {
+        auto *ip = &code[i];
+        auto op = *ip;
+        auto len = bcode_inst_len(ip);
+        if ((i + len) > ncode) {
+            return false;
+        }
+        auto d = std::size_t(op >> 8);
+        switch (op & BC_INST_OP_MASK) {
+            case BC_INST_OFFSET:
+                /* points back at the start */
+                if (d != (i + 1)) {
+                    return false;
+                }
+                break;
+            case BC_INST_JUMP:
+            case BC_INST_JUMP_B:
+            case BC_INST_JUMP_RESULT:
+                if ((i + 1 + d) >= ncode) {
+                    return false;
+                }
+                break;
+            case BC_INST_BLOCK:
+                if ((i + 1 + d) > ncode) {
+                    return false;
+                }
+                break;
+            case BC_INST_LOOP:
+                if ((i + 3 + d) >= ncode) {
+                    return false;
+                }
+                break;
+            case BC_INST_LOOP_NEXT:
+                if (d >= i) {
+                    return false;
+                }
+                break;
+            case BC_INST_INLINE:
+                /* the fallback call must be there to look at */
+                if (((i + 2 + d + 2) > ncode) || (
+                    (code[i + 2 + d] & BC_INST_OP_MASK) != BC_INST_CALL
+                ) || ((code[i + 2 + d] >> 8) >= nids)) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+        if (image_inst_ident(op) && (d >= nids)) {
+            return false;
+        }
+        if (
+            ((op & BC_INST_OP_MASK) == BC_INST_LOOKUP_VAL_COM_V) &&
+            ((ip[1] >> 8) >= nids)
+        ) {
+            return false;
+        }
+        if (auto spos = image_inst_str(ip); spos) {
+            std::uintptr_t sidx;
+            std::memcpy(&sidx, &ip[spos], sizeof(sidx));
+            if (sidx >= nstrs) {
+                return false;
+            }
+        }
+        i += len;
+    }
+    return true;
+}
+
+/* checks that the idents the instruction refers to are of the kind it
+ * expects, as the VM casts them without looking
+ */
+static bool image_check_idents(std::uint32_t const *ip, ident *const *ids) {
+    auto is = [ids](std::uint32_t w, ident_type tp) {
+        return (ids[w >> 8]->type() == tp);
+    };
+    auto op = *ip;
+    switch (op & BC_INST_OP_MASK) {
+        case BC_INST_VAR:
+            return is(op, ident_type::VAR);
+        case BC_INST_LOOKUP:
+        case BC_INST_ALIAS:
+        case BC_INST_CALL:
+        case BC_INST_LOOKUP_RESULT:
+        case BC_INST_VAL_ALIAS:
+            return is(op, ident_type::ALIAS);
+        case BC_INST_LOOKUP_VAL_COM_V:
+            if (!is(ip[1], ident_type::ALIAS)) {
+                return false;
+            }
+            [[fallthrough]];
+        case BC_INST_COM:
+        case BC_INST_COM_V:
+        case BC_INST_VAL_COM:
+        case BC_INST_VAL_COM_V:
+            /* the ones compiled into other instructions have no callback */
+            return is(op, ident_type::COMMAND) && bool(
+                static_cast<command_impl *>(ids[op >> 8])->p_cb_cftv
+            );
+        case BC_INST_INLINE:
+            /* inlined calls look at the generation of the alias */
+            return is(ip[(op >> 8) + 2], ident_type::ALIAS);
+        default:
+            break;
+    }
+    return true;
+}
+
+bcode_ref bcode_load(
+    thread_state &ts, std::string_view img, std::string_view src,
+    std::uint64_t cmdhash
+) {
+    auto *cs = ts.istate;
+    image_reader rd{img};
+    bcode_image_hdr hdr;
+    if (!rd.get(&hdr, sizeof(hdr))) {
+        return bcode_ref{};
+    }
+    if (
+        std::memcmp(hdr.magic, BCODE_IMAGE_MAGIC, sizeof(hdr.magic)) ||
+        (hdr.version != BCODE_IMAGE_VERSION) ||
+        (hdr.order != BCODE_IMAGE_ORDER) ||
+        (hdr.isize != sizeof(integer_type)) ||
+        (hdr.fsize != sizeof(float_type)) ||
+        (hdr.psize != sizeof(void *)) ||
+        (hdr.srchash != image_hash(src)) ||
+        (hdr.sum != image_hash(rd.data)) ||
+        (hdr.ncode < 2) || (hdr.entry == 0) || (hdr.entry >= hdr.ncode) ||
+        (hdr.cmdhash != cmdhash)
+    ) {
+        return bcode_ref{};
+    }
+    /* padded for image_check */
+    valbuf<std::uint32_t> code{cs};
+    code.resize(std::size_t(hdr.ncode) + 3, 0);
+    if (!rd.get(code.data(), hdr.ncode * sizeof(std::uint32_t))) {
+        return bcode_ref{};
+    }
+    if (!image_check(code.data(), hdr.ncode, hdr.nidents, hdr.nstrs)) {
+        return bcode_ref{};
+    }
+    /* resolve the idents, creating aliases like the parser would */
+    valbuf<ident *> ids{cs};
+    for (std::uint32_t i = 0; i < hdr.nidents; ++i) {
+        std::uint32_t tp[2];
+        std::string_view name;
+        if (!rd.get(tp, sizeof(tp)) || !rd.get_str(name)) {
+            return bcode_ref{};
+        }
+        ident *id;
+        if (tp[0] == std::uint32_t(ident_type::ALIAS)) {
+            if (!is_valid_name(name)) {
+                return bcode_ref{};
+            }
+            id = &cs->new_ident(*ts.pstate, name, IDENT_FLAG_UNKNOWN);
+        } else {
+            id = cs->get_ident(name);
+        }
+        if (!id || (std::uint32_t(id->type()) != tp[0])) {
+            return bcode_ref{};
+        }
+        if ((id->type() == ident_type::VAR) && (std::uint32_t(
+            static_cast<var_impl *>(id)->p_storage.type()
+        ) != tp[1])) {
+            return bcode_ref{};
+        }
+        ids.push_back(id);
+    }
+    for (std::size_t i = 1; i < hdr.ncode; i += bcode_inst_len(&code[i])) {
+        if (!image_check_idents(&code[i], ids.data())) {
+            return bcode_ref{};
+        }
+    }
+    valbuf<std::string_view> svals{cs};
+    for (std::uint32_t i = 0; i < hdr.nstrs; ++i) {
+        if (!rd.get_str(svals.emplace_back())) {
+            return bcode_ref{};
+        }
+    }
+    /* one body hash for every inlined call flagged as current */
+    valbuf<std::uint64_t> ihashes{cs};
+    for (std::size_t i = 1; i < hdr.ncode; i += bcode_inst_len(&code[i])) {
+        if (
+            ((code[i] & BC_INST_OP_MASK) == BC_INST_INLINE) && code[i + 1] &&
+            !rd.get(&ihashes.emplace_back(), sizeof(std::uint64_t))
+        ) {
+            return bcode_ref{};
+        }
+    }
+    /* everything is known to be good, so nothing can fail from here on */
+    valbuf<char const *> strs{cs};
+    for (auto &v: svals.buf) {
+        strs.push_back(cs->strman->add(v));
+    }
+    auto reloc = [&ids](std::uint32_t &op) {
+        op = (op & 0xFF) | std::uint32_t(ids[op >> 8]->index() << 8);
+    };
+    std::size_t ihash = 0;
+    for (std::size_t i = 1; i < hdr.ncode; i += bcode_inst_len(&code[i])) {
+        auto *ip = &code[i];
+        auto op = *ip;
+        if ((op & BC_INST_OP_MASK) == BC_INST_INLINE) {
+            auto *a = static_cast<alias_impl *>(static_cast<alias *>(
+                ids[ip[(op >> 8) + 2] >> 8]
+            ));
+            auto gen = a->p_gen.load();
+            std::uint64_t h;
+            bool cur = ip[1] && image_inline_hash(ts, a, h) && (
+                h == ihashes[ihash]
+            );
+            ihash += !!ip[1];
+            /* a copied body not matching the alias here must not be used
+             * until the alias changes for about 2^32 times
+             */
+            ip[1] = cur ? gen : (gen - 1);
+        }
+        if (image_inst_ident(op)) {
+            reloc(ip[0]);
+        }
+        if ((op & BC_INST_OP_MASK) == BC_INST_LOOKUP_VAL_COM_V) {
+            reloc(ip[1]);
+        }
+        if (auto spos = image_inst_str(ip); spos) {
+            std::uintptr_t sidx;
+            std::memcpy(&sidx, &ip[spos], sizeof(sidx));
+            std::memcpy(&ip[spos], &strs[sidx], sizeof(char const *));
+        }
+    }
+    auto *cp = bcode_alloc(cs, hdr.ncode, strs.data(), strs.size());
+    std::memcpy(cp, code.data(), hdr.ncode * sizeof(std::uint32_t));
+    cp += hdr.entry;
+    bcode *b;
+    std::memcpy(&b, &cp, sizeof(b));
+    return bcode_p::make_ref(b);
+}
+
 } /* namespace cubescript */
@@ -9,6 +9,8 @@
 namespace cubescript {
 
 struct internal_state;
+struct thread_state;
+struct charbuf;
 
 struct bcode {
     std::uint32_t init;
@@ -33,6 +35,18 @@ constexpr std::size_t bc_store_size = (
     sizeof(T) - 1
 ) / sizeof(std::uint32_t) + 1;
 
+/* the instructions taking an ident name from the stack (BC_INST_*_U) are
+ * followed by a cache word; it holds the index + 1 of the ident the name
+ * resolved to the last time, or zero if not resolved yet, and the VM uses
+ * it as long as the name stays the same (names are interned, so it only
+ * needs to compare the addresses); for calls by literal name, the cache
+ * word is marked with BC_CACHE_LITERAL
+ */
+enum {
+    BC_CACHE_LITERAL = 1U << 31,
+    BC_CACHE_MASK = BC_CACHE_LITERAL - 1
+};
+
 /* instructions consist of:
  *
  * [D 24][M 2][O 6] == I
@@ -74,7 +88,9 @@ enum {
     BC_INST_FORCE,
     /* duplicate top of the stack according to M */
     BC_INST_DUP,
-    /* push value after I on the stack according to M (length D if string) */
+    /* push value after I on the stack according to M; strings are stored
+     * as a pointer to a managed string held by the bytecode's constant table
+     */
     BC_INST_VAL,
     /* push value inside D on the stack according to M
      *
@@ -168,6 +184,89 @@ enum {
      */
     BC_INST_COM_V,
 
+    /* superinstructions; these are never emitted directly by the generator,
+     * but produced by its peephole pass from frequent instruction sequences
+     * and they behave exactly like the sequences they replace
+     */
+
+    /* lookup the alias with index D and set R to its value according to M
+     * (replaces BC_INST_LOOKUP without type mask + BC_INST_RESULT)
+     */
+    BC_INST_LOOKUP_RESULT,
+    /* set alias with index D to the value of the BC_INST_VAL or
+     * BC_INST_VAL_INT following I (replaces BC_INST_VAL* + BC_INST_ALIAS)
+     */
+    BC_INST_VAL_ALIAS,
+    /* push the value of the BC_INST_VAL or BC_INST_VAL_INT following I,
+     * then call builtin command with index D like BC_INST_COM
+     */
+    BC_INST_VAL_COM,
+    /* like above, but the arg count follows the value like in BC_INST_COM_V
+     * (replaces BC_INST_VAL* + BC_INST_COM_V)
+     */
+    BC_INST_VAL_COM_V,
+    /* like above, but a BC_INST_LOOKUP goes before the value, i.e. it
+     * replaces BC_INST_LOOKUP + BC_INST_VAL* + BC_INST_COM_V
+     */
+    BC_INST_LOOKUP_VAL_COM_V,
+
+    /* quickened instructions; these are rewritten in place by the VM from
+     * the instructions they are based on once it is safe to do so
+     */
+
+    /* BC_INST_CALL_U with a literal name that has already been resolved,
+     * the cache word is used without checking the name
+     */
+    BC_INST_CALL_Q,
+
+    /* inline builtins */
+
+    /* pop 2 values off the stack (top being last) and apply the arithmetic
+     * or comparison D (MATH_* from cs_math.hh) to them, like the builtin
+     * command would; the values are already converted to the right type,
+     * the result goes in R according to M
+     */
+    BC_INST_ARITH,
+
+    /* inline loops; the builtin's argument blocks are laid out in place, the
+     * first one starting with BC_INST_LOOP and the body ending in
+     * BC_INST_LOOP_NEXT, with the loop running in its own frame
+     */
+
+    /* pop the loop arguments off the stack as given by the BC_LOOP_*
+     * descriptor following I, set up the loop and run the code following
+     * the descriptor; if the loop does not run at all, jump past the
+     * BC_INST_LOOP_NEXT, which is D instructions after the descriptor
+     */
+    BC_INST_LOOP,
+    /* end of the loop condition (replaces its BC_INST_EXIT): force R
+     * according to M, if considered false, leave the loop, otherwise skip
+     * the BC_INST_BLOCK and BC_INST_OFFSET of the body that follow
+     */
+    BC_INST_LOOP_COND,
+    /* end of the loop body (replaces its BC_INST_EXIT): advance the loop
+     * and jump back by D instructions to the code following the descriptor,
+     * or leave the loop when done
+     */
+    BC_INST_LOOP_NEXT,
+
+    /* inlined alias calls; the body of a small alias is copied in place
+     * of the call, followed by the BC_INST_CALL it replaces, which is used
+     * as a fallback whenever the copy is stale
+     */
+
+    /* if the generation of the alias called by the BC_INST_CALL found D
+     * instructions after the generation word following I still matches
+     * that word, run the copied body after the word in a frame taking over
+     * the call's arguments, then continue after the BC_INST_CALL; else
+     * jump to the BC_INST_CALL
+     */
+    BC_INST_INLINE,
+    /* push the D-th argument of the innermost inlined call according to M
+     * (replaces BC_INST_LOOKUP of an argument alias in inlined bodies)
+     */
+    BC_INST_ARG,
+
     /* opcode mask */
     BC_INST_OP_MASK = 0x3F,
     /* type mask shift */
@@ -186,7 +285,32 @@ enum {
     BC_INST_FLAG_FALSE = 0 << BC_INST_RET
 };
 
-std::uint32_t *bcode_alloc(internal_state *cs, std::size_t sz);
+/* the descriptor of BC_INST_LOOP; the loop may have a condition block
+ * before the body, and sets up to 3 idents (shift BC_LOOP_VARS) to either
+ * the items of a list or a counter; a counted loop gets the offset, count
+ * and step from the integers pushed after its ident, their positions being
+ * stored in the descriptor (1-based, 0 meaning the default)
+ */
+enum {
+    BC_LOOP_COND = 1 << 0,
+    BC_LOOP_LIST = 1 << 1,
+    /* shifts of the 2-bit fields */
+    BC_LOOP_VARS = 2,
+    BC_LOOP_OFFSET = 4,
+    BC_LOOP_COUNT = 6,
+    BC_LOOP_STEP = 8
+};
+
+std::uint32_t *bcode_alloc(
+    internal_state *cs, std::size_t sz,
+    char const * const *strs, std::size_t nstrs
+);
+
+/* length of the instruction at the given position, including any data
+ * stored after it; the contents of BC_INST_BLOCK are not included, as
+ * they are instructions of their own
+ */
+std::size_t bcode_inst_len(std::uint32_t const *code);
 
 void bcode_addref(std::uint32_t *code);
 void bcode_unref(std::uint32_t *code);
@@ -200,6 +324,36 @@ empty_block *bcode_init_empty(internal_state *cs);
 void bcode_free_empty(internal_state *cs, empty_block *empty);
 bcode *bcode_get_empty(empty_block *empty, std::size_t val);
 
+/* bytecode images, see state::save_code() and state::load_code(); the
+ * image is appended to the buffer, and a null reference is returned when
+ * the image cannot be used; the hash of the commands is passed in, as it
+ * takes a walk over all idents and may be shared by many images
+ */
+void bcode_save(
+    thread_state &ts, bcode *bc, std::string_view src,
+    std::uint64_t cmdhash, charbuf &buf
+);
+bcode_ref bcode_load(
+    thread_state &ts, std::string_view img, std::string_view src,
+    std::uint64_t cmdhash
+);
+
+/* helpers for the image formats, which are native-endian */
+std::uint64_t image_hash(
+    std::string_view v, std::uint64_t h = 0xCBF29CE484222325ULL
+);
+std::uint64_t image_cmd_hash(internal_state *cs);
+
+void image_put(charbuf &buf, void const *p, std::size_t n);
+void image_put_str(charbuf &buf, std::string_view v);
+
+struct image_reader {
+    std::string_view data;
+
+    bool get(void *p, std::size_t n);
+    bool get_str(std::string_view &v);
+};
+
 struct bcode_p {
     bcode_p(bcode_ref const &r): br{const_cast<bcode_ref *>(&r)} {}
 
@@ -6,6 +6,7 @@
 
 #include "cs_ident.hh"
 #include "cs_parser.hh"
+#include "cs_vm.hh"
 
 namespace cubescript {
 
@@ -24,8 +25,15 @@ std::uint32_t gen_state::peek(std::size_t idx) const {
     return code[idx];
 }
 
+gen_state::~gen_state() {
+    for (auto *s: strs.buf) {
+        str_managed_unref(s);
+    }
+}
+
 bcode_ref gen_state::steal_ref() {
-    auto *cp = bcode_alloc(ts.istate, code.size());
+    auto *cp = bcode_alloc(ts.istate, code.size(), strs.data(), strs.size());
+    strs.clear();
     std::memcpy(cp, code.data(), code.size() * sizeof(std::uint32_t));
     bcode *b;
     cp += 1;
@@ -57,10 +65,45 @@ void gen_state::gen_not(int ltype) {
     code.push_back(BC_INST_NOT | ret_code(ltype));
 }
 
-bool gen_state::gen_if(std::size_t tpos, std::size_t fpos, int ltype) {
+bool gen_state::gen_if(
+    std::size_t cpos, std::size_t tpos, std::size_t fpos, int ltype
+) {
+    /* constant condition: keep only the branch that is taken, as long as
+     * the other one has no side effects (i.e. it is a block or nothing)
+     */
+    arenabuf<any_value> cond{ts.arena};
+    if (fold_values(cpos, tpos, cond) && (cond.size() == 1)) {
+        auto tend = fpos ? fpos : count();
+        auto quiet = [this](std::size_t pos, std::size_t epos) {
+            return is_block(pos, epos) || (
+                (epos == (pos + 1)) && (code[pos] == BC_INST_EMPTY)
+            );
+        };
+        if (cond[0].get_bool()) {
+            if (is_block(tpos, tend) && (!fpos || quiet(fpos, count()))) {
+                code.resize(tend);
+                drop(cpos, tpos + 1);
+                code[cpos] = BC_INST_ENTER_RESULT;
+                code.back() = (code.back() & ~BC_INST_RET_MASK) | ret_code(
+                    ltype
+                );
+                return true;
+            }
+        } else if (!fpos) {
+            if (quiet(tpos, tend)) {
+                code.resize(cpos);
+                return true;
+            }
+        } else if (quiet(tpos, fpos) && is_block(fpos)) {
+            drop(cpos, fpos + 1);
+            code[cpos] = BC_INST_ENTER_RESULT;
+            code.back() = (code.back() & ~BC_INST_RET_MASK) | ret_code(ltype);
+            return true;
+        }
+    }
     auto inst1 = code[tpos];
     auto op1 = inst1 & ~BC_INST_RET_MASK;
-    auto tlen = std::uint32_t(fpos - tpos - 1);
+    auto tlen = std::uint32_t((fpos ? fpos : count()) - tpos - 1);
     if (!fpos) {
         if (is_block(tpos, fpos)) {
             code[tpos] = (tlen << 8) | BC_INST_JUMP_B | BC_INST_FLAG_FALSE;
@@ -122,6 +165,195 @@ void gen_state::gen_and_or(bool is_or, std::size_t start, int ltype) {
     }
 }
 
+/* turns the trailing blocks of a loop builtin into an inline loop; the
+ * first block starts with the loop setup and the body jumps back to it,
+ * with the result of the builtin being none like when it is called
+ */
+bool gen_state::gen_loop(
+    std::uint32_t desc, std::size_t cpos, std::size_t bpos, int ltype
+) {
+    if (!is_block(bpos) || ((desc & BC_LOOP_COND) && !is_block(cpos, bpos))) {
+        return false;
+    }
+    auto lpos = (desc & BC_LOOP_COND) ? cpos : bpos;
+    auto npos = count() - 1;
+    auto len = std::uint32_t(npos - lpos - 2);
+    code[lpos] = BC_INST_LOOP | (len << 8);
+    code[lpos + 1] = desc;
+    if (desc & BC_LOOP_COND) {
+        code[bpos - 1] = BC_INST_LOOP_COND | (
+            code[bpos - 1] & BC_INST_RET_MASK
+        );
+    }
+    code[npos] = BC_INST_LOOP_NEXT | (len << 8) | (
+        code[npos] & BC_INST_RET_MASK
+    );
+    gen_result_null(ltype);
+    return true;
+}
+
+/* compile-time evaluation; the values pushed by the code since a position
+ * are decoded, and if they are all constant, the code is replaced with the
+ * result, which goes in R just like with the instructions it replaces
+ */
+
+static void fold_force(state &cs, any_value &v, std::uint32_t op) {
+    switch (op & BC_INST_RET_MASK) {
+        case BC_RET_STRING:
+            v.force_string(cs);
+            break;
+        case BC_RET_INT:
+            v.force_integer();
+            break;
+        case BC_RET_FLOAT:
+            v.force_float();
+            break;
+    }
+}
+
+bool gen_state::fold_values(
+    std::size_t start, std::size_t end, arenabuf<any_value> &vals
+) {
+    auto &cs = *ts.pstate;
+    while (start < end) {
+        switch (code[start] & BC_INST_OP_MASK) {
+            case BC_INST_VAL:
+            case BC_INST_VAL_INT:
+                break;
+            default:
+                return false;
+        }
+        auto &v = vals.emplace_back();
+        start = std::size_t(vm_get_val(cs, &code[start], v) - &code[0]);
+        /* an expression in parens that was folded already */
+        if (
+            ((start + 1) < end) &&
+            ((code[start] & BC_INST_OP_MASK) == BC_INST_RESULT) &&
+            ((code[start + 1] & BC_INST_OP_MASK) == BC_INST_RESULT_ARG)
+        ) {
+            fold_force(cs, v, code[start]);
+            fold_force(cs, v, code[start + 1]);
+            start += 2;
+        }
+    }
+    return true;
+}
+
+bool gen_state::fold_result(std::size_t start, any_value &v, int ltype) {
+    switch (v.type()) {
+        case value_type::NONE:
+            code.resize(start);
+            gen_val_null();
+            break;
+        case value_type::INTEGER:
+            code.resize(start);
+            gen_val_integer(v.get_integer());
+            break;
+        case value_type::FLOAT:
+            code.resize(start);
+            gen_val_float(v.get_float());
+            break;
+        case value_type::STRING:
+            code.resize(start);
+            gen_val_string(v.get_string(*ts.pstate));
+            break;
+        default:
+            return false;
+    }
+    gen_result(ltype);
+    return true;
+}
+
+/* the block offsets are absolute, so the ones after the code need fixing */
+void gen_state::drop(std::size_t beg, std::size_t end) {
+    auto n = end - beg;
+    auto nsize = count() - n;
+    std::memmove(
+        &code[beg], &code[end], (nsize - beg) * sizeof(std::uint32_t)
+    );
+    code.resize(nsize);
+    for (std::size_t i = beg; i < nsize; i += bcode_inst_len(&code[i])) {
+        if ((code[i] & BC_INST_OP_MASK) == BC_INST_OFFSET) {
+            code[i] -= std::uint32_t(n << 8);
+        }
+    }
+}
+
+bool gen_state::fold_call(
+    std::size_t start, command_impl &id, std::uint32_t nargs, int ltype
+) {
+    arenabuf<any_value> args{ts.arena};
+    if (!fold_values(start, count(), args) || (args.size() != nargs)) {
+        return false;
+    }
+    any_value res{};
+    try {
+        id.call_id(ts, span_type<any_value>{args.data(), args.size()}, res);
+    } catch (error const &) {
+        /* leave it to run time */
+        return false;
+    }
+    return fold_result(start, res, ltype);
+}
+
+bool gen_state::fold_not(std::size_t start, int ltype) {
+    arenabuf<any_value> args{ts.arena};
+    if (!fold_values(start, count(), args) || (args.size() != 1)) {
+        return false;
+    }
+    any_value res{};
+    res.set_integer(!args[0].get_bool());
+    return fold_result(start, res, ltype);
+}
+
+/* like gen_and_or; the first argument is evaluated eagerly, so it may be
+ * a plain value, while the rest are blocks that consist of a constant
+ */
+bool gen_state::fold_and_or(
+    bool is_or, std::size_t first, std::size_t start, int ltype
+) {
+    auto &cs = *ts.pstate;
+    arenabuf<any_value> vals{ts.arena};
+    auto fold_block = [this, &vals](std::size_t pos) -> std::size_t {
+        auto len = std::size_t(code[pos] >> 8);
+        auto end = pos + len;
+        if (
+            (len < 3) || (end >= count()) || !is_block(pos, end + 1) ||
+            ((code[end - 1] & BC_INST_OP_MASK) != BC_INST_RESULT) ||
+            ((code[end] & BC_INST_OP_MASK) != BC_INST_EXIT)
+        ) {
+            return 0;
+        }
+        auto nvals = vals.size();
+        if (!fold_values(pos + 2, end - 1, vals) || (
+            vals.size() != (nvals + 1)
+        )) {
+            return 0;
+        }
+        fold_force(*ts.pstate, vals.back(), code[end - 1]);
+        return end + 1;
+    };
+    if ((code[first] & BC_INST_OP_MASK) == BC_INST_BLOCK) {
+        if (fold_block(first) != start) {
+            return false;
+        }
+        fold_force(cs, vals.back(), code[start - 1]);
+    } else if (!fold_values(first, start, vals) || (vals.size() != 1)) {
+        return false;
+    }
+    for (auto i = start; i < count();) {
+        i = fold_block(i);
+        if (!i) {
+            return false;
+        }
+    }
+    std::size_t n = 0;
+    while (((n + 1) < vals.size()) && (vals[n].get_bool() != is_or)) {
+        ++n;
+    }
+    return fold_result(first, vals[n], ltype);
+}
+
 void gen_state::gen_val_null() {
     code.push_back(BC_INST_VAL_INT | BC_RET_NULL);
 }
@@ -181,53 +413,43 @@ void gen_state::gen_val_string(std::string_view v) {
         code.push_back(op);
         return;
     }
-    code.push_back(BC_INST_VAL | BC_RET_STRING | std::uint32_t(vsz << 8));
-    std::uint32_t *wp;
-    auto *sp = v.data();
-    std::memcpy(&wp, &sp, sizeof(wp));
-    code.append(wp, wp + (v.size() / sizeof(std::uint32_t)));
-    std::size_t esz = v.size() % sizeof(std::uint32_t);
-    char c[sizeof(std::uint32_t)] = {0};
-    std::memcpy(c, v.data() + v.size() - esz, esz);
-    std::uint32_t u;
-    std::memcpy(&u, c, sizeof(u));
-    code.push_back(u);
+    gen_val_managed(v);
+}
+
+/* string constants are interned once here, so that running the code only
+ * has to bump the reference count
+ */
+void gen_state::gen_val_managed(std::string_view v) {
+    auto *str = ts.istate->strman->add(v);
+    strs.push_back(str);
+    std::uint32_t u[bc_store_size<char const *>] = {0};
+    std::memcpy(u, &str, sizeof(str));
+    code.push_back(BC_INST_VAL | BC_RET_STRING);
+    code.append(u, u + bc_store_size<char const *>);
 }
 
 /* FIXME: figure out how to do without the intermediate buffer */
 template<typename F>
-static void gen_str_filter(
-    valbuf<std::uint32_t> &code, thread_state &ts, std::string_view v, F &&func
+static std::string_view gen_str_filter(
+    arena_charbuf &buf, std::string_view v, F &&func
 ) {
-    code.push_back(BC_INST_VAL | BC_RET_STRING);
-    auto ncode = code.size();
-    /* we're reserving a proper number of words */
-    auto nwords = (v.size() / sizeof(std::uint32_t)) + 1;
-    code.reserve(ncode + nwords);
-    /* allocate a character buffer that's at least that many words */
-    auto al = std_allocator<char>{ts.istate};
-    auto *buf = al.allocate(nwords * sizeof(std::uint32_t));
-    /* the body */
-    auto len = func(&buf[0]);
-    /* fill the leftover bytes with zeroes */
-    memset(&buf[len], 0, sizeof(std::uint32_t) - len % sizeof(std::uint32_t));
-    /* set the actual length */
-    code.back() |= (len << 8);
-    std::uint32_t *ubuf;
-    std::memcpy(&ubuf, &buf, sizeof(ubuf));
-    code.append(ubuf, ubuf + ((len / sizeof(std::uint32_t)) + 1));
-    al.deallocate(buf, nwords * sizeof(std::uint32_t));
+    /* the filtered string is never longer than the input */
+    buf.resize(v.size() + 1);
+    auto len = func(buf.data());
+    return std::string_view{buf.data(), len};
 }
 
 void gen_state::gen_val_string_unescape(std::string_view v) {
-    gen_str_filter(code, ts, v, [&v](auto *buf) {
+    arena_charbuf sbuf{ts.arena};
+    gen_val_managed(gen_str_filter(sbuf, v, [&v](auto *buf) {
         auto *wbuf = unescape_string(buf, v);
         return std::size_t(wbuf - buf);
-    });
+    }));
 }
 
 void gen_state::gen_val_block(std::string_view v) {
-    gen_str_filter(code, ts, v, [&v, this](auto *buf) {
+    arena_charbuf sbuf{ts.arena};
+    gen_val_managed(gen_str_filter(sbuf, v, [&v, this](auto *buf) {
         auto *str = v.data();
         auto *send = v.data() + v.size();
         std::size_t len = 0;
@@ -281,7 +503,7 @@ void gen_state::gen_val_block(std::string_view v) {
             }
         }
         return len;
-    });
+    }));
 }
 
 void gen_state::gen_val_ident() {
@@ -341,13 +563,26 @@ void gen_state::gen_lookup_var(ident &id, int ltype) {
 }
 
 void gen_state::gen_lookup_alias(ident &id, int ltype, int dtype) {
-    code.push_back(
-        BC_INST_LOOKUP | ret_code(ltype, ret_code(dtype)) | (id.index() << 8)
-    );
+    auto rc = ret_code(ltype, ret_code(dtype));
+    if (inlining && static_cast<alias &>(id).is_arg()) {
+        /* the argument aliases come first, so the index is the position */
+        if (std::uint32_t(id.index()) < inline_args) {
+            code.push_back(BC_INST_ARG | rc | (id.index() << 8));
+            return;
+        }
+        /* not passed, so never set */
+        gen_val_null();
+        if (rc) {
+            code.push_back(BC_INST_FORCE | rc);
+        }
+        return;
+    }
+    code.push_back(BC_INST_LOOKUP | rc | (id.index() << 8));
 }
 
 void gen_state::gen_lookup_ident(int ltype) {
     code.push_back(BC_INST_LOOKUP_U | ret_code(ltype));
+    code.push_back(0);
 }
 
 void gen_state::gen_assign_alias(ident &id) {
@@ -356,6 +591,7 @@ void gen_state::gen_assign_alias(ident &id) {
 
 void gen_state::gen_assign() {
     code.push_back(BC_INST_ALIAS_U);
+    code.push_back(0);
 }
 
 void gen_state::gen_compile(bool cond) {
@@ -368,6 +604,7 @@ void gen_state::gen_compile(bool cond) {
 
 void gen_state::gen_ident_lookup() {
     code.push_back(BC_INST_IDENT_U);
+    code.push_back(0);
 }
 
 void gen_state::gen_concat(std::size_t concs, bool space, int ltype) {
@@ -394,13 +631,142 @@ void gen_state::gen_command_call(
     }
 }
 
+void gen_state::gen_arith(int op, int ltype) {
+    code.push_back(BC_INST_ARITH | ret_code(ltype) | (op << 8));
+}
+
+/* limits for the alias bodies that get inlined, in source characters and
+ * in compiled instructions
+ */
+static constexpr std::size_t MAX_INLINE_SRC = 256;
+static constexpr std::size_t MAX_INLINE_LEN = 32;
+
+/* whether an inlined body may run in place of the call; it must not see
+ * its arguments other than by value, make code that could be run from
+ * elsewhere, or use names only known at runtime (which may be arguments)
+ */
+static bool inline_safe(
+    thread_state &ts, std::uint32_t const *code, std::size_t len
+) {
+    auto is_arg = [&ts](std::uint32_t idx) {
+        return (idx < MAX_ARGUMENTS) || (
+            idx == std::uint32_t(ts.istate->ivar_numargs->index())
+        );
+    };
+    for (std::size_t i = 0; i < len; i += bcode_inst_len(&code[i])) {
+        auto op = code[i];
+        switch (op & BC_INST_OP_MASK) {
+            case BC_INST_IDENT:
+            case BC_INST_LOOKUP:
+            case BC_INST_VAR:
+            case BC_INST_ALIAS:
+            case BC_INST_CALL:
+            case BC_INST_VAL_ALIAS:
+            case BC_INST_LOOKUP_RESULT:
+                if (is_arg(op >> 8)) {
+                    return false;
+                }
+                break;
+            case BC_INST_LOOKUP_VAL_COM_V:
+                if (is_arg(code[i + 1] >> 8)) {
+                    return false;
+                }
+                [[fallthrough]];
+            case BC_INST_COM:
+            case BC_INST_COM_V:
+            case BC_INST_VAL_COM:
+            case BC_INST_VAL_COM_V:
+                /* the name given to it may be that of an argument */
+                if (static_cast<command_impl *>(
+                    ts.istate->lookup_ident(op >> 8)
+                )->p_byname) {
+                    return false;
+                }
+                break;
+            case BC_INST_CALL_U:
+                /* a literal name would have been known if it was one */
+                if (!(code[i + 1] & BC_CACHE_LITERAL)) {
+                    return false;
+                }
+                break;
+            case BC_INST_BLOCK:
+            case BC_INST_COMPILE:
+            case BC_INST_COND:
+            case BC_INST_LOCAL:
+            case BC_INST_DO:
+            case BC_INST_DO_ARGS:
+            case BC_INST_IDENT_U:
+            case BC_INST_LOOKUP_U:
+            case BC_INST_ALIAS_U:
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+/* copies the body of a small alias in front of its call, to be run in
+ * place of it for as long as the alias does not change; the copy is made
+ * from the value seen by the compiling thread, so no thread may have it
+ * shadowed, while shadowing it later bumps the generation like any other
+ * change does
+ */
+void gen_state::gen_inline(alias &a, std::uint32_t nargs) {
+    auto &imp = static_cast<alias_impl &>(a);
+    if (inlining || a.is_arg()) {
+        return;
+    }
+    std::uint32_t gen = imp.p_gen;
+    if (imp.p_shadows) {
+        return;
+    }
+    auto &ast = ts.get_astack(&a);
+    if ((ast.node != &imp.p_initial) || ast.flags) {
+        return;
+    }
+    auto &val = ast.node->val_s;
+    if (val.type() != value_type::STRING) {
+        return;
+    }
+    auto body = val.get_string(*ts.pstate);
+    if (body.size() > MAX_INLINE_SRC) {
+        return;
+    }
+    gen_state gs{ts};
+    gs.inlining = true;
+    gs.inline_args = nargs;
+    auto *line = ts.current_line;
+    try {
+        gs.gen_main(body);
+    } catch (error const &) {
+        /* left to the call, which reports it when compiling the body */
+        ts.current_line = line;
+        return;
+    }
+    ts.current_line = line;
+    /* the body without BC_INST_START, up to and including the exit */
+    auto len = gs.code.size() - 1;
+    if ((len > MAX_INLINE_LEN) || !inline_safe(ts, &gs.code[1], len)) {
+        return;
+    }
+    code.push_back(BC_INST_INLINE | std::uint32_t(len << 8));
+    code.push_back(gen);
+    code.append(&gs.code[1], &gs.code[len + 1]);
+    /* the copied code refers to the same string constants */
+    strs.append(gs.strs.data(), gs.strs.data() + gs.strs.size());
+    gs.strs.clear();
+}
+
 void gen_state::gen_alias_call(ident &id, std::uint32_t nargs) {
+    gen_inline(static_cast<alias &>(id), nargs);
     code.push_back(BC_INST_CALL | (id.index() << 8));
     code.push_back(nargs);
 }
 
-void gen_state::gen_call(std::uint32_t nargs) {
+void gen_state::gen_call(std::uint32_t nargs, bool literal) {
     code.push_back(BC_INST_CALL_U | (nargs << 8));
+    code.push_back(literal ? std::uint32_t(BC_CACHE_LITERAL) : 0);
 }
 
 void gen_state::gen_local(std::uint32_t nargs) {
@@ -433,6 +799,9 @@ void gen_state::gen_main(std::string_view v, std::string_view src) {
         code.push_back(BC_INST_START);
         ps.parse_block(VAL_ANY);
         code.push_back(BC_INST_EXIT);
+#ifndef LIBCUBESCRIPT_NO_PEEPHOLE
+        optimize();
+#endif
     } catch (...) {
         ts.source = psrc;
         throw;
@@ -509,4 +878,194 @@ std::pair<std::size_t, std::string_view> gen_state::gen_block(
     return std::make_pair(ret_line, v);
 }
 
+/* the peephole pass; it runs over the finished code, fusing frequent
+ * instruction sequences into superinstructions and dropping sequences
+ * that have no effect, then relocates jumps and blocks to the new layout
+ */
+void gen_state::optimize() {
+    auto osize = code.size();
+    /* sequences spanning a jump target must be left alone */
+    arenabuf<unsigned char> targets{ts.arena};
+    targets.resize(osize + 1, 0);
+    for (std::size_t i = 0; i < osize; i += bcode_inst_len(&code[i])) {
+        switch (code[i] & BC_INST_OP_MASK) {
+            case BC_INST_JUMP:
+            case BC_INST_JUMP_B:
+            case BC_INST_JUMP_RESULT:
+                targets[i + (code[i] >> 8) + 1] = 1;
+                break;
+            /* the loop start, the body after the condition, the end of
+             * the body (for continue) and the code after the loop
+             */
+            case BC_INST_LOOP:
+                targets[i + 2] = 1;
+                targets[i + (code[i] >> 8) + 2] = 1;
+                break;
+            case BC_INST_LOOP_COND:
+                targets[i + 3] = 1;
+                break;
+            case BC_INST_LOOP_NEXT:
+                targets[i + 1] = 1;
+                break;
+            /* the fallback call and the code after it */
+            case BC_INST_INLINE:
+                targets[i + (code[i] >> 8) + 2] = 1;
+                targets[i + (code[i] >> 8) + 4] = 1;
+                break;
+            default:
+                break;
+        }
+    }
+    auto is_val = [](std::uint32_t op) {
+        switch (op & BC_INST_OP_MASK) {
+            case BC_INST_VAL:
+            case BC_INST_VAL_INT:
+                return true;
+            default:
+                break;
+        }
+        return false;
+    };
+    /* new positions of old instructions, plus old positions of the
+     * instructions that need relocating (jumps, blocks and offsets)
+     */
+    arenabuf<std::uint32_t> ncode{ts.arena};
+    arenabuf<std::size_t> npos{ts.arena};
+    arenabuf<std::pair<std::size_t, std::size_t>> relocs{ts.arena};
+    ncode.reserve(osize);
+    npos.resize(osize + 1, 0);
+    auto append = [this, &ncode](std::size_t beg, std::size_t len) {
+        ncode.append(&code[beg], &code[beg + len]);
+    };
+    for (std::size_t i = 0; i < osize;) {
+        auto op = code[i];
+        auto len = bcode_inst_len(&code[i]);
+        auto j = i + len;
+        /* whether a sequence may continue with the instruction at j */
+        bool cont = (j < osize) && !targets[j];
+        npos[i] = ncode.size();
+        switch (op & BC_INST_OP_MASK) {
+            case BC_INST_VAL:
+            case BC_INST_VAL_INT: {
+                if (!cont) {
+                    break;
+                }
+                auto nop = code[j];
+                auto nflags = nop & ~BC_INST_OP_MASK;
+                switch (nop & BC_INST_OP_MASK) {
+                    case BC_INST_ALIAS:
+                        ncode.push_back(BC_INST_VAL_ALIAS | nflags);
+                        append(i, len);
+                        i = j + 1;
+                        continue;
+                    case BC_INST_COM:
+                        ncode.push_back(BC_INST_VAL_COM | nflags);
+                        append(i, len);
+                        i = j + 1;
+                        continue;
+                    case BC_INST_COM_V:
+                        ncode.push_back(BC_INST_VAL_COM_V | nflags);
+                        append(i, len);
+                        ncode.push_back(code[j + 1]);
+                        i = j + 2;
+                        continue;
+                    default:
+                        break;
+                }
+                break;
+            }
+            case BC_INST_LOOKUP: {
+                if (!cont) {
+                    break;
+                }
+                auto nop = code[j];
+                /* only one of them may force the type */
+                if (((nop & ~BC_INST_RET_MASK) == BC_INST_RESULT) && (
+                    !(op & BC_INST_RET_MASK) || !(nop & BC_INST_RET_MASK)
+                )) {
+                    ncode.push_back(
+                        BC_INST_LOOKUP_RESULT | (op & ~BC_INST_OP_MASK) |
+                        (nop & BC_INST_RET_MASK)
+                    );
+                    i = j + 1;
+                    continue;
+                }
+                if (!is_val(nop)) {
+                    break;
+                }
+                auto k = j + bcode_inst_len(&code[j]);
+                if (
+                    (k >= osize) || targets[k] ||
+                    ((code[k] & BC_INST_OP_MASK) != BC_INST_COM_V)
+                ) {
+                    break;
+                }
+                ncode.push_back(
+                    BC_INST_LOOKUP_VAL_COM_V | (code[k] & ~BC_INST_OP_MASK)
+                );
+                append(i, k - i);
+                ncode.push_back(code[k + 1]);
+                i = k + 2;
+                continue;
+            }
+            case BC_INST_RESULT_ARG:
+                /* pushing the result and immediately popping it back */
+                if (cont && !(op & BC_INST_RET_MASK) && (
+                    code[j] == BC_INST_RESULT
+                )) {
+                    i = j + 1;
+                    continue;
+                }
+                break;
+            case BC_INST_JUMP:
+            case BC_INST_JUMP_B:
+            case BC_INST_JUMP_RESULT:
+            case BC_INST_BLOCK:
+            case BC_INST_OFFSET:
+            case BC_INST_LOOP:
+            case BC_INST_LOOP_NEXT:
+            case BC_INST_INLINE:
+                relocs.emplace_back(ncode.size(), i);
+                break;
+            default:
+                break;
+        }
+        append(i, len);
+        i = j;
+    }
+    npos[osize] = ncode.size();
+    if (ncode.size() == osize) {
+        /* only same-size rewrites, no need to relocate anything */
+        std::memcpy(code.data(), ncode.data(), osize * sizeof(std::uint32_t));
+        return;
+    }
+    for (std::size_t i = 0; i < relocs.size(); ++i) {
+        auto [pos, opos] = relocs[i];
+        auto &nop = ncode[pos];
+        switch (nop & BC_INST_OP_MASK) {
+            case BC_INST_OFFSET:
+                nop = BC_INST_OFFSET | std::uint32_t((pos + 1) << 8);
+                break;
+            case BC_INST_LOOP:
+            case BC_INST_INLINE: {
+                auto next = npos[opos + (nop >> 8) + 2];
+                nop = (nop & 0xFF) | std::uint32_t((next - pos - 2) << 8);
+                break;
+            }
+            case BC_INST_LOOP_NEXT: {
+                auto start = npos[opos - (nop >> 8)];
+                nop = (nop & 0xFF) | std::uint32_t((pos - start) << 8);
+                break;
+            }
+            default: {
+                /* jumps and blocks both store the length to skip */
+                auto end = npos[opos + (nop >> 8) + 1];
+                nop = (nop & 0xFF) | std::uint32_t((end - pos - 1) << 8);
+                break;
+            }
+        }
+    }
+    code.buf.swap(ncode.buf);
+}
+
 } /* namespace cubescript */
@@ -18,8 +18,9 @@ struct gen_state {
 
     gen_state() = delete;
     gen_state(thread_state &tsr):
-        ts{tsr}, code{tsr.istate}
+        ts{tsr}, scope{tsr.arena}, code{tsr.arena}, strs{tsr.arena}
     {}
+    ~gen_state();
 
     std::size_t count() const;
     std::uint32_t peek(std::size_t idx) const;
@@ -33,8 +34,22 @@ struct gen_state {
     void gen_force(int ltype);
 
     void gen_not(int ltype = 0);
-    bool gen_if(std::size_t tpos, std::size_t fpos, int ltype = 0);
+    bool gen_if(
+        std::size_t cpos, std::size_t tpos, std::size_t fpos, int ltype = 0
+    );
     void gen_and_or(bool is_or, std::size_t start, int ltype = 0);
+    bool gen_loop(
+        std::uint32_t desc, std::size_t cpos, std::size_t bpos, int ltype = 0
+    );
+
+    bool fold_call(
+        std::size_t start, command_impl &id, std::uint32_t nargs,
+        int ltype = 0
+    );
+    bool fold_not(std::size_t start, int ltype = 0);
+    bool fold_and_or(
+        bool is_or, std::size_t first, std::size_t start, int ltype = 0
+    );
 
     void gen_val_null();
     void gen_result_null(int ltype = 0);
@@ -76,8 +91,9 @@ struct gen_state {
     void gen_command_call(
         ident &id, int comt, int ltype = 0, std::uint32_t nargs = 0
     );
+    void gen_arith(int op, int ltype = 0);
     void gen_alias_call(ident &id, std::uint32_t nargs = 0);
-    void gen_call(std::uint32_t nargs = 0);
+    void gen_call(std::uint32_t nargs = 0, bool literal = false);
 
     void gen_local(std::uint32_t nargs);
     void gen_do(bool args, int ltype = 0);
@@ -101,7 +117,31 @@ struct gen_state {
     );
 
 private:
-    valbuf<std::uint32_t> code;
+    void optimize();
+
+    bool fold_values(
+        std::size_t start, std::size_t end, arenabuf<any_value> &vals
+    );
+    bool fold_result(std::size_t start, any_value &v, int ltype);
+    void drop(std::size_t beg, std::size_t end);
+
+    void gen_inline(alias &a, std::uint32_t nargs);
+    void gen_val_managed(std::string_view v);
+
+    /* the buffers live in the thread's compile arena, which is released
+     * once the outermost generator is done; declared first to go last
+     */
+    arena_scope scope;
+    arenabuf<std::uint32_t> code;
+    /* the string constants referenced by the code, each holding a reference
+     * of its own; they are handed over to the bytecode in steal_ref()
+     */
+    arenabuf<char const *> strs;
+    /* compiling the body of an alias to be inlined at a call site with
+     * the given number of arguments
+     */
+    bool inlining = false;
+    std::uint32_t inline_args = 0;
 };
 
 } /* namespace cubescript */
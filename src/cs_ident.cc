@@ -113,8 +113,10 @@ void var_value::steal_value(any_value &v, state &cs) {
             return;
         }
         case value_type::STRING: {
-            auto sv = v.force_string(cs);
-            var_store<char const *>(p_stor, str_managed_ref(sv.data()));
+            auto sr = state_p{cs}.ts().istate->strman->intern(
+                v.get_string(cs)
+            );
+            var_store<char const *>(p_stor, str_managed_ref(sr.data()));
             return;
         }
         default:
@@ -123,18 +125,18 @@ void var_value::steal_value(any_value &v, state &cs) {
     abort(); /* unreachable unless buggy */
 }
 
-any_value var_value::to_value() const {
-    switch (type()) {
+any_value var_value::get_value(unsigned char const *fromp) const {
+    switch (p_type) {
         case value_type::INTEGER:
-            return var_load<integer_type>(p_stor);
+            return var_load<integer_type>(fromp);
         case value_type::FLOAT: {
             float_type fv{};
-            FS vs = var_load<FS>(p_stor);
+            FS vs = var_load<FS>(fromp);
             std::memcpy(&fv, &vs, sizeof(fv));
             return fv;
         }
         case value_type::STRING:
-            return string_ref{var_load<char const *>(p_stor)};
+            return string_ref{var_load<char const *>(fromp)};
         default:
             break;
     }
@@ -142,6 +144,14 @@ any_value var_value::to_value() const {
     return any_value{};
 }
 
+any_value var_value::to_value() const {
+    return get_value(p_stor);
+}
+
+any_value var_value::saved_value() const {
+    return get_value(p_ostor);
+}
+
 ident_impl::ident_impl(ident_type tp, string_ref nm, int fl):
     p_name{nm}, p_flags{fl}, p_type{int(tp)}
 {}
@@ -182,6 +192,7 @@ alias_impl::alias_impl(
     ident_impl{ident_type::ALIAS, name, fl}, p_initial{}
 {
     p_initial.val_s.set_string(a, cs);
+    intern_alias_value(cs, p_initial.val_s);
 }
 
 alias_impl::alias_impl(state &, string_ref name, integer_type a, int fl):
@@ -202,10 +213,11 @@ alias_impl::alias_impl(state &, string_ref name, int fl):
     p_initial.val_s.set_none();
 }
 
-alias_impl::alias_impl(state &, string_ref name, any_value v, int fl):
+alias_impl::alias_impl(state &cs, string_ref name, any_value v, int fl):
     ident_impl{ident_type::ALIAS, name, fl}, p_initial{}
 {
     p_initial.val_s = v.get_plain();
+    intern_alias_value(cs, p_initial.val_s);
 }
 
 command_impl::command_impl(
@@ -213,7 +225,29 @@ command_impl::command_impl(
 ):
     ident_impl{ident_type::COMMAND, name, 0},
     p_cargs{args}, p_cb_cftv{std::move(f)}, p_numargs{nargs}
-{}
+{
+    std::string_view fmt = p_cargs.view();
+    for (char c: fmt) {
+        if ((c >= '1') && (c <= '4')) {
+            p_nrep = std::size_t(c - '0');
+            break;
+        } else if (c == '.') {
+            break;
+        }
+        ++p_nfixed;
+    }
+    p_variadic = (p_nfixed < fmt.size());
+    p_shape = p_nfixed ? fmt[0] : 'a';
+    for (std::size_t i = 0; i < p_nfixed; ++i) {
+        if (fmt[i] != p_shape) {
+            p_shape = '\0';
+            break;
+        }
+    }
+    if (std::strchr("ifsa", p_shape) == nullptr) {
+        p_shape = '\0';
+    }
+}
 
 void var_changed(thread_state &ts, builtin_var &id, any_value &oldval) {
     auto *cid = ts.istate->cmd_var_changed;
@@ -270,11 +304,23 @@ void alias_stack::push(ident_stack &st) {
     node = &st;
 }
 
+void intern_alias_value(state &cs, any_value &v) {
+    if (v.type() != value_type::STRING) {
+        return;
+    }
+    auto sr = v.get_string(cs);
+    auto isr = state_p{cs}.ts().istate->strman->intern(sr);
+    if (isr.data() != sr.data()) {
+        v.set_string(isr);
+    }
+}
+
 void alias_stack::pop() {
     node = node->next;
 }
 
 void alias_stack::set_arg(alias *a, thread_state &ts, any_value &v) {
+    static_cast<alias_impl *>(a)->changed();
     if (ident_is_used_arg(a, ts)) {
         node->code = bcode_ref{};
     } else {
@@ -285,10 +331,12 @@ void alias_stack::set_arg(alias *a, thread_state &ts, any_value &v) {
 }
 
 void alias_stack::set_alias(alias *a, thread_state &ts, any_value &v) {
+    intern_alias_value(*ts.pstate, v);
     node->val_s = std::move(v);
     node->code = bcode_ref{};
     flags = ts.ident_flags;
     auto *imp = static_cast<alias_impl *>(a);
+    imp->changed();
     if (node == &imp->p_initial) {
         imp->p_flags = flags;
     }
@@ -397,17 +445,15 @@ LIBCUBESCRIPT_EXPORT any_value builtin_var::call(
     any_value ret{};
     auto &ts = state_p{cs}.ts();
     auto *cimp = static_cast<command_impl *>(hid);
-    auto &targs = ts.vmstack;
-    auto osz = targs.size();
+    vmstack_scope sc{ts};
+    auto &targs = sc.args;
     auto anargs = std::size_t(cimp->arg_count());
     auto nargs = args.size();
-    targs.resize(
-        osz + std::max(args.size(), anargs + 1)
-    );
+    targs.resize(std::max(args.size(), anargs + 1));
     for (std::size_t i = 0; i < nargs; ++i) {
-        targs[osz + i + 1] = args[i];
+        targs[i + 1] = args[i];
     }
-    exec_command(ts, cimp, this, &targs[osz], ret, nargs + 1, false);
+    exec_command(ts, cimp, this, targs.data(), ret, nargs + 1, false);
     return ret;
 }
 
@@ -490,20 +536,14 @@ LIBCUBESCRIPT_EXPORT any_value command::call(
     }
     auto nargs = args.size();
     auto &ts = state_p{cs}.ts();
-    if (nargs < std::size_t(cimpl.arg_count())) {
-        auto &targs = ts.vmstack;
-        auto osz = targs.size();
-        targs.resize(osz + cimpl.arg_count());
-        try {
-            for (std::size_t i = 0; i < nargs; ++i) {
-                targs[osz + i] = args[i];
-            }
-            exec_command(ts, &cimpl, this, &targs[osz], ret, nargs, false);
-        } catch (...) {
-            targs.resize(osz);
-            throw;
+    if (nargs < cimpl.p_nfixed) {
+        vmstack_scope sc{ts};
+        auto &targs = sc.args;
+        targs.resize(cimpl.p_nfixed);
+        for (std::size_t i = 0; i < nargs; ++i) {
+            targs[i] = args[i];
         }
-        targs.resize(osz);
+        exec_command(ts, &cimpl, this, targs.data(), ret, nargs, false);
     } else {
         exec_command(ts, &cimpl, this, &args[0], ret, nargs, false);
     }
@@ -520,6 +560,7 @@ LIBCUBESCRIPT_EXPORT alias_local::alias_local(state &cs, ident &a) {
     p_alias = static_cast<alias *>(&a);
     auto &ast = ts.get_astack(p_alias);
     ast.push(ts.idstack.emplace_back());
+    static_cast<alias_impl *>(p_alias)->shadow();
     p_sp = &ast;
     ast.flags &= ~IDENT_FLAG_UNKNOWN;
 }
@@ -537,6 +578,7 @@ LIBCUBESCRIPT_EXPORT alias_local::alias_local(state &cs, any_value const &v):
 LIBCUBESCRIPT_EXPORT alias_local::~alias_local() {
     if (p_alias) {
         static_cast<alias_stack *>(p_sp)->pop();
+        static_cast<alias_impl *>(p_alias)->unshadow();
     }
 }
 
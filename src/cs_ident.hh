@@ -44,6 +44,8 @@ struct var_value {
 
     void steal_value(any_value &v, state &cs);
     any_value to_value() const;
+    /* the value put aside by save(), only valid for overridden vars */
+    any_value saved_value() const;
 
 private:
     using VU = union {
@@ -52,6 +54,8 @@ private:
         atomic_type<char const *> s;
     };
 
+    any_value get_value(unsigned char const *fromp) const;
+
     /* fixed upon creation */
     value_type p_type;
     alignas(VU) unsigned char p_stor[sizeof(VU)];
@@ -73,6 +77,14 @@ enum {
     IDENT_FLAG_PERSIST    = 1 << 5
 };
 
+/* short strings live inline in any_value until something asks for them with
+ * the non-const get_string(), which interns them in place; alias values may
+ * be read from several threads at once, so they are interned as they are
+ * stored to keep those reads from writing into the value; transient strings
+ * are interned here as well, as alias values tend to stay around
+ */
+void intern_alias_value(state &cs, any_value &v);
+
 struct ident_stack {
     any_value val_s;
     bcode_ref code;
@@ -136,7 +148,28 @@ struct alias_impl: ident_impl, alias {
     alias_impl(state &cs, string_ref n, int flags);
     alias_impl(state &cs, string_ref n, any_value v, int flags);
 
+    /* the value may have changed for some thread */
+    void changed() {
+        p_gen++;
+    }
+
+    /* a local (or loop variable) starts or stops shadowing the value */
+    void shadow() {
+        p_shadows++;
+        p_gen++;
+    }
+
+    void unshadow() {
+        p_shadows--;
+    }
+
     ident_stack p_initial;
+    /* bumped on every change, so that copies of the body inlined by the
+     * compiler can tell when they are stale, see BC_INST_INLINE
+     */
+    atomic_type<std::uint32_t> p_gen{0};
+    /* the number of locals shadowing the alias, across all threads */
+    atomic_type<std::uint32_t> p_shadows{0};
 };
 
 struct command_impl: ident_impl, command {
@@ -151,8 +184,48 @@ struct command_impl: ident_impl, command {
     string_ref p_cargs;
     command_func p_cb_cftv;
     int p_numargs;
+
+    /* the argument format precompiled for exec_command; the first p_nfixed
+     * characters of the format are the conversions of the fixed arguments,
+     * the last p_nrep of those are repeated for variadic arguments; if all
+     * fixed arguments are converted the same way (i, f, s or a), that is
+     * stored in p_shape so the conversion can be done in one loop
+     */
+    std::size_t p_nfixed = 0;
+    std::size_t p_nrep = 0;
+    bool p_variadic = false;
+    char p_shape = '\0';
+
+    /* MATH_* for the builtins the compiler may emit inline, see cs_math.hh */
+    int p_builtin = 0;
+    /* the result only depends on the arguments and there are no side
+     * effects, so calls with constant arguments may be folded at compile time
+     */
+    bool p_pure = false;
+    /* BC_LOOP_* descriptor for the loop builtins the compiler may emit
+     * inline when their code arguments are literal blocks, see cs_bcode.hh
+     */
+    std::uint32_t p_loop = 0;
+    /* looks idents up by a name given at runtime; run from a body inlined
+     * into another alias, that would find the arguments of the caller
+     */
+    bool p_byname = false;
 };
 
+/* tags a loop builtin created by the standard library */
+inline void loop_builtin(command *cmd, std::uint32_t desc) {
+    if (cmd) {
+        static_cast<command_impl *>(cmd)->p_loop = desc;
+    }
+}
+
+/* tags a builtin that looks up idents by a name it is given at runtime */
+inline void byname_builtin(command *cmd) {
+    if (cmd) {
+        static_cast<command_impl *>(cmd)->p_byname = true;
+    }
+}
+
 bool ident_is_used_arg(ident const *id, thread_state &ts);
 
 struct ident_p {
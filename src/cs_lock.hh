@@ -3,8 +3,11 @@
 
 #include <cubescript/cubescript.hh>
 
+#include <cstdint>
+
 #if LIBCUBESCRIPT_CONF_THREAD_SAFE
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
 #else
 #include <utility>
@@ -19,6 +22,13 @@ struct mutex_type {
     void unlock() {}
 };
 
+struct shared_mutex_type {
+    void lock() {}
+    void unlock() {}
+    void lock_shared() {}
+    void unlock_shared() {}
+};
+
 template<typename T>
 struct atomic_type {
     T p_v;
@@ -35,6 +45,15 @@ struct atomic_type {
         return std::exchange(p_v, v);
     }
 
+    bool compare_exchange_weak(T &expected, T v) {
+        if (p_v != expected) {
+            expected = p_v;
+            return false;
+        }
+        p_v = v;
+        return true;
+    }
+
     atomic_type<T> &operator=(T v) {
         p_v = v;
         return *this;
@@ -55,18 +74,73 @@ struct atomic_type {
     T operator++(int) {
         return p_v++;
     }
+
+    T operator--(int) {
+        return p_v--;
+    }
 };
 
 #else
 
 using mutex_type = std::mutex;
+using shared_mutex_type = std::shared_mutex;
 template<typename T>
 using atomic_type = std::atomic<T>;
 
 #endif
 
+/* relaxed access to words that may be rewritten while other threads read
+ * them, such as the inline caches in bytecode; a stale value is fine
+ *
+ * words that publish something other threads go on to dereference, like
+ * the index of an ident, use the acquire/release variants instead
+ */
+
+#if ! LIBCUBESCRIPT_CONF_THREAD_SAFE
+
+inline std::uint32_t atomic_word_load(std::uint32_t const *p) {
+    return *p;
+}
+
+inline void atomic_word_store(std::uint32_t *p, std::uint32_t v) {
+    *p = v;
+}
+
+inline std::uint32_t atomic_word_acquire(std::uint32_t const *p) {
+    return *p;
+}
+
+inline void atomic_word_release(std::uint32_t *p, std::uint32_t v) {
+    *p = v;
+}
+
+#else
+
+inline std::uint32_t atomic_word_load(std::uint32_t const *p) {
+    return std::atomic_ref<std::uint32_t>{
+        *const_cast<std::uint32_t *>(p)
+    }.load(std::memory_order_relaxed);
+}
+
+inline void atomic_word_store(std::uint32_t *p, std::uint32_t v) {
+    std::atomic_ref<std::uint32_t>{*p}.store(v, std::memory_order_relaxed);
+}
+
+inline std::uint32_t atomic_word_acquire(std::uint32_t const *p) {
+    return std::atomic_ref<std::uint32_t>{
+        *const_cast<std::uint32_t *>(p)
+    }.load(std::memory_order_acquire);
+}
+
+inline void atomic_word_release(std::uint32_t *p, std::uint32_t v) {
+    std::atomic_ref<std::uint32_t>{*p}.store(v, std::memory_order_release);
+}
+
+#endif
+
+template<typename M>
 struct mtx_guard {
-    mtx_guard(mutex_type &m): p_m{m} {
+    mtx_guard(M &m): p_m{m} {
         m.lock();
     }
 
@@ -74,7 +148,20 @@ struct mtx_guard {
         p_m.unlock();
     }
 
-    mutex_type &p_m;
+    M &p_m;
+};
+
+/* for readers of data guarded by a shared_mutex_type */
+struct shared_mtx_guard {
+    shared_mtx_guard(shared_mutex_type &m): p_m{m} {
+        m.lock_shared();
+    }
+
+    ~shared_mtx_guard() {
+        p_m.unlock_shared();
+    }
+
+    shared_mutex_type &p_m;
 };
 
 } /* namespace cubescript */
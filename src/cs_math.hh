@@ -0,0 +1,86 @@
+#ifndef LIBCUBESCRIPT_MATH_HH
+#define LIBCUBESCRIPT_MATH_HH
+
+#include <cubescript/cubescript.hh>
+
+#include "cs_state.hh"
+#include "cs_ident.hh"
+
+#include <cmath>
+#include <string_view>
+#include <utility>
+
+namespace cubescript {
+
+/* the standard arithmetic and comparison builtins; when called with two
+ * arguments, the compiler emits these inline as BC_INST_ARITH with D being
+ * the operation, instead of calling the command; since the command objects
+ * are tagged rather than looked up by name, a host providing its own
+ * commands of the same names still gets them called
+ */
+enum {
+    MATH_NONE = 0,
+    /* integer */
+    MATH_ADD, MATH_SUB, MATH_MUL, MATH_DIV, MATH_MOD,
+    /* float */
+    MATH_ADDF, MATH_SUBF, MATH_MULF, MATH_DIVF, MATH_MODF,
+    /* integer comparisons */
+    MATH_EQ, MATH_NE, MATH_LT, MATH_GT, MATH_LE, MATH_GE,
+    /* float comparisons */
+    MATH_EQF, MATH_NEF, MATH_LTF, MATH_GTF, MATH_LEF, MATH_GEF,
+    /* string comparisons */
+    MATH_EQS, MATH_NES, MATH_LTS, MATH_GTS, MATH_LES, MATH_GES
+};
+
+/* binary operations shared between the commands and the VM */
+
+template<typename T>
+struct math_div {
+    T operator()(T val1, T val2) const {
+        if (val2) {
+            return val1 / val2;
+        }
+        return T(0);
+    }
+};
+
+struct math_mod {
+    integer_type operator()(integer_type val1, integer_type val2) const {
+        if (val2) {
+            return val1 % val2;
+        }
+        return integer_type(0);
+    }
+};
+
+struct math_modf {
+    float_type operator()(float_type val1, float_type val2) const {
+        if (val2) {
+            return float_type(std::fmod(val1, val2));
+        }
+        return float_type(0);
+    }
+};
+
+/* creates a command that the compiler is allowed to fold */
+template<typename F>
+inline command *new_cmd_pure(
+    state &cs, std::string_view name, std::string_view args, F &&f
+) {
+    auto *cmd = new_cmd_quiet(cs, name, args, std::forward<F>(f));
+    if (cmd) {
+        static_cast<command_impl *>(cmd)->p_pure = true;
+    }
+    return cmd;
+}
+
+/* tags a builtin command created by the standard library */
+inline void math_builtin(command *cmd, int op) {
+    if (cmd) {
+        static_cast<command_impl *>(cmd)->p_builtin = op;
+    }
+}
+
+} /* namespace cubescript */
+
+#endif
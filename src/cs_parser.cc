@@ -316,8 +316,8 @@ std::string_view parser_state::get_str() {
 }
 
 /* like the above, but unescapes the string and dups it as a buffer */
-charbuf parser_state::get_str_dup() {
-    charbuf buf{ts};
+arena_charbuf parser_state::get_str_dup() {
+    arena_charbuf buf{ts.arena};
     unescape_string(std::back_inserter(buf), get_str());
     return buf;
 }
@@ -441,7 +441,7 @@ static void lookup_done(gen_state &gs, int ltype) {
 
 /* parses $foo */
 void parser_state::parse_lookup(int ltype) {
-    charbuf lookup{gs.ts};
+    arena_charbuf lookup{ts.arena};
     next_char(); /* skip $ */
     switch (current()) {
         /* $(...), $[...] */
@@ -548,7 +548,7 @@ lookup_id:
  * only called from within parse_blockarg
  */
 bool parser_state::parse_subblock() {
-    charbuf lookup{ts};
+    arena_charbuf lookup{ts.arena};
     switch (current()) {
         /* @(...) */
         case '(':
@@ -755,7 +755,7 @@ done:
  * this also includes left and right sides in assignments
  * returns if we parsed something
  */
-bool parser_state::parse_arg(int ltype, charbuf *word) {
+bool parser_state::parse_arg(int ltype, arena_charbuf *word) {
     /* not a part of the grammar */
     skip_comments();
     /* guess what our argument is */
@@ -925,6 +925,9 @@ bool parser_state::parse_call_command(
     command_impl *id, ident &self, int rettype
 ) {
     std::uint32_t comtype = BC_INST_COM, numargs = 0, fakeargs = 0;
+    auto start = gs.count();
+    /* where the last two arguments begin, for loops */
+    std::size_t prevpos = 0, lastpos = 0;
     auto fmt = id->args();
     bool more = true, rep = false;
     for (auto it = fmt.begin(); it != fmt.end(); ++it) {
@@ -981,6 +984,8 @@ bool parser_state::parse_call_command(
                 }
                 break;
             default:
+                prevpos = lastpos;
+                lastpos = gs.count();
                 more = parse_cmd_arg(*this, *it, more, rep);
                 if (!more) {
                     if (!rep) {
@@ -993,7 +998,17 @@ bool parser_state::parse_call_command(
                 break;
         }
     }
-    gs.gen_command_call(*id, comtype, rettype, numargs);
+    if (id->p_pure && gs.fold_call(start, *id, numargs, rettype)) {
+        return more;
+    } else if (id->p_loop && gs.gen_loop(
+        id->p_loop, prevpos, lastpos, rettype
+    )) {
+        return more;
+    } else if (id->p_builtin && (numargs == 2)) {
+        gs.gen_arith(id->p_builtin, rettype);
+    } else {
+        gs.gen_command_call(*id, comtype, rettype, numargs);
+    }
     return more;
 }
 
@@ -1037,6 +1052,7 @@ bool parser_state::parse_id_do(bool args, int ltype) {
 
 bool parser_state::parse_id_if(ident &id, int ltype) {
     /* condition */
+    auto cpos = gs.count();
     bool more = parse_arg(VAL_ANY);
     if (!more) {
         /* no condition: expr is nothing */
@@ -1053,7 +1069,7 @@ bool parser_state::parse_id_if(ident &id, int ltype) {
             auto fpos = gs.count();
             /* false block */
             more = parse_arg(VAL_CODE);
-            if (!gs.gen_if(tpos, more ? fpos : 0)) {
+            if (!gs.gen_if(cpos, tpos, more ? fpos : 0)) {
                 /* can't fully compile: use a call */
                 gs.gen_command_call(id, BC_INST_COM, ltype);
             }
@@ -1065,6 +1081,7 @@ bool parser_state::parse_id_if(ident &id, int ltype) {
 bool parser_state::parse_id_and_or(ident &id, int ltype) {
     std::uint32_t numargs = 0;
     /* first */
+    auto first = gs.count();
     bool more = parse_arg(VAL_COND);
     if (!more) {
         /* no first: generate true or false */
@@ -1101,7 +1118,10 @@ bool parser_state::parse_id_and_or(ident &id, int ltype) {
             gs.gen_command_call(id, BC_INST_COM_V, ltype, numargs);
         } else {
             /* all blocks and nothing left */
-            gs.gen_and_or((ident_p{id}.impl().p_type != ID_AND), start);
+            bool is_or = (ident_p{id}.impl().p_type != ID_AND);
+            if (!gs.fold_and_or(is_or, first, start)) {
+                gs.gen_and_or(is_or, start);
+            }
         }
     }
     return more;
@@ -1181,10 +1201,11 @@ bool parser_state::parse_call_id(ident &id, int ltype) {
             return more;
         }
         case ID_NOT: {
+            auto start = gs.count();
             bool more = parse_arg(VAL_ANY);
             if (!more) {
                 gs.gen_result_true(ltype);
-            } else {
+            } else if (!gs.fold_not(start, ltype)) {
                 gs.gen_not(ltype);
             }
             return more;
@@ -1204,13 +1225,13 @@ bool parser_state::parse_call_id(ident &id, int ltype) {
 }
 
 /* generates a call to an unknown entity on the stack */
-static bool parse_no_id(parser_state &ps, int term) {
+static bool parse_no_id(parser_state &ps, int term, bool literal) {
     std::uint32_t nargs = 0;
     /* the entity is already on the stack, parse out any arguments to it */
     while (ps.parse_arg(VAL_ANY)) {
         ++nargs;
     }
-    ps.gs.gen_call(nargs);
+    ps.gs.gen_call(nargs, literal);
     return finish_statement(ps, false, term);
 }
 
@@ -1267,7 +1288,7 @@ static bool parse_assign_var(
 }
 
 bool parser_state::parse_assign(
-    charbuf &idname, int ltype, int term, bool &noass
+    arena_charbuf &idname, int ltype, int term, bool &noass
 ) {
     /* lookahead */
     switch (current(1)) {
@@ -1337,7 +1358,7 @@ bool parser_state::parse_assign(
 }
 
 void parser_state::parse_block(int ltype, int term) {
-    charbuf idname{gs.ts};
+    arena_charbuf idname{ts.arena};
     /* the main statement parse loop */
     for (;;) {
         /* first, skip any comments in the way and prepare the env */
@@ -1367,7 +1388,7 @@ void parser_state::parse_block(int ltype, int term) {
         }
         /* we didn't get a name to look up: treat as unknown */
         if (idname.empty()) {
-            if (!parse_no_id(*this, term)) {
+            if (!parse_no_id(*this, term, false)) {
                 return;
             }
             continue;
@@ -1382,7 +1403,7 @@ void parser_state::parse_block(int ltype, int term) {
             if (is_valid_name(idstr)) {
                 /* VAL_WORD does not codegen, put the name on the stack */
                 gs.gen_val_string(idstr);
-                if (!parse_no_id(*this, term)) {
+                if (!parse_no_id(*this, term, true)) {
                     return;
                 }
                 continue;
@@ -38,7 +38,7 @@ struct parser_state {
     }
 
     std::string_view get_str();
-    charbuf get_str_dup();
+    arena_charbuf get_str_dup();
 
     std::string_view get_word();
 
@@ -71,13 +71,15 @@ struct parser_state {
     void parse_lookup(int ltype);
     bool parse_subblock();
     void parse_blockarg(int ltype);
-    bool parse_arg(int ltype, charbuf *word = nullptr);
+    bool parse_arg(int ltype, arena_charbuf *word = nullptr);
 
     bool parse_call_command(command_impl *id, ident &self, int rettype);
     bool parse_call_alias(alias &id);
     bool parse_call_id(ident &id, int ltype);
 
-    bool parse_assign(charbuf &idname, int ltype, int term, bool &noass);
+    bool parse_assign(
+        arena_charbuf &idname, int ltype, int term, bool &noass
+    );
 
     bool parse_id_local();
     bool parse_id_do(bool args, int ltype);
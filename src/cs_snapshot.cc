@@ -0,0 +1,451 @@
+#include <cstring>
+
+#include "cs_bcode.hh"
+#include "cs_state.hh"
+#include "cs_thread.hh"
+#include "cs_ident.hh"
+#include "cs_strman.hh"
+#include "cs_parser.hh"
+
+namespace cubescript {
+
+/* state snapshots
+ *
+ * a snapshot is a flat image of everything scripts can see: the commands
+ * (by name and argument list only, the host binds them again before
+ * loading), the vars with their values and flags, and the aliases with
+ * their values, flags and compiled code, the latter stored as bytecode
+ * images; the records go in the order of ident creation, so that a fresh
+ * state ends up with the same ident indices
+ *
+ * the image is read in place and only copied from where the state needs
+ * its own copy anyway (strings, code), so it may be a memory mapping
+ */
+
+static constexpr char SNAPSHOT_MAGIC[4] = {'C', 'S', 'S', 'N'};
+static constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+static constexpr std::uint32_t SNAPSHOT_ORDER = 0x01020304;
+
+struct snapshot_hdr {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t order;
+    std::uint8_t isize, fsize, psize, pad;
+    std::uint64_t sum; /* of everything following the header */
+    std::uint64_t cmdhash;
+    std::uint32_t nrecords;
+    std::uint32_t pad2;
+};
+
+/* alias values that are code are stored as images; for the others, the
+ * value type is stored as is
+ */
+static constexpr std::uint32_t SNAPSHOT_CODE = 0xFF;
+
+/* what a snapshot keeps of the ident flags */
+static constexpr int SNAPSHOT_VAR_FLAGS = (
+    IDENT_FLAG_READONLY | IDENT_FLAG_OVERRIDE |
+    IDENT_FLAG_OVERRIDDEN | IDENT_FLAG_PERSIST
+);
+static constexpr int SNAPSHOT_ALIAS_FLAGS = (
+    IDENT_FLAG_UNKNOWN | IDENT_FLAG_OVERRIDDEN | IDENT_FLAG_PERSIST
+);
+
+static void snapshot_put_u32(charbuf &buf, std::uint32_t v) {
+    image_put(buf, &v, sizeof(v));
+}
+
+static void snapshot_put_value(
+    thread_state &ts, charbuf &buf, any_value const &v, value_type tp
+) {
+    switch (tp) {
+        case value_type::INTEGER: {
+            auto i = v.get_integer();
+            image_put(buf, &i, sizeof(i));
+            break;
+        }
+        case value_type::FLOAT: {
+            auto f = v.get_float();
+            image_put(buf, &f, sizeof(f));
+            break;
+        }
+        case value_type::STRING:
+            image_put_str(buf, v.get_string(*ts.pstate));
+            break;
+        default:
+            break;
+    }
+}
+
+/* reads a value of the given type; strings are views of the image */
+static bool snapshot_get_value(
+    image_reader &rd, value_type tp, integer_type &iv, float_type &fv,
+    std::string_view &sv
+) {
+    switch (tp) {
+        case value_type::NONE:
+            return true;
+        case value_type::INTEGER:
+            return rd.get(&iv, sizeof(iv));
+        case value_type::FLOAT:
+            return rd.get(&fv, sizeof(fv));
+        case value_type::STRING:
+            return rd.get_str(sv);
+        default:
+            break;
+    }
+    return false;
+}
+
+static void snapshot_set_value(
+    state &cs, any_value &v, value_type tp, integer_type iv,
+    float_type fv, std::string_view sv
+) {
+    switch (tp) {
+        case value_type::INTEGER:
+            v.set_integer(iv);
+            break;
+        case value_type::FLOAT:
+            v.set_float(fv);
+            break;
+        case value_type::STRING:
+            v.set_string(sv, cs);
+            break;
+        default:
+            v.set_none();
+            break;
+    }
+}
+
+LIBCUBESCRIPT_EXPORT string_ref state::save_snapshot() {
+    auto &ts = *p_tstate;
+    auto *cs = ts.istate;
+    auto cmdhash = image_cmd_hash(cs);
+    charbuf buf{ts};
+    buf.resize(sizeof(snapshot_hdr));
+    std::uint32_t nrecords = 0;
+    auto nids = cs->identnum.load();
+    for (std::size_t i = 0; i < nids; ++i) {
+        auto *id = cs->lookup_ident(i);
+        switch (id->type()) {
+            case ident_type::COMMAND: {
+                auto *cmd = static_cast<command_impl *>(id);
+                snapshot_put_u32(buf, std::uint32_t(ident_type::COMMAND));
+                image_put_str(buf, cmd->name());
+                image_put_str(buf, cmd->args());
+                break;
+            }
+            case ident_type::VAR: {
+                auto *var = static_cast<var_impl *>(id);
+                auto tp = var->p_storage.type();
+                int flags = var->p_flags & SNAPSHOT_VAR_FLAGS;
+                snapshot_put_u32(buf, std::uint32_t(ident_type::VAR));
+                image_put_str(buf, var->name());
+                snapshot_put_u32(buf, std::uint32_t(flags));
+                snapshot_put_u32(buf, std::uint32_t(tp));
+                snapshot_put_value(ts, buf, var->p_storage.to_value(), tp);
+                if (flags & IDENT_FLAG_OVERRIDDEN) {
+                    snapshot_put_value(
+                        ts, buf, var->p_storage.saved_value(), tp
+                    );
+                }
+                break;
+            }
+            case ident_type::ALIAS: {
+                auto *a = static_cast<alias_impl *>(static_cast<alias *>(id));
+                /* argument aliases exist in every state */
+                if (a->is_arg()) {
+                    continue;
+                }
+                /* the global value, whatever this thread may have pushed */
+                auto &val = a->p_initial.val_s;
+                snapshot_put_u32(buf, std::uint32_t(ident_type::ALIAS));
+                image_put_str(buf, a->name());
+                snapshot_put_u32(
+                    buf, std::uint32_t(a->p_flags & SNAPSHOT_ALIAS_FLAGS)
+                );
+                auto tp = val.type();
+                switch (tp) {
+                    case value_type::INTEGER:
+                    case value_type::FLOAT:
+                    case value_type::STRING:
+                        snapshot_put_u32(buf, std::uint32_t(tp));
+                        snapshot_put_value(ts, buf, val, tp);
+                        break;
+                    case value_type::CODE: {
+                        snapshot_put_u32(buf, SNAPSHOT_CODE);
+                        charbuf img{ts};
+                        bcode_save(
+                            ts, bcode_p{val.get_code()}.get(), "",
+                            cmdhash, img
+                        );
+                        image_put_str(buf, img.str());
+                        break;
+                    }
+                    default:
+                        snapshot_put_u32(buf, std::uint32_t(value_type::NONE));
+                        break;
+                }
+                /* the compiled body, if it was ever called */
+                auto &code = a->p_initial.code;
+                if (code && (tp == value_type::STRING)) {
+                    charbuf img{ts};
+                    bcode_save(
+                        ts, bcode_p{code}.get(), val.get_string(*this),
+                        cmdhash, img
+                    );
+                    image_put_str(buf, img.str());
+                } else {
+                    image_put_str(buf, std::string_view{});
+                }
+                break;
+            }
+            default:
+                /* special idents are created by the library itself */
+                continue;
+        }
+        ++nrecords;
+    }
+    snapshot_hdr hdr;
+    std::memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.order = SNAPSHOT_ORDER;
+    hdr.isize = sizeof(integer_type);
+    hdr.fsize = sizeof(float_type);
+    hdr.psize = sizeof(void *);
+    hdr.pad = 0;
+    hdr.sum = image_hash(buf.str().substr(sizeof(hdr)));
+    hdr.cmdhash = cmdhash;
+    hdr.nrecords = nrecords;
+    hdr.pad2 = 0;
+    std::memcpy(buf.data(), &hdr, sizeof(hdr));
+    /* like save_code, binary data that nobody looks up */
+    return cs->strman->make_transient(buf.str());
+}
+
+/* one record of the snapshot, as read from the image */
+struct snapshot_rec {
+    ident_type type;
+    std::string_view name;
+    std::string_view args;
+    int flags = 0;
+    std::uint32_t vtype = 0;
+    integer_type ival = 0, oival = 0;
+    float_type fval = 0, ofval = 0;
+    std::string_view sval, osval;
+    std::string_view code;
+};
+
+static bool snapshot_read(image_reader &rd, snapshot_rec &rec) {
+    std::uint32_t tp, flags;
+    if (!rd.get(&tp, sizeof(tp)) || !rd.get_str(rec.name)) {
+        return false;
+    }
+    rec.type = ident_type(tp);
+    switch (rec.type) {
+        case ident_type::COMMAND:
+            return rd.get_str(rec.args);
+        case ident_type::VAR: {
+            if (!rd.get(&flags, sizeof(flags)) || !rd.get(
+                &rec.vtype, sizeof(rec.vtype)
+            )) {
+                return false;
+            }
+            rec.flags = int(flags) & SNAPSHOT_VAR_FLAGS;
+            auto vt = value_type(rec.vtype);
+            switch (vt) {
+                case value_type::INTEGER:
+                case value_type::FLOAT:
+                case value_type::STRING:
+                    break;
+                default:
+                    return false;
+            }
+            if (!snapshot_get_value(rd, vt, rec.ival, rec.fval, rec.sval)) {
+                return false;
+            }
+            if (rec.flags & IDENT_FLAG_OVERRIDDEN) {
+                return snapshot_get_value(
+                    rd, vt, rec.oival, rec.ofval, rec.osval
+                );
+            }
+            return true;
+        }
+        case ident_type::ALIAS: {
+            if (!rd.get(&flags, sizeof(flags)) || !rd.get(
+                &rec.vtype, sizeof(rec.vtype)
+            )) {
+                return false;
+            }
+            rec.flags = int(flags) & SNAPSHOT_ALIAS_FLAGS;
+            if (rec.vtype == SNAPSHOT_CODE) {
+                if (!rd.get_str(rec.sval)) {
+                    return false;
+                }
+            } else if (!snapshot_get_value(
+                rd, value_type(rec.vtype), rec.ival, rec.fval, rec.sval
+            )) {
+                return false;
+            }
+            return rd.get_str(rec.code);
+        }
+        default:
+            break;
+    }
+    return false;
+}
+
+/* whether the record can be applied to the state as it is */
+static bool snapshot_check(internal_state *cs, snapshot_rec const &rec) {
+    auto *id = cs->get_ident(rec.name);
+    if (!id) {
+        /* host commands must be bound already, the rest is created */
+        return (rec.type != ident_type::COMMAND) && is_valid_name(rec.name);
+    }
+    if (id->type() != rec.type) {
+        return false;
+    }
+    switch (rec.type) {
+        case ident_type::COMMAND:
+            return static_cast<command *>(id)->args() == rec.args;
+        case ident_type::VAR:
+            return std::uint32_t(
+                static_cast<var_impl *>(id)->p_storage.type()
+            ) == rec.vtype;
+        case ident_type::ALIAS:
+            return !static_cast<alias *>(id)->is_arg();
+        default:
+            break;
+    }
+    return false;
+}
+
+static void snapshot_apply_var(thread_state &ts, snapshot_rec const &rec) {
+    auto &cs = *ts.pstate;
+    auto vt = value_type(rec.vtype);
+    any_value val{}, oval{};
+    snapshot_set_value(cs, val, vt, rec.ival, rec.fval, rec.sval);
+    snapshot_set_value(cs, oval, vt, rec.oival, rec.ofval, rec.osval);
+    auto *id = ts.istate->get_ident(rec.name);
+    if (!id) {
+        auto vtp = var_type::DEFAULT;
+        if (rec.flags & IDENT_FLAG_OVERRIDE) {
+            vtp = var_type::OVERRIDABLE;
+        } else if (rec.flags & IDENT_FLAG_PERSIST) {
+            vtp = var_type::PERSISTENT;
+        }
+        bool ro = (rec.flags & IDENT_FLAG_READONLY);
+        switch (vt) {
+            case value_type::INTEGER:
+                id = &cs.new_var(rec.name, rec.ival, ro, vtp);
+                break;
+            case value_type::FLOAT:
+                id = &cs.new_var(rec.name, rec.fval, ro, vtp);
+                break;
+            default:
+                id = &cs.new_var(rec.name, rec.sval, ro, vtp);
+                break;
+        }
+    }
+    /* no change hooks are run, the state is restored as it was */
+    auto *var = static_cast<var_impl *>(static_cast<builtin_var *>(id));
+    if (rec.flags & IDENT_FLAG_OVERRIDDEN) {
+        var->set_raw_value(cs, std::move(oval));
+        var->p_storage.save();
+        var->p_flags |= IDENT_FLAG_OVERRIDDEN;
+    } else if (var->p_flags & IDENT_FLAG_OVERRIDDEN) {
+        var->p_storage.restore();
+        var->p_flags &= ~IDENT_FLAG_OVERRIDDEN;
+    }
+    var->set_raw_value(cs, std::move(val));
+}
+
+static void snapshot_apply_alias(
+    thread_state &ts, snapshot_rec const &rec, std::uint64_t cmdhash
+) {
+    auto &cs = *ts.pstate;
+    auto &id = ts.istate->new_ident(cs, rec.name, IDENT_FLAG_UNKNOWN);
+    auto *a = static_cast<alias_impl *>(static_cast<alias *>(&id));
+    auto &val = a->p_initial.val_s;
+    if (rec.vtype == SNAPSHOT_CODE) {
+        auto code = bcode_load(ts, rec.sval, "", cmdhash);
+        if (code) {
+            val.set_code(code);
+        } else {
+            val.set_none();
+        }
+    } else {
+        snapshot_set_value(
+            cs, val, value_type(rec.vtype), rec.ival, rec.fval, rec.sval
+        );
+        intern_alias_value(cs, val);
+    }
+    a->p_initial.code = bcode_ref{};
+    if (!rec.code.empty() && (val.type() == value_type::STRING)) {
+        /* stale code is simply compiled again when called */
+        a->p_initial.code = bcode_load(
+            ts, rec.code, val.get_string(cs), cmdhash
+        );
+    }
+    a->p_flags = rec.flags;
+    auto &ast = ts.get_astack(a);
+    if (ast.node == &a->p_initial) {
+        ast.flags = rec.flags;
+    }
+    a->changed();
+}
+
+LIBCUBESCRIPT_EXPORT bool state::load_snapshot(std::string_view image) {
+    auto &ts = *p_tstate;
+    auto *cs = ts.istate;
+    image_reader rd{image};
+    snapshot_hdr hdr;
+    if (!rd.get(&hdr, sizeof(hdr))) {
+        return false;
+    }
+    if (
+        std::memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+        (hdr.version != SNAPSHOT_VERSION) ||
+        (hdr.order != SNAPSHOT_ORDER) ||
+        (hdr.isize != sizeof(integer_type)) ||
+        (hdr.fsize != sizeof(float_type)) ||
+        (hdr.psize != sizeof(void *)) ||
+        (hdr.sum != image_hash(rd.data))
+    ) {
+        return false;
+    }
+    /* the code images are only good for the very same set of commands */
+    auto cmdhash = image_cmd_hash(cs);
+    if (hdr.cmdhash != cmdhash) {
+        return false;
+    }
+    /* check everything first, so that nothing is changed on failure */
+    auto body = rd;
+    for (std::uint32_t i = 0; i < hdr.nrecords; ++i) {
+        snapshot_rec rec;
+        if (!snapshot_read(rd, rec) || !snapshot_check(cs, rec)) {
+            return false;
+        }
+    }
+    if (!rd.data.empty()) {
+        return false;
+    }
+    rd = body;
+    for (std::uint32_t i = 0; i < hdr.nrecords; ++i) {
+        snapshot_rec rec;
+        snapshot_read(rd, rec);
+        switch (rec.type) {
+            case ident_type::VAR:
+                snapshot_apply_var(ts, rec);
+                break;
+            case ident_type::ALIAS:
+                snapshot_apply_alias(ts, rec, cmdhash);
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+} /* namespace cubescript */
@@ -1,7 +1,10 @@
 #include <memory>
 #include <cstdio>
 #include <cmath>
+#include <exception>
+#include <vector>
 
+#include "cs_alloc.hh"
 #include "cs_bcode.hh"
 #include "cs_state.hh"
 #include "cs_thread.hh"
@@ -11,28 +14,47 @@
 #include "cs_error.hh"
 #include "cs_lock.hh"
 
+#if LIBCUBESCRIPT_CONF_THREAD_SAFE
+#include <thread>
+#endif
+
 namespace cubescript {
 
 internal_state::internal_state(alloc_func af, void *data):
     allocf{af}, aptr{data},
     idents{allocator_type{this}},
-    identmap{nullptr},
-    identcap{1024}, /* realistic initial space */
+    identmap{},
     argmap{},
     identnum{0},
     strman{create<string_pool>(this)},
     empty{bcode_init_empty(this)}
-{
-    identmap = create_array<ident *>(identcap);
-}
+{}
 
 internal_state::~internal_state() {
+    /* destroyed as what they were created as, for the size */
     for (auto &p: idents) {
-        destroy(&ident_p{*p.second}.impl());
+        auto *impl = &ident_p{*p.second}.impl();
+        switch (p.second->type()) {
+            case ident_type::VAR:
+                destroy(static_cast<var_impl *>(impl));
+                break;
+            case ident_type::ALIAS:
+                destroy(static_cast<alias_impl *>(impl));
+                break;
+            default:
+                destroy(static_cast<command_impl *>(impl));
+                break;
+        }
     }
     bcode_free_empty(this, empty);
     destroy(strman);
-    destroy_array(identmap, identcap);
+    for (std::size_t i = 0; i < IDENT_SEGMENTS; ++i) {
+        auto *seg = identmap[i].load();
+        if (!seg) {
+            break;
+        }
+        destroy_array(seg, IDENT_SEGMENT << i);
+    }
 }
 
 void *internal_state::alloc(void *ptr, size_t os, size_t ns) {
@@ -43,83 +65,63 @@ void *internal_state::alloc(void *ptr, size_t os, size_t ns) {
     return p;
 }
 
-static void *default_alloc(void *, void *p, size_t, size_t ns) {
-    if (!ns) {
-        std::free(p);
-        return nullptr;
-    }
-    return std::realloc(p, ns);
-}
-
-ident *internal_state::lookup_ident(std::size_t idx) {
-    if (idx < MAX_ARGUMENTS) {
-        return argmap[idx];
-    }
-    mtx_guard l{ident_mtx};
-    return identmap[idx];
-}
-
-ident const *internal_state::lookup_ident(std::size_t idx) const {
-    if (idx < MAX_ARGUMENTS) {
-        return argmap[idx];
-    }
-    mtx_guard l{ident_mtx};
-    return identmap[idx];
-}
-
 void internal_state::foreach_ident(void (*f)(ident *, void *), void *data) {
     auto nids = identnum.load();
     for (std::size_t i = 0; i < nids; ++i) {
-        ident *id;
-        {
-            mtx_guard l{ident_mtx};
-            id = identmap[i];
-        }
-        f(id, data);
+        f(lookup_ident(i), data);
     }
 }
 
+void internal_state::insert_ident(ident *id, ident_impl *impl) {
+    ident_p{*id}.impl(impl);
+    idents[id->name()] = id;
+    std::size_t idx = identnum.load();
+    auto [seg, off] = ident_pos(idx);
+    if (!identmap[seg].load()) {
+        /* out of space, add a segment; the old ones stay in place */
+        identmap[seg].store(create_array<ident *>(IDENT_SEGMENT << seg));
+    }
+    identmap[seg].load()[off] = id;
+    impl->p_index = int(idx);
+    identnum.store(idx + 1);
+}
+
 ident *internal_state::add_ident(ident *id, ident_impl *impl) {
     if (!id) {
         return nullptr;
     }
-    ident_p{*id}.impl(impl);
-    {
-        mtx_guard l{ident_mtx};
-        idents[id->name()] = id;
-        impl->p_index = identnum++;
-        if (identnum > identcap) {
-            /* if we've run out of space, double it */
-            identcap *= 2;
-            auto *oldmap = identmap;
-            auto *newmap = create_array<ident *>(identcap);
-            std::memcpy(newmap, oldmap, sizeof(ident *) * impl->p_index);
-            identmap = newmap;
-            destroy_array(oldmap, identcap / 2);
-        }
-        identmap[impl->p_index] = id;
-        return id;
-    }
+    mtx_guard l{ident_mtx};
+    insert_ident(id, impl);
+    return id;
 }
 
 ident &internal_state::new_ident(state &cs, std::string_view name, int flags) {
     ident *id = get_ident(name);
-    if (!id) {
-        if (!is_valid_name(name)) {
-            throw error_p::make(
-                cs, "'%s' is not a valid identifier name", name.data()
-            );
-        }
-        auto *inst = create<alias_impl>(
-            cs, string_ref{cs, name}, flags
+    if (id) {
+        return *id;
+    }
+    if (!is_valid_name(name)) {
+        throw error_p::make(
+            cs, "'%s' is not a valid identifier name", name.data()
         );
-        id = add_ident(inst, inst);
     }
+    auto *inst = create<alias_impl>(cs, string_ref{cs, name}, flags);
+    {
+        /* another thread may have created it in the meantime */
+        mtx_guard l{ident_mtx};
+        auto it = idents.find(name);
+        if (it == idents.end()) {
+            insert_ident(inst, inst);
+            return *inst;
+        }
+        id = it->second;
+    }
+    destroy(inst);
     return *id;
 }
 
 ident *internal_state::get_ident(std::string_view name) const {
-    mtx_guard l{ident_mtx};
+    shared_mtx_guard l{ident_mtx};
     auto id = idents.find(name);
     if (id == idents.end()) {
         return nullptr;
@@ -129,13 +131,30 @@ ident *internal_state::get_ident(std::string_view name) const {
 
 /* public interfaces */
 
-state::state(): state{default_alloc, nullptr} {}
+static void destroy_state(thread_state *ts) {
+    auto *sp = ts->istate;
+    auto af = sp->allocf;
+    auto *ad = sp->aptr;
+    sp->destroy(ts);
+    sp->destroy(sp);
+    /* the heap of the builtin slab allocator goes with the state */
+    if (af == slab_alloc) {
+        slab_heap_free(static_cast<slab_heap *>(ad));
+    }
+}
+
+state::state(): state{builtin_alloc::SLAB} {}
+
+state::state(builtin_alloc a): state{
+    (a == builtin_alloc::SLAB) ? slab_alloc : malloc_alloc,
+    (a == builtin_alloc::SLAB) ? slab_heap_new() : nullptr
+} {}
 
 state::state(alloc_func func, void *data) {
     command *p;
 
     if (!func) {
-        func = default_alloc;
+        func = malloc_alloc;
     }
     /* allocator is not set up yet, use func directly */
     auto *statep = static_cast<internal_state *>(
@@ -148,6 +167,9 @@ state::state(alloc_func func, void *data) {
         p_tstate = statep->create<thread_state>(statep);
     } catch (...) {
         statep->destroy(statep);
+        if (func == slab_alloc) {
+            slab_heap_free(static_cast<slab_heap *>(data));
+        }
         throw;
     }
 
@@ -306,13 +328,19 @@ state::state(alloc_func func, void *data) {
     static_cast<command_impl *>(p)->p_type = ID_CONTINUE;
 }
 
+static void destroy_thread(thread_state *ts) {
+    if (ts->owner) {
+        destroy_state(ts);
+    } else {
+        ts->istate->destroy(ts);
+    }
+}
+
 LIBCUBESCRIPT_EXPORT state::~state() {
-    if (!p_tstate || !p_tstate->owner) {
+    if (!p_tstate) {
         return;
     }
-    auto *sp = p_tstate->istate;
-    sp->destroy(p_tstate);
-    sp->destroy(sp);
+    destroy_thread(p_tstate);
 }
 
 LIBCUBESCRIPT_EXPORT state::state(state &&s) {
@@ -320,18 +348,26 @@ LIBCUBESCRIPT_EXPORT state::state(state &&s) {
 }
 
 LIBCUBESCRIPT_EXPORT state &state::operator=(state &&s) {
-    if (p_tstate && p_tstate->owner) {
-        auto *sp = p_tstate->istate;
-        sp->destroy(p_tstate);
-        sp->destroy(sp);
+    if (p_tstate) {
+        destroy_thread(p_tstate);
     }
     p_tstate = s.p_tstate;
     s.p_tstate = nullptr;
+    if (p_tstate) {
+        p_tstate->pstate = this;
+    }
     return *this;
 }
 
 LIBCUBESCRIPT_EXPORT void state::swap(state &s) {
     std::swap(p_tstate, s.p_tstate);
+    /* the thread refers back to whichever object holds it now */
+    if (p_tstate) {
+        p_tstate->pstate = this;
+    }
+    if (s.p_tstate) {
+        s.p_tstate->pstate = &s;
+    }
 }
 
 state::state(void *is) {
@@ -402,8 +438,10 @@ LIBCUBESCRIPT_EXPORT void state::clear_override(ident &id) {
         case ident_type::ALIAS: {
             auto &ast = p_tstate->get_astack(static_cast<alias *>(&id));
             ast.node->val_s.set_string("", *this);
+            intern_alias_value(*this, ast.node->val_s);
             ast.node->code = bcode_ref{};
             ast.flags &= ~IDENT_FLAG_OVERRIDDEN;
+            static_cast<alias_impl &>(id).changed();
             return;
         }
         case ident_type::VAR: {
@@ -545,50 +583,9 @@ LIBCUBESCRIPT_EXPORT void state::assign_value(
 }
 
 LIBCUBESCRIPT_EXPORT any_value state::lookup_value(std::string_view name) {
-    ident *id = nullptr;
-    auto idopt = get_ident(name);
-    if (!idopt) {
-        id = nullptr;
-    } else {
-        id = &idopt->get();
-    }
-    alias_stack *ast;
+    auto *id = p_tstate->istate->get_ident(name);
     if (id) {
-        switch(id->type()) {
-            case ident_type::ALIAS: {
-                auto *a = static_cast<alias_impl *>(id);
-                ast = &p_tstate->get_astack(static_cast<alias *>(id));
-                if (ast->flags & IDENT_FLAG_UNKNOWN) {
-                    break;
-                }
-                if (a->is_arg() && !ident_is_used_arg(id, *p_tstate)) {
-                    return any_value{};
-                }
-                return ast->node->val_s.get_plain();
-            }
-            case ident_type::VAR:
-                return static_cast<builtin_var *>(id)->value();
-            case ident_type::COMMAND: {
-                any_value val{};
-                auto *cimpl = static_cast<command_impl *>(id);
-                auto &args = p_tstate->vmstack;
-                auto osz = args.size();
-                /* pad with as many empty values as we need */
-                args.resize(osz + cimpl->arg_count());
-                try {
-                    exec_command(
-                        *p_tstate, cimpl, cimpl, &args[osz], val, 0, true
-                    );
-                } catch (...) {
-                    args.resize(osz);
-                    throw;
-                }
-                args.resize(osz);
-                return val;
-            }
-            default:
-                return any_value{};
-        }
+        return cubescript::lookup_value(*p_tstate, *id);
     }
     throw error_p::make(*this, "unknown alias lookup: %s", name.data());
 }
@@ -742,6 +739,129 @@ LIBCUBESCRIPT_EXPORT bcode_ref state::compile(
     return gs.steal_ref();
 }
 
+/* one thread of a batch; the inputs are taken in order, so the first
+ * error a thread runs into is also the earliest of its inputs to fail,
+ * and its message is kept aside as the thread goes on compiling
+ */
+struct compile_worker {
+    std::size_t err_idx = std::size_t(-1);
+    charbuf msg;
+    std::exception_ptr eptr{};
+
+    compile_worker(internal_state *is): msg{is} {}
+
+    void run(
+        state &cs, span_type<compile_input const> inputs,
+        span_type<bcode_ref> ret, atomic_type<std::size_t> &next
+    ) {
+        for (;;) {
+            std::size_t i = next++;
+            if (i >= inputs.size()) {
+                return;
+            }
+            try {
+                ret[i] = cs.compile(inputs[i].code, inputs[i].source);
+            } catch (error const &e) {
+                if (err_idx > i) {
+                    err_idx = i;
+                    msg.append(e.what());
+                }
+            } catch (...) {
+                if (err_idx > i) {
+                    err_idx = i;
+                    eptr = std::current_exception();
+                }
+            }
+        }
+    }
+};
+
+LIBCUBESCRIPT_EXPORT void state::compile_all(
+    span_type<compile_input const> inputs, span_type<bcode_ref> ret,
+    std::size_t nthreads
+) {
+    auto *is = p_tstate->istate;
+    atomic_type<std::size_t> next{0};
+    compile_worker self{is};
+    compile_worker *fw = &self;
+#if LIBCUBESCRIPT_CONF_THREAD_SAFE
+    if (!nthreads) {
+        nthreads = std::thread::hardware_concurrency();
+    }
+    if (nthreads > inputs.size()) {
+        nthreads = inputs.size();
+    }
+    /* each side thread compiles with a thread of its own, so that they
+     * do not share the parser and generator scratch data
+     */
+    std::vector<state, std_allocator<state>> sides{std_allocator<state>{is}};
+    std::vector<compile_worker, std_allocator<compile_worker>> workers{
+        std_allocator<compile_worker>{is}
+    };
+    std::vector<std::thread, std_allocator<std::thread>> thrs{
+        std_allocator<std::thread>{is}
+    };
+    if (nthreads > 1) {
+        sides.reserve(nthreads - 1);
+        workers.reserve(nthreads - 1);
+        thrs.reserve(nthreads - 1);
+        for (std::size_t i = 0; i < (nthreads - 1); ++i) {
+            sides.push_back(new_thread());
+            workers.emplace_back(is);
+        }
+        for (std::size_t i = 0; i < (nthreads - 1); ++i) {
+            try {
+                thrs.emplace_back([&, i]() {
+                    workers[i].run(sides[i], inputs, ret, next);
+                });
+            } catch (...) {
+                /* whatever is left is compiled by the others */
+                break;
+            }
+        }
+    }
+    self.run(*this, inputs, ret, next);
+    for (auto &t: thrs) {
+        t.join();
+    }
+    /* the earliest failure wins */
+    for (auto &w: workers) {
+        if (w.err_idx < fw->err_idx) {
+            fw = &w;
+        }
+    }
+#else
+    static_cast<void>(nthreads);
+    self.run(*this, inputs, ret, next);
+#endif
+    if (fw->eptr) {
+        std::rethrow_exception(fw->eptr);
+    }
+    if (fw->err_idx != std::size_t(-1)) {
+        throw error{*this, fw->msg.str()};
+    }
+}
+
+LIBCUBESCRIPT_EXPORT string_ref state::save_code(
+    bcode_ref const &code, std::string_view v
+) {
+    charbuf buf{*p_tstate};
+    bcode_save(
+        *p_tstate, bcode_p{code}.get(), v,
+        image_cmd_hash(p_tstate->istate), buf
+    );
+    /* binary data nobody looks up, keep it out of the pool */
+    return p_tstate->istate->strman->make_transient(buf.str());
+}
+
+LIBCUBESCRIPT_EXPORT bcode_ref state::load_code(
+    std::string_view image, std::string_view v
+) {
+    return bcode_load(
+        *p_tstate, image, v, image_cmd_hash(p_tstate->istate)
+    );
+}
+
 LIBCUBESCRIPT_EXPORT bool state::override_mode() const {
     return (p_tstate->ident_flags & IDENT_FLAG_OVERRIDDEN);
 }
@@ -780,6 +900,16 @@ LIBCUBESCRIPT_EXPORT std::size_t state::max_call_depth(std::size_t v) {
     return old;
 }
 
+LIBCUBESCRIPT_EXPORT string_cache_info state::string_cache() const {
+    return p_tstate->istate->strman->get_cache();
+}
+
+LIBCUBESCRIPT_EXPORT void state::string_cache(
+    std::size_t max_entries, std::size_t max_bytes
+) {
+    p_tstate->istate->strman->set_cache(max_entries, max_bytes);
+}
+
 LIBCUBESCRIPT_EXPORT void std_init_all(state &cs) {
     std_init_base(cs);
     std_init_math(cs);
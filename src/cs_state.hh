@@ -7,6 +7,7 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <bit>
 
 #include "cs_bcode.hh"
 #include "cs_ident.hh"
@@ -17,6 +18,13 @@ namespace cubescript {
 struct internal_state;
 struct string_pool;
 
+/* the ident map is made of segments that never move once allocated, so
+ * it can be read without locking; the first segment holds IDENT_SEGMENT
+ * idents and each following one twice as many as the one before it
+ */
+static constexpr std::size_t IDENT_SEGMENT = 1024;
+static constexpr std::size_t IDENT_SEGMENTS = 32;
+
 template<typename T>
 struct std_allocator {
     using value_type = T;
@@ -50,11 +58,12 @@ struct internal_state {
         std::equal_to<std::string_view>,
         allocator_type
     > idents;
-    ident **identmap;
-    std::size_t identcap;
+    std::array<atomic_type<ident **>, IDENT_SEGMENTS> identmap;
     std::array<ident *, MAX_ARGUMENTS> argmap;
+    /* published once the ident is in the map */
     atomic_type<std::size_t> identnum;
-    mutable mutex_type ident_mtx;
+    /* taken by writers, and shared for the name lookup */
+    mutable shared_mutex_type ident_mtx;
 
     string_pool *strman;
     empty_block *empty;
@@ -75,10 +84,26 @@ struct internal_state {
 
     ~internal_state();
 
-    ident *lookup_ident(std::size_t idx);
-    ident const *lookup_ident(std::size_t idx) const;
+    /* the segment and the position within it of the given index */
+    static std::pair<std::size_t, std::size_t> ident_pos(std::size_t idx) {
+        std::size_t seg = std::bit_width(idx / IDENT_SEGMENT + 1) - 1;
+        return std::make_pair(
+            seg, idx - IDENT_SEGMENT * ((std::size_t(1) << seg) - 1)
+        );
+    }
+
+    ident *lookup_ident(std::size_t idx) const {
+        if (idx < MAX_ARGUMENTS) {
+            return argmap[idx];
+        }
+        auto [seg, off] = ident_pos(idx);
+        return identmap[seg].load()[off];
+    }
+
     void foreach_ident(void (*f)(ident *, void *), void *data);
 
+    /* with ident_mtx held */
+    void insert_ident(ident *id, ident_impl *impl);
     ident *add_ident(ident *id, ident_impl *impl);
     ident &new_ident(state &cs, std::string_view name, int flags);
     ident *get_ident(std::string_view name) const;
@@ -132,17 +157,17 @@ inline T *std_allocator<T>::allocate(std::size_t n) {
 
 template<typename T>
 inline void std_allocator<T>::deallocate(T *p, std::size_t n) {
-    istate->alloc(p, n, 0);
+    istate->alloc(p, n * sizeof(T), 0);
 }
 
 template<typename F>
-inline void new_cmd_quiet(
+inline command *new_cmd_quiet(
     state &cs, std::string_view name, std::string_view args, F &&f
 ) {
     try {
-        cs.new_command(name, args, std::forward<F>(f));
+        return &cs.new_command(name, args, std::forward<F>(f));
     } catch (error const &) {
-        return;
+        return nullptr;
     }
 }
 
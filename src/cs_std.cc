@@ -2,8 +2,93 @@
 
 #include "cs_thread.hh"
 
+#include <cstddef>
+
 namespace cubescript {
 
+/* the default chunk size, bigger requests get a chunk of their own */
+static constexpr std::size_t ARENA_CHUNK = 8192;
+
+struct alignas(std::max_align_t) compile_arena::chunk {
+    chunk *next;
+    std::size_t size;
+
+    unsigned char *data() {
+        return reinterpret_cast<unsigned char *>(this + 1);
+    }
+};
+
+static inline std::size_t arena_align(std::size_t n) {
+    auto a = alignof(std::max_align_t);
+    return (n + a - 1) & ~(a - 1);
+}
+
+compile_arena::~compile_arena() {
+    reset();
+    if (first) {
+        istate->alloc(first, sizeof(chunk) + first->size, 0);
+    }
+}
+
+void *compile_arena::alloc_chunk(std::size_t n) {
+    auto sz = (n > ARENA_CHUNK) ? n : ARENA_CHUNK;
+    auto *c = static_cast<chunk *>(
+        istate->alloc(nullptr, 0, sizeof(chunk) + sz)
+    );
+    c->next = nullptr;
+    c->size = sz;
+    if (last) {
+        last->next = c;
+    } else {
+        first = c;
+    }
+    last = c;
+    top = c->data() + n;
+    end = c->data() + sz;
+    return c->data();
+}
+
+void *compile_arena::allocate(std::size_t n) {
+    n = arena_align(n);
+    if (std::size_t(end - top) < n) {
+        return alloc_chunk(n);
+    }
+    auto *ret = top;
+    top += n;
+    return ret;
+}
+
+void compile_arena::deallocate(void *p, std::size_t n) {
+    auto *up = static_cast<unsigned char *>(p);
+    /* only the last allocation can be given back */
+    if (last && ((up + arena_align(n)) == top) && (up >= last->data())) {
+        top = up;
+    }
+}
+
+void compile_arena::reset() {
+    if (!first) {
+        return;
+    }
+    auto *c = first->next;
+    while (c) {
+        auto *n = c->next;
+        istate->alloc(c, sizeof(chunk) + c->size, 0);
+        c = n;
+    }
+    /* an oversized first chunk is not worth keeping */
+    if (first->size > ARENA_CHUNK) {
+        istate->alloc(first, sizeof(chunk) + first->size, 0);
+        first = last = nullptr;
+        top = end = nullptr;
+        return;
+    }
+    first->next = nullptr;
+    last = first;
+    top = first->data();
+    end = first->data() + first->size;
+}
+
 charbuf::charbuf(state &cs): charbuf{state_p{cs}.ts().istate} {}
 charbuf::charbuf(thread_state &ts): charbuf{ts.istate} {}
 
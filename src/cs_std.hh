@@ -14,13 +14,92 @@
 
 namespace cubescript {
 
-/* a value buffer */
+/* a bump-pointer arena for scratch memory that dies all at once, such as
+ * what the parser and code generator use while compiling; it is carved
+ * out of chunks allocated through the state, freeing is a no-op unless
+ * it is the most recent allocation, and reset() gives everything back
+ * except for the first chunk, which is kept around for the next use
+ */
+
+struct compile_arena {
+    compile_arena() = delete;
+    compile_arena(internal_state *cs): istate{cs} {}
+
+    compile_arena(compile_arena const &) = delete;
+    compile_arena &operator=(compile_arena const &) = delete;
+
+    ~compile_arena();
+
+    void *allocate(std::size_t n);
+    void deallocate(void *p, std::size_t n);
+
+    void reset();
+
+    internal_state *istate;
+    /* the chunks in allocation order, the last one being the current */
+    struct chunk;
+    chunk *first = nullptr;
+    chunk *last = nullptr;
+    unsigned char *top = nullptr;
+    unsigned char *end = nullptr;
+    /* the number of live scopes, it is reset when the last one exits */
+    std::size_t users = 0;
+
+private:
+    void *alloc_chunk(std::size_t n);
+};
+
+/* marks a use of the arena; nested scopes share the memory and only the
+ * outermost one resets it, as outer buffers may grow during inner scopes
+ */
+
+struct arena_scope {
+    arena_scope(compile_arena &a): arena{a} { ++a.users; }
+    ~arena_scope() {
+        if (!--arena.users) {
+            arena.reset();
+        }
+    }
+
+    arena_scope(arena_scope const &) = delete;
+    arena_scope &operator=(arena_scope const &) = delete;
+
+    compile_arena &arena;
+};
 
 template<typename T>
+struct arena_allocator {
+    using value_type = T;
+
+    arena_allocator(compile_arena &a): arena{&a} {}
+
+    template<typename U>
+    arena_allocator(arena_allocator<U> const &a): arena{a.arena} {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) {
+        arena->deallocate(p, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(arena_allocator<U> const &a) const {
+        return arena == a.arena;
+    }
+
+    compile_arena *arena;
+};
+
+/* a value buffer */
+
+template<typename T, typename AL = std_allocator<T>>
 struct valbuf {
     valbuf() = delete;
 
     valbuf(internal_state *cs): buf{std_allocator<T>{cs}} {}
+    valbuf(AL const &a): buf{a} {}
 
     using size_type = std::size_t;
     using value_type = T;
@@ -66,18 +145,22 @@ struct valbuf {
     T *data() { return buf.data(); }
     T const *data() const { return buf.data(); }
 
-    std::vector<T, std_allocator<T>> buf;
+    std::vector<T, AL> buf;
 };
 
+/* value buffer in the compile arena */
+
+template<typename T>
+using arenabuf = valbuf<T, arena_allocator<T>>;
+
 /* specialization of value buffer for bytes */
 
-struct charbuf: valbuf<char> {
-    charbuf(internal_state *cs): valbuf<char>{cs} {}
-    charbuf(state &cs);
-    charbuf(thread_state &ts);
+template<typename AL>
+struct basic_charbuf: valbuf<char, AL> {
+    using valbuf<char, AL>::valbuf;
 
     void append(char const *beg, char const *end) {
-        valbuf<char>::append(beg, end);
+        valbuf<char, AL>::append(beg, end);
     }
 
     void append(std::string_view v) {
@@ -85,12 +168,98 @@ struct charbuf: valbuf<char> {
     }
 
     std::string_view str() {
-        return std::string_view{buf.data(), buf.size()};
+        return std::string_view{this->buf.data(), this->buf.size()};
     }
 
     std::string_view str_term() {
-        return std::string_view{buf.data(), buf.size() - 1};
+        return std::string_view{this->buf.data(), this->buf.size() - 1};
+    }
+};
+
+struct charbuf: basic_charbuf<std_allocator<char>> {
+    charbuf(internal_state *cs): basic_charbuf{cs} {}
+    charbuf(state &cs);
+    charbuf(thread_state &ts);
+};
+
+/* byte buffer in the compile arena, for the parser */
+
+using arena_charbuf = basic_charbuf<arena_allocator<char>>;
+
+/* a stack buffer; unlike valbuf it never moves its elements, so references
+ * to them stay valid as it grows, which is needed e.g. for alias stacks
+ * that link into it; the storage is allocated in fixed-size chunks that
+ * are kept around until the buffer is destroyed
+ */
+
+template<typename T, std::size_t N = 32>
+struct stackbuf {
+    stackbuf() = delete;
+
+    stackbuf(internal_state *cs): chunks{std_allocator<T *>{cs}} {}
+
+    stackbuf(stackbuf const &) = delete;
+    stackbuf &operator=(stackbuf const &) = delete;
+
+    ~stackbuf() {
+        clear();
+        std_allocator<T> al{chunks.get_allocator()};
+        for (std::size_t i = 0; i < chunks.size(); ++i) {
+            al.deallocate(chunks[i], N);
+        }
     }
+
+    using size_type = std::size_t;
+    using value_type = T;
+    using reference = T &;
+    using const_reference = T const &;
+
+    template<typename ...A>
+    reference emplace_back(A &&...args) {
+        if ((nelem / N) >= chunks.size()) {
+            chunks.reserve(chunks.size() + 1);
+            chunks.push_back(
+                std_allocator<T>{chunks.get_allocator()}.allocate(N)
+            );
+        }
+        auto *p = new (chunks[nelem / N] + (nelem % N)) T(
+            std::forward<A>(args)...
+        );
+        ++nelem;
+        return *p;
+    }
+
+    void pop_back() {
+        (*this)[--nelem].~T();
+    }
+
+    void resize(std::size_t s) {
+        while (nelem > s) {
+            pop_back();
+        }
+        while (nelem < s) {
+            emplace_back();
+        }
+    }
+
+    T &back() { return (*this)[nelem - 1]; }
+    T const &back() const { return (*this)[nelem - 1]; }
+
+    std::size_t size() const { return nelem; }
+
+    bool empty() const { return !nelem; }
+
+    void clear() {
+        while (nelem) {
+            pop_back();
+        }
+    }
+
+    T &operator[](std::size_t i) { return chunks[i / N][i % N]; }
+    T const &operator[](std::size_t i) const { return chunks[i / N][i % N]; }
+
+    std::vector<T *, std_allocator<T *>> chunks;
+    std::size_t nelem = 0;
 };
 
 /* because the dual-iterator constructor is not supported everywhere
@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cstring>
+#include <new>
 #include <cubescript/cubescript.hh>
 
 #include "cs_strman.hh"
@@ -11,119 +12,437 @@ namespace cubescript {
 struct string_ref_state {
     internal_state *state;
     std::size_t length;
-    std::size_t refcount;
+    std::size_t hash;
+    atomic_type<std::size_t> refcount;
+    /* transient strings are not in the pool, see make_transient() */
+    bool transient;
+    /* the cache node of a dead string kept around, or zero */
+    std::uint32_t cached;
 };
 
+static inline std::size_t ref_state_size(string_ref_state const *st) {
+    return st->length + sizeof(string_ref_state) + 1;
+}
+
 inline string_ref_state *get_ref_state(char const *ptr) {
     string_ref_state *r;
     std::memcpy(&r, &ptr, sizeof(r));
     return r - 1;
 }
 
+inline char const *get_ref_str(string_ref_state *st) {
+    st += 1;
+    char const *r;
+    std::memcpy(&r, &st, sizeof(r));
+    return r;
+}
+
+/* increments the reference count of a string found in the table, unless
+ * it has already dropped to zero; in that case the string is on its way
+ * out (its last reference is waiting for the shard lock to remove it) and
+ * must be treated as if it was not there
+ */
+static bool try_ref(string_ref_state *st) {
+    auto rc = st->refcount.load();
+    while (rc) {
+        if (st->refcount.compare_exchange_weak(rc, rc + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static constexpr std::size_t STRPOOL_SHARD_INIT = 64;
+
+string_pool::shard::~shard() {
+    evict_all();
+    if (cache) {
+        cstate->destroy_array(cache, cache_size + 1);
+    }
+    if (slots) {
+        cstate->destroy_array(slots, mask + 1);
+    }
+}
+
+string_pool::slot *string_pool::shard::find(
+    std::size_t hash, std::string_view str
+) const {
+    for (auto i = hash & mask;; i = (i + 1) & mask) {
+        auto &sl = slots[i];
+        if (!sl.str) {
+            return &sl;
+        }
+        if (
+            (sl.hash == hash) && (sl.str->length == str.size()) &&
+            !std::memcmp(get_ref_str(sl.str), str.data(), str.size())
+        ) {
+            return &sl;
+        }
+    }
+}
+
+void string_pool::shard::insert(std::size_t hash, string_ref_state *str) {
+    /* keep the load factor at most 3/4 */
+    if ((nused + 1) * 4 > (mask + 1) * 3) {
+        grow();
+    }
+    auto i = hash & mask;
+    while (slots[i].str) {
+        i = (i + 1) & mask;
+    }
+    slots[i].hash = hash;
+    slots[i].str = str;
+    ++nused;
+}
+
+void string_pool::shard::remove(std::size_t hash, string_ref_state *str) {
+    auto i = hash & mask;
+    for (;; i = (i + 1) & mask) {
+        if (!slots[i].str) {
+            /* replaced by a fresh copy in the meantime */
+            return;
+        }
+        if (slots[i].str == str) {
+            break;
+        }
+    }
+    /* backward shift deletion, so that no tombstones are needed; every
+     * following entry that would become unreachable is moved into the hole
+     */
+    for (auto j = (i + 1) & mask; slots[j].str; j = (j + 1) & mask) {
+        auto home = slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i] = slot{};
+    --nused;
+}
+
+string_pool::slot *string_pool::shard::find_ptr(
+    std::size_t hash, string_ref_state *str
+) const {
+    for (auto i = hash & mask; slots[i].str; i = (i + 1) & mask) {
+        if (slots[i].str == str) {
+            return &slots[i];
+        }
+    }
+    return nullptr;
+}
+
+bool string_pool::shard::retain(string_ref_state *str) {
+    auto sz = ref_state_size(str);
+    if (!cache_size || (sz > cache_max_bytes) || !find_ptr(str->hash, str)) {
+        return false;
+    }
+    while (!cache_free || ((cache_bytes + sz) > cache_max_bytes)) {
+        evict();
+    }
+    auto idx = cache_free;
+    auto &nd = cache[idx];
+    cache_free = nd.next;
+    nd.str = str;
+    nd.prev = 0;
+    nd.next = cache_head;
+    if (cache_head) {
+        cache[cache_head].prev = idx;
+    } else {
+        cache_tail = idx;
+    }
+    cache_head = idx;
+    str->cached = idx;
+    ++cache_used;
+    cache_bytes += sz;
+    return true;
+}
+
+void string_pool::shard::unlink(string_ref_state *str) {
+    auto idx = str->cached;
+    auto &nd = cache[idx];
+    if (nd.prev) {
+        cache[nd.prev].next = nd.next;
+    } else {
+        cache_head = nd.next;
+    }
+    if (nd.next) {
+        cache[nd.next].prev = nd.prev;
+    } else {
+        cache_tail = nd.prev;
+    }
+    nd.str = nullptr;
+    nd.next = cache_free;
+    cache_free = idx;
+    --cache_used;
+    cache_bytes -= ref_state_size(str);
+    str->cached = 0;
+}
+
+void string_pool::shard::revive(string_ref_state *str) {
+    unlink(str);
+    /* nobody else can see a dead string without holding the lock */
+    str->refcount.store(1);
+    ++cache_hits;
+}
+
+void string_pool::shard::evict() {
+    auto *str = cache[cache_tail].str;
+    unlink(str);
+    remove(str->hash, str);
+    cstate->alloc(str, ref_state_size(str), 0);
+}
+
+void string_pool::shard::evict_all() {
+    while (cache_tail) {
+        evict();
+    }
+}
+
+void string_pool::shard::set_cache(std::size_t entries, std::size_t bytes) {
+    evict_all();
+    if (cache) {
+        cstate->destroy_array(cache, cache_size + 1);
+        cache = nullptr;
+    }
+    cache_size = 0;
+    cache_max_bytes = bytes;
+    if (!entries || !bytes) {
+        return;
+    }
+    cache_size = std::uint32_t(entries);
+    cache = cstate->create_array<cache_node>(cache_size + 1);
+    /* node 0 is the null node, the rest start out free */
+    for (std::uint32_t i = 1; i <= cache_size; ++i) {
+        cache[i] = cache_node{nullptr, 0, (i < cache_size) ? (i + 1) : 0};
+    }
+    cache_free = 1;
+}
+
+void string_pool::shard::grow() {
+    auto *oslots = slots;
+    auto osize = slots ? (mask + 1) : 0;
+    auto nsize = osize ? (osize * 2) : STRPOOL_SHARD_INIT;
+    slots = cstate->create_array<slot>(nsize);
+    mask = nsize - 1;
+    for (std::size_t i = 0; i < osize; ++i) {
+        if (!oslots[i].str) {
+            continue;
+        }
+        auto j = oslots[i].hash & mask;
+        while (slots[j].str) {
+            j = (j + 1) & mask;
+        }
+        slots[j] = oslots[i];
+    }
+    if (oslots) {
+        cstate->destroy_array(oslots, osize);
+    }
+}
+
+string_pool::string_pool(internal_state *cs): cstate{cs} {
+    for (auto &sh: shards) {
+        sh = cs->create<shard>(cs);
+        sh->grow();
+    }
+    set_cache(STRPOOL_CACHE_ENTRIES, STRPOOL_CACHE_BYTES);
+}
+
+void string_pool::set_cache(std::size_t entries, std::size_t bytes) {
+    if (!entries || !bytes) {
+        entries = bytes = 0;
+    }
+    cache_entries = entries;
+    cache_bytes = bytes;
+    /* every shard gets its share, the first ones what is left over, so
+     * that the shards together never go over the limits
+     */
+    for (std::size_t i = 0; i < STRPOOL_SHARDS; ++i) {
+        auto sentries = entries / STRPOOL_SHARDS;
+        auto sbytes = bytes / STRPOOL_SHARDS;
+        sentries += (i < (entries % STRPOOL_SHARDS));
+        sbytes += (i < (bytes % STRPOOL_SHARDS));
+        mtx_guard l{shards[i]->p_mtx};
+        shards[i]->set_cache(sentries, sbytes);
+    }
+}
+
+string_cache_info string_pool::get_cache() const {
+    string_cache_info ret{cache_entries, cache_bytes, 0, 0, 0, 0};
+    for (auto *sh: shards) {
+        mtx_guard l{sh->p_mtx};
+        ret.entries += sh->cache_used;
+        ret.bytes += sh->cache_bytes;
+        ret.hits += sh->cache_hits;
+        ret.misses += sh->cache_misses;
+    }
+    return ret;
+}
+
+string_pool::~string_pool() {
+    for (auto *sh: shards) {
+        cstate->destroy(sh);
+    }
+}
+
 char const *string_pool::add(std::string_view str) {
-    {
-        mtx_guard l{p_mtx};
-        auto it = counts.find(str);
-        /* already present: just increment ref */
-        if (it != counts.end()) {
-            auto *st = it->second;
-            /* having a null pointer is the same as non-existence */
-            if (st) {
-                ++st->refcount;
-                st += 1;
-                char const *r;
-                std::memcpy(&r, &st, sizeof(r));
-                return r;
-            }
+    if (str.size() >= STRPOOL_INTERN_MAX) {
+        /* too long to be worth hashing and sharing */
+        return new_transient(str);
+    }
+    auto h = hash_str(str);
+    auto &sh = get_shard(h);
+    mtx_guard l{sh.p_mtx};
+    auto *sl = sh.find(h, str);
+    /* already present: just increment ref, or bring it back from the dead */
+    if (sl->str) {
+        if (try_ref(sl->str)) {
+            return get_ref_str(sl->str);
+        }
+        if (sl->str->cached) {
+            sh.revive(sl->str);
+            return get_ref_str(sl->str);
         }
     }
-    /* not present: allocate brand new data */
+    ++sh.cache_misses;
+    /* not present: allocate brand new data; this is done with the lock
+     * held so that two threads adding the same string never both succeed
+     */
     auto ss = str.size();
     auto strp = alloc_buf(ss);
     /* write string data, it's already pre-terminated */
     memcpy(strp, str.data(), ss);
-    /* store it */
-    {
-        mtx_guard l{p_mtx};
-        counts.emplace(std::string_view{strp, ss}, get_ref_state(strp));
+    auto *st = get_ref_state(strp);
+    st->hash = h;
+    /* store it; a dying entry is simply replaced in its slot */
+    if (sl->str) {
+        sl->str = st;
+    } else {
+        sh.insert(h, st);
     }
     return strp;
 }
 
 char const *string_pool::internal_ref(char const *ptr) {
-    auto *ss = get_ref_state(ptr);
-    {
-        mtx_guard l{p_mtx};
-        ++ss->refcount;
-    }
+    /* the caller holds a reference, so this can never race with removal */
+    get_ref_state(ptr)->refcount++;
     return ptr;
 }
 
 string_ref string_pool::steal(char *ptr) {
     auto *ss = get_ref_state(ptr);
     auto sr = std::string_view{ptr, ss->length};
+    if (sr.size() >= STRPOOL_INTERN_MAX) {
+        ss->transient = true;
+        return string_ref_from(ptr);
+    }
+    auto h = hash_str(sr);
+    ss->hash = h;
     string_ref_state *st = nullptr;
     {
-        mtx_guard l{p_mtx};
+        auto &sh = get_shard(h);
+        mtx_guard l{sh.p_mtx};
         /* much like add(), but we already have memory */
-        auto it = counts.find(sr);
-        if (it != counts.end()) {
-            st = it->second;
+        auto *sl = sh.find(h, sr);
+        if (sl->str && try_ref(sl->str)) {
+            st = sl->str;
+        } else if (sl->str && sl->str->cached) {
+            sh.revive(sl->str);
+            st = sl->str;
+        } else if (sl->str) {
+            ++sh.cache_misses;
+            /* the buffer comes with a reference, which we hand over below */
+            sl->str = ss;
+        } else {
+            ++sh.cache_misses;
+            sh.insert(h, ss);
         }
     }
     if (st) {
         /* the buffer is superfluous now */
-        cstate->alloc(ss, ss->length + sizeof(string_ref_state) + 1, 0);
-        st += 1;
-        char const *rp;
-        std::memcpy(&rp, &st, sizeof(rp));
-        return string_ref{rp};
-    } else {
-        mtx_guard l{p_mtx};
-        ss->refcount = 0; /* string_ref will increment it */
-        counts.emplace(sr, ss);
+        cstate->alloc(ss, ref_state_size(ss), 0);
+        ss = st;
     }
-    return string_ref{ptr};
+    return string_ref_from(get_ref_str(ss));
+}
+
+char const *string_pool::new_transient(std::string_view str) {
+    auto strp = alloc_buf(str.size());
+    if (!str.empty()) {
+        memcpy(strp, str.data(), str.size());
+    }
+    get_ref_state(strp)->transient = true;
+    return strp;
+}
+
+string_ref string_pool::make_transient(std::string_view str) {
+    return string_ref_from(new_transient(str));
+}
+
+string_ref string_pool::intern(string_ref const &str) {
+    auto *ss = get_ref_state(str.p_str);
+    if (!ss->transient || (ss->length >= STRPOOL_INTERN_MAX)) {
+        return str;
+    }
+    return string_ref_from(add(std::string_view{str.p_str, ss->length}));
+}
+
+/* wraps a fresh string holding a single reference, which is handed over */
+string_ref string_pool::string_ref_from(char const *ptr) {
+    string_ref ret{ptr};
+    internal_unref(ptr);
+    return ret;
+}
+
+bool str_managed_transient(char const *str) {
+    return get_ref_state(str)->transient;
+}
+
+void set_transient_string(state &cs, any_value &v, std::string_view str) {
+    /* short strings are kept inline by any_value, which is even cheaper */
+    if (str.size() < sizeof(void *)) {
+        v.set_string(str, cs);
+        return;
+    }
+    v.set_string(state_p{cs}.ts().istate->strman->make_transient(str));
 }
 
 void string_pool::internal_unref(char const *ptr) {
     auto *ss = get_ref_state(ptr);
-    if (mtx_guard l{p_mtx}; !--ss->refcount) {
-        /* refcount zero, so ditch it
-         * this path is a little slow...
-         */
-        auto sr = std::string_view{ptr, ss->length};
-        auto it = counts.find(sr);
-        /* this should *never* happen unless we have a bug */
-#ifndef NDEBUG
-        assert(it != counts.end());
-#else
-        if (it == counts.end()) {
-            abort();
-        }
-#endif
-        /* we're freeing the key */
-        counts.erase(it);
-    } else {
+    if (ss->refcount-- != 1) {
+        return;
+    }
+    if (ss->transient) {
+        /* not in the pool, so nobody else can find it */
+        cstate->alloc(ss, ref_state_size(ss), 0);
         return;
     }
+    /* refcount zero, so cache it or ditch it; nothing can revive the
+     * string until it is in the cache, as lookups skip dead entries, but
+     * the entry may have been replaced by a fresh string with the same
+     * contents, which must be left alone; the slot is located by the
+     * stored hash and the pointer alone
+     */
+    {
+        auto &sh = get_shard(ss->hash);
+        mtx_guard l{sh.p_mtx};
+        if (sh.retain(ss)) {
+            return;
+        }
+        sh.remove(ss->hash, ss);
+    }
     /* dealloc */
-    cstate->alloc(ss, ss->length + sizeof(string_ref_state) + 1, 0);
+    cstate->alloc(ss, ref_state_size(ss), 0);
 }
 
 char const *string_pool::find(std::string_view str) const {
-    string_ref_state *sp;
-    {
-        mtx_guard l{p_mtx};
-        auto it = counts.find(str);
-        if (it == counts.end()) {
-            return nullptr;
-        }
-        sp = it->second + 1;
+    auto h = hash_str(str);
+    auto &sh = get_shard(h);
+    mtx_guard l{sh.p_mtx};
+    auto *sl = sh.find(h, str);
+    if (!sl->str || !sl->str->refcount.load()) {
+        return nullptr;
     }
-    char const *rp;
-    std::memcpy(&rp, &sp, sizeof(rp));
-    return rp;
+    return get_ref_str(sl->str);
 }
 
 std::string_view string_pool::get(char const *ptr) const {
@@ -133,11 +452,8 @@ std::string_view string_pool::get(char const *ptr) const {
 
 char *string_pool::alloc_buf(std::size_t len) const {
     auto mem = cstate->alloc(nullptr, 0, len + sizeof(string_ref_state) + 1);
-    /* write length and initial refcount */
-    auto *sst = static_cast<string_ref_state *>(mem);
-    sst->state = cstate;
-    sst->length = len;
-    sst->refcount = 1;
+    /* write length and initial refcount, the hash is filled in later */
+    auto *sst = new (mem) string_ref_state{cstate, len, 0, 1, false, 0};
     /* pre-terminate */
     char *strp;
     sst += 1;
@@ -194,11 +510,18 @@ LIBCUBESCRIPT_EXPORT string_ref::operator std::string_view() const {
 }
 
 LIBCUBESCRIPT_EXPORT bool string_ref::operator==(string_ref const &s) const {
-    return p_str == s.p_str;
+    if (p_str == s.p_str) {
+        return true;
+    }
+    /* transient strings may exist in more than one copy */
+    if (str_managed_transient(p_str) || str_managed_transient(s.p_str)) {
+        return view() == s.view();
+    }
+    return false;
 }
 
 LIBCUBESCRIPT_EXPORT bool string_ref::operator!=(string_ref const &s) const {
-    return p_str != s.p_str;
+    return !(*this == s);
 }
 
 } /* namespace cubescript */
@@ -3,7 +3,9 @@
 
 #include <cubescript/cubescript.hh>
 
-#include <unordered_map>
+#include <array>
+#include <climits>
+#include <cstdint>
 #include <string_view>
 
 #include "cs_std.hh"
@@ -17,6 +19,24 @@ struct string_ref_state;
 char const *str_managed_ref(char const *str);
 void str_managed_unref(char const *str);
 std::string_view str_managed_view(char const *str);
+bool str_managed_transient(char const *str);
+
+/* sets the value to a transient copy of the string; meant for the results
+ * of commands that build strings, which may be large and are usually gone
+ * again soon after
+ */
+void set_transient_string(state &cs, any_value &v, std::string_view str);
+
+/* internal access to values, so that the VM can push managed strings it
+ * already holds (such as string constants) with just a reference bump
+ */
+struct any_value_p {
+    any_value_p(any_value &v): vp{&v} {}
+
+    void set_managed(char const *str);
+
+    any_value *vp;
+};
 
 /* string manager
  *
@@ -30,16 +50,43 @@ std::string_view str_managed_view(char const *str);
  * as a part of the string's memory, so it can be easily accessed using just
  * the pointer to the string, but also this is transparent for usage
  *
- * the string manager is thread-safe, so it should be usable in any context
+ * the string manager is thread-safe, so it should be usable in any context;
+ * the table is split into shards by hash, each with its own lock, so that
+ * threads interning unrelated strings do not contend with each other, and
+ * the reference counts themselves are atomic and never take a lock unless
+ * the count drops to zero and the string has to be removed
+ *
+ * each shard is a flat open-addressing table with linear probing; the hash
+ * of a string is computed once and kept in both its header and its slot, so
+ * probing mostly compares hashes and removal never looks at the contents
+ *
+ * besides interned strings, there are transient strings; those look the
+ * same and are refcounted the same, but they are never put in the table,
+ * so creating them costs no hashing and no locking, and there may be more
+ * than one copy of the same contents; strings past STRPOOL_INTERN_MAX are
+ * always transient, shorter ones get interned once stored long-term
+ *
+ * interned strings whose reference count drops to zero are not freed right
+ * away; they stay in the table and are put in a bounded cache, from which
+ * add() and steal() revive them, so that strings which are made and dropped
+ * over and over (such as list items or numbers turned into strings) do not
+ * pay for an allocation and a table insertion every time; each shard has
+ * its own part of the cache, from which the least recently dropped strings
+ * are evicted (and only then freed) once it is over its limits
  */
 
+static constexpr std::size_t STRPOOL_SHARD_BITS = 4;
+static constexpr std::size_t STRPOOL_SHARDS = 1 << STRPOOL_SHARD_BITS;
+static constexpr std::size_t STRPOOL_INTERN_MAX = 1 << 14;
+
+/* the default limits of the cache of dead strings, for the whole pool */
+static constexpr std::size_t STRPOOL_CACHE_ENTRIES = 1024;
+static constexpr std::size_t STRPOOL_CACHE_BYTES = 1 << 16;
+
 struct string_pool {
-    using allocator_type = std_allocator<
-        std::pair<std::string_view const, string_ref_state *>
-    >;
     string_pool() = delete;
-    string_pool(internal_state *cs): cstate{cs}, counts{allocator_type{cs}} {}
-    ~string_pool() {}
+    string_pool(internal_state *cs);
+    ~string_pool();
 
     string_pool(string_pool const &) = delete;
     string_pool(string_pool &&) = delete;
@@ -69,6 +116,14 @@ struct string_pool {
      */
     void internal_unref(char const *ptr);
 
+    /* creates a transient string, bypassing the table */
+    string_ref make_transient(std::string_view str);
+
+    /* gets an interned version of a managed string for long-term storage;
+     * interned strings and transient strings that are too long are kept
+     */
+    string_ref intern(string_ref const &str);
+
     /* just finds a managed pointer with the same contents
      * as the input, if not found then a null pointer is returned
      */
@@ -82,14 +137,105 @@ struct string_pool {
      */
     char *alloc_buf(std::size_t len) const;
 
+    char const *new_transient(std::string_view str);
+    string_ref string_ref_from(char const *ptr);
+
+    /* sets the limits of the dead string cache, evicting everything in it;
+     * the limits are split evenly between the shards, zero disables it
+     */
+    void set_cache(std::size_t entries, std::size_t bytes);
+
+    /* the current state of the cache, summed up over the shards */
+    string_cache_info get_cache() const;
+
+    struct slot {
+        std::size_t hash = 0;
+        /* a null pointer marks an empty slot */
+        string_ref_state *str = nullptr;
+    };
+
+    struct shard {
+        shard(internal_state *cs): cstate{cs} {}
+        ~shard();
+
+        /* returns the slot holding the given string, or the empty slot
+         * which ends its probe sequence if it's not present
+         */
+        slot *find(std::size_t hash, std::string_view str) const;
+
+        /* inserts a string known not to be present */
+        void insert(std::size_t hash, string_ref_state *str);
+
+        /* removes the given exact string, if still present */
+        void remove(std::size_t hash, string_ref_state *str);
+
+        /* finds the slot of the given exact string, if present */
+        slot *find_ptr(std::size_t hash, string_ref_state *str) const;
+
+        void grow();
+
+        /* puts a string that just died in the cache, unless it does not
+         * fit or is not in the table anymore, in which case the caller is
+         * supposed to free it
+         */
+        bool retain(string_ref_state *str);
+
+        /* takes a cached string out of the cache with a fresh reference */
+        void revive(string_ref_state *str);
+
+        /* drops the least recently cached string from the table and frees
+         * it, or all of them
+         */
+        void evict();
+        void evict_all();
+
+        /* takes a string out of the cache list, leaving it dead */
+        void unlink(string_ref_state *str);
+
+        void set_cache(std::size_t entries, std::size_t bytes);
+
+        internal_state *cstate;
+        mutable mutex_type p_mtx{};
+        slot *slots = nullptr;
+        std::size_t mask = 0;
+        std::size_t nused = 0;
+
+        /* the cache is a list of nodes from the most recently dropped
+         * string to the least recently dropped one, linked by index, with
+         * 0 as the null index; cached strings keep the index of their node
+         */
+        struct cache_node {
+            string_ref_state *str;
+            std::uint32_t prev, next;
+        };
+        cache_node *cache = nullptr;
+        std::uint32_t cache_size = 0;
+        std::uint32_t cache_head = 0;
+        std::uint32_t cache_tail = 0;
+        std::uint32_t cache_free = 0;
+        std::size_t cache_used = 0;
+        std::size_t cache_bytes = 0;
+        std::size_t cache_max_bytes = 0;
+        std::size_t cache_hits = 0;
+        std::size_t cache_misses = 0;
+    };
+
+    static std::size_t hash_str(std::string_view str) {
+        return std::hash<std::string_view>{}(str);
+    }
+
+    /* picks the shard using the top bits of the hash, since the bottom
+     * bits are what the table uses to pick a slot
+     */
+    shard &get_shard(std::size_t h) const {
+        return *shards[h >> (sizeof(h) * CHAR_BIT - STRPOOL_SHARD_BITS)];
+    }
+
     internal_state *cstate;
-    mutable mutex_type p_mtx{};
-    std::unordered_map<
-        std::string_view, string_ref_state *,
-        std::hash<std::string_view>,
-        std::equal_to<std::string_view>,
-        allocator_type
-    > counts;
+    std::array<shard *, STRPOOL_SHARDS> shards;
+    /* the limits as given, for reporting */
+    std::size_t cache_entries = 0;
+    std::size_t cache_bytes = 0;
 };
 
 } /* namespace cubescript */
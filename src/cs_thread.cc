@@ -5,10 +5,16 @@
 namespace cubescript {
 
 thread_state::thread_state(internal_state *cs):
-    vmstack{cs}, idstack{cs}, callstack{cs}, astacks{cs}, errbuf{cs}
-{
-    vmstack.reserve(32);
-    idstack.reserve(MAX_ARGUMENTS);
+    vmstacks{cs}, idstack{cs}, callstack{cs}, frames{cs},
+    astacks{cs}, errbuf{cs}, arena{cs}
+{}
+
+thread_state::~thread_state() {
+    for (std::size_t i = 0; i < astacks.size(); ++i) {
+        if (astacks[i]) {
+            istate->destroy_array(astacks[i], ASTACK_PAGE);
+        }
+    }
 }
 
 hook_func thread_state::set_hook(hook_func f) {
@@ -17,16 +23,35 @@ hook_func thread_state::set_hook(hook_func f) {
     return hk;
 }
 
-alias_stack &thread_state::get_astack(alias const *a) {
-    auto it = astacks.try_emplace(a->index());
-    if (it.second) {
+valbuf<any_value> &thread_state::enter_vmstack() {
+    if (native_depth == vmstacks.size()) {
+        vmstacks.emplace_back(istate).reserve(32);
+    }
+    return vmstacks[native_depth++];
+}
+
+void thread_state::leave_vmstack() {
+    vmstacks[--native_depth].clear();
+}
+
+alias_stack &thread_state::init_astack(alias const *a) {
+    auto idx = std::size_t(a->index());
+    auto pg = idx / ASTACK_PAGE;
+    if (pg >= astacks.size()) {
+        astacks.resize(pg + 1, nullptr);
+    }
+    if (!astacks[pg]) {
+        astacks[pg] = istate->create_array<alias_stack>(ASTACK_PAGE);
+    }
+    auto &ast = astacks[pg][idx % ASTACK_PAGE];
+    if (!ast.node) {
         auto *imp = const_cast<alias_impl *>(
             static_cast<alias_impl const *>(a)
         );
-        it.first->second.node = &imp->p_initial;
-        it.first->second.flags = imp->p_flags;
+        ast.node = &imp->p_initial;
+        ast.flags = imp->p_flags;
     }
-    return it.first->second;
+    return ast;
 }
 
 char *thread_state::request_errbuf(std::size_t bufs, char *&sp) {
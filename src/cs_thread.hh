@@ -18,24 +18,79 @@ struct ident_level {
     ident_level(ident &i): id{i} {};
 };
 
+/* kinds of VM frames, i.e. what has pushed them */
+enum {
+    VM_FRAME_BLOCK = 0, /* BC_INST_ENTER, result goes on the stack */
+    VM_FRAME_RESULT,    /* BC_INST_ENTER_RESULT, shares the result */
+    VM_FRAME_LOCAL,     /* local idents, left with the enclosing frame */
+    VM_FRAME_DO,        /* BC_INST_DO */
+    VM_FRAME_CALL,      /* alias call */
+    VM_FRAME_LOOP,      /* BC_INST_LOOP */
+    VM_FRAME_INLINE     /* BC_INST_INLINE, shares the result */
+};
+
+/* nested blocks and calls do not recurse into the VM, they push a frame
+ * onto the thread's frame stack instead, which holds whatever is needed
+ * to get back to the caller once the frame's code exits
+ */
+struct vm_frame {
+    int kind = VM_FRAME_BLOCK;
+    /* the instruction that pushed the frame */
+    std::uint32_t op = 0;
+    /* where to continue after exit, for frames running other code */
+    std::uint32_t *ret = nullptr;
+    /* the result the frame's code writes into */
+    any_value *res = nullptr;
+    /* storage for the result if the frame has its own */
+    any_value val{};
+    /* VM stack and ident stack tops at entry */
+    std::size_t vtop = 0;
+    std::size_t itop = 0;
+    /* local or loop idents offset on the VM stack, number of alias args,
+     * or the arguments offset of the enclosing inlined call
+     */
+    std::size_t nargs = 0;
+    /* the state of the caller for alias calls, or the list of a loop */
+    any_value oldargs{};
+    int oldflags = 0;
+    /* inline loops: the BC_LOOP_* descriptor, the next counter value with
+     * its step and the iterations left (the list position for list loops),
+     * plus the loop state of the thread to restore
+     */
+    std::uint32_t ldesc = 0;
+    integer_type lval = 0, lstep = 0, lleft = 0;
+    std::size_t lnative = 0, lframe = 0;
+    /* keeps the code alive for as long as it runs */
+    bcode_ref code{};
+};
+
+/* the alias stacks of a thread are allocated in pages of this many */
+static constexpr std::size_t ASTACK_PAGE = 64;
+
 struct thread_state {
-    using astack_allocator = std_allocator<std::pair<int const, alias_stack>>;
     /* the shared state pointer */
     internal_state *istate{};
     /* the public state interface */
     state *pstate{};
-    /* VM stack */
-    valbuf<any_value> vmstack;
+    /* VM stacks, every native entry into the VM gets its own so that
+     * nested code can never move values referenced by the outer levels
+     */
+    stackbuf<valbuf<any_value>> vmstacks;
     /* ident stack */
-    valbuf<ident_stack> idstack;
+    stackbuf<ident_stack> idstack;
     /* call stack */
-    valbuf<ident_level> callstack;
-    /* per-alias stack pointer */
-    std::unordered_map<
-        int, alias_stack, std::hash<int>, std::equal_to<int>, astack_allocator
-    > astacks;
+    stackbuf<ident_level> callstack;
+    /* VM frame stack */
+    stackbuf<vm_frame> frames;
+    /* per-alias stack pointer, indexed by the alias index; the pages are
+     * allocated on first use and the entries in them set up from the alias
+     * (a null node), so that side threads only pay for what they touch
+     */
+    valbuf<alias_stack *> astacks;
     /* per-thread storage buffer for error messages */
     charbuf errbuf;
+    /* scratch memory for the parser and code generator */
+    compile_arena arena;
     /* we can attach a hook to vm events */
     hook_func call_hook{};
     /* whether we own the internal state (i.e. not a side thread */
@@ -43,27 +98,62 @@ struct thread_state {
     /* thread ident flags */
     int ident_flags = 0;
     /* call depth limit */
-    std::size_t max_call_depth = 1024;
+    std::size_t max_call_depth = 65536;
     /* current call depth */
     std::size_t call_depth = 0;
+    /* how many times the VM is nested on the native stack */
+    std::size_t native_depth = 0;
     /* loop nesting level */
     std::size_t loop_level = 0;
+    /* native VM level running the innermost loop body */
+    std::size_t loop_native = 0;
+    /* frame count at the innermost loop if it is compiled inline, or 0 */
+    std::size_t loop_frame = 0;
+    /* VM stack offset of the arguments of the innermost inlined call */
+    std::size_t inline_args = 0;
+    /* break or continue signalled by the loop body */
+    loop_state loop_signal = loop_state::NORMAL;
     /* debug info */
     std::string_view source{};
     std::size_t *current_line = nullptr;
 
     thread_state(internal_state *cs);
+    ~thread_state();
 
     hook_func set_hook(hook_func f);
 
     hook_func &get_hook() { return call_hook; }
     hook_func const &get_hook() const { return call_hook; }
 
-    alias_stack &get_astack(alias const *a);
+    alias_stack &get_astack(alias const *a) {
+        auto idx = std::size_t(a->index());
+        auto pg = idx / ASTACK_PAGE;
+        if ((pg < astacks.size()) && astacks[pg]) {
+            auto &ast = astacks[pg][idx % ASTACK_PAGE];
+            if (ast.node) {
+                return ast;
+            }
+        }
+        return init_astack(a);
+    }
+
+    alias_stack &init_astack(alias const *a);
+
+    valbuf<any_value> &enter_vmstack();
+    void leave_vmstack();
 
     char *request_errbuf(std::size_t bufs, char *&sp);
 };
 
+/* holds a VM stack of its own for the duration of the scope */
+struct vmstack_scope {
+    vmstack_scope(thread_state &s): ts{s}, args{s.enter_vmstack()} {}
+    ~vmstack_scope() { ts.leave_vmstack(); }
+
+    thread_state &ts;
+    valbuf<any_value> &args;
+};
+
 } /* namespace cubescript */
 
 #endif /* LIBCUBESCRIPT_THREAD_HH */
@@ -7,6 +7,7 @@
 #include <cmath>
 #include <cstdlib>
 #include <iterator>
+#include <utility>
 
 namespace cubescript {
 
@@ -57,10 +58,12 @@ static std::string_view floatstr(float_type v, charbuf &buf) {
 }
 
 template<typename T>
-static inline void csv_cleanup(value_type tv, T *stor) {
+static inline void csv_cleanup(value_type tv, T *stor, unsigned char sinl) {
     switch (tv) {
         case value_type::STRING:
-            str_managed_unref(stor->s);
+            if (!sinl) {
+                str_managed_unref(stor->s);
+            }
             break;
         case value_type::CODE: {
             bcode_unref(stor->b->raw());
@@ -90,7 +93,11 @@ any_value::any_value(float_type val):
 any_value::any_value(std::string_view val, state &cs):
     p_stor{}, p_type{value_type::STRING}
 {
-    p_stor.s = state_p{cs}.ts().istate->strman->add(val);
+    if (val.size() < sizeof(p_stor)) {
+        set_small(val);
+    } else {
+        p_stor.s = state_p{cs}.ts().istate->strman->add(val);
+    }
 }
 
 any_value::any_value(string_ref const &val):
@@ -114,7 +121,7 @@ any_value::any_value(ident &val):
 }
 
 any_value::~any_value() {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
 }
 
 any_value::any_value(any_value const &v): any_value{} {
@@ -126,7 +133,7 @@ any_value::any_value(any_value &&v): any_value{} {
 }
 
 any_value &any_value::operator=(any_value const &v) {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::NONE;
     switch (v.type()) {
         case value_type::INTEGER:
@@ -137,8 +144,11 @@ any_value &any_value::operator=(any_value const &v) {
             break;
         case value_type::STRING:
             p_type = value_type::STRING;
-            p_stor.s = v.p_stor.s;
-            str_managed_ref(p_stor.s);
+            std::memcpy(&p_stor, &v.p_stor, sizeof(p_stor));
+            p_sinl = v.p_sinl;
+            if (!p_sinl) {
+                str_managed_ref(p_stor.s);
+            }
             break;
         case value_type::CODE:
             set_code(v.get_code());
@@ -185,44 +195,75 @@ value_type any_value::type() const {
 }
 
 void any_value::set_integer(integer_type val) {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::INTEGER;
     p_stor.i = val;
 }
 
 void any_value::set_float(float_type val) {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::FLOAT;
     p_stor.f = val;
 }
 
 void any_value::set_string(std::string_view val, state &cs) {
-    csv_cleanup(p_type, &p_stor);
-    p_stor.s = state_p{cs}.ts().istate->strman->add(val);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::STRING;
+    if (val.size() < sizeof(p_stor)) {
+        set_small(val);
+    } else {
+        p_stor.s = state_p{cs}.ts().istate->strman->add(val);
+        p_sinl = 0;
+    }
 }
 
 void any_value::set_string(string_ref const &val) {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_stor.s = str_managed_ref(val.p_str);
     p_type = value_type::STRING;
+    p_sinl = 0;
+}
+
+void any_value_p::set_managed(char const *str) {
+    csv_cleanup(vp->p_type, &vp->p_stor, vp->p_sinl);
+    vp->p_stor.s = str_managed_ref(str);
+    vp->p_type = value_type::STRING;
+    vp->p_sinl = 0;
+}
+
+/* short strings are stored in the value itself, with a terminating zero so
+ * that the view is usable as a C string much like an interned one
+ */
+void any_value::set_small(std::string_view val) {
+    if (!val.empty()) {
+        std::memcpy(p_stor.c, val.data(), val.size());
+    }
+    p_stor.c[val.size()] = '\0';
+    p_sinl = static_cast<unsigned char>(val.size() + 1);
+}
+
+std::string_view any_value::get_view() const {
+    if (p_sinl) {
+        return std::string_view{p_stor.c, std::size_t(p_sinl - 1)};
+    }
+    return str_managed_view(p_stor.s);
 }
 
 void any_value::set_none() {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::NONE;
 }
 
 void any_value::set_code(bcode_ref const &val) {
     bcode *p = bcode_p{val}.get();
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::CODE;
     bcode_addref(p->raw());
     p_stor.b = p;
 }
 
 void any_value::set_ident(ident &val) {
-    csv_cleanup(p_type, &p_stor);
+    csv_cleanup(p_type, &p_stor, p_sinl);
     p_type = value_type::IDENT;
     p_stor.v = &val;
 }
@@ -253,7 +294,7 @@ float_type any_value::force_float() {
             rf = float_type(p_stor.i);
             break;
         case value_type::STRING:
-            rf = parse_float(str_managed_view(p_stor.s));
+            rf = parse_float(get_view());
             break;
         case value_type::FLOAT:
             return p_stor.f;
@@ -271,7 +312,7 @@ integer_type any_value::force_integer() {
             ri = integer_type(std::floor(p_stor.f));
             break;
         case value_type::STRING:
-            ri = parse_int(str_managed_view(p_stor.s));
+            ri = parse_int(get_view());
             break;
         case value_type::INTEGER:
             return p_stor.i;
@@ -293,13 +334,13 @@ std::string_view any_value::force_string(state &cs) {
             str = intstr(p_stor.i, rs);
             break;
         case value_type::STRING:
-            return str_managed_view(p_stor.s);
+            return get_view();
         default:
             str = rs.str();
             break;
     }
     set_string(str, cs);
-    return str_managed_view(p_stor.s);
+    return get_view();
 }
 
 bcode_ref any_value::force_code(state &cs, std::string_view source) {
@@ -337,7 +378,7 @@ integer_type any_value::get_integer() const {
         case value_type::INTEGER:
             return p_stor.i;
         case value_type::STRING:
-            return parse_int(str_managed_view(p_stor.s));
+            return parse_int(get_view());
         default:
             break;
     }
@@ -351,7 +392,7 @@ float_type any_value::get_float() const {
         case value_type::INTEGER:
             return float_type(p_stor.i);
         case value_type::STRING:
-            return parse_float(str_managed_view(p_stor.s));
+            return parse_float(get_view());
         default:
             break;
     }
@@ -372,9 +413,21 @@ ident &any_value::get_ident(state &cs) const {
     return *p_stor.v;
 }
 
+string_ref any_value::get_string(state &cs) {
+    if ((type() == value_type::STRING) && p_sinl) {
+        /* something wants a stable reference, so intern it now */
+        p_stor.s = state_p{cs}.ts().istate->strman->add(get_view());
+        p_sinl = 0;
+    }
+    return std::as_const(*this).get_string(cs);
+}
+
 string_ref any_value::get_string(state &cs) const {
     switch (type()) {
         case value_type::STRING:
+            if (p_sinl) {
+                return string_ref{cs, get_view()};
+            }
             return string_ref{p_stor.s};
         case value_type::INTEGER: {
             charbuf rs{cs};
@@ -409,7 +462,7 @@ bool any_value::get_bool() const {
         case value_type::INTEGER:
             return p_stor.i != 0;
         case value_type::STRING: {
-            std::string_view s = str_managed_view(p_stor.s);
+            std::string_view s = get_view();
             if (s.empty()) {
                 return false;
             }
@@ -454,7 +507,7 @@ LIBCUBESCRIPT_EXPORT string_ref concat_values(
         }
         std::copy(sep.begin(), sep.end(), std::back_inserter(buf));
     }
-    return string_ref{cs, buf.str()};
+    return state_p{cs}.ts().istate->strman->make_transient(buf.str());
 }
 
 } /* namespace cubescript */
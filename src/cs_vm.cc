@@ -3,6 +3,8 @@
 #include "cs_std.hh"
 #include "cs_parser.hh"
 #include "cs_error.hh"
+#include "cs_lock.hh"
+#include "cs_math.hh"
 
 #include <cstdio>
 #include <cmath>
@@ -16,9 +18,10 @@ static inline void push_alias(thread_state &ts, ident &id, ident_stack &st) {
     }
     if (!static_cast<alias &>(id).is_arg()) {
         auto *aimp = static_cast<alias_impl *>(&id);
-        auto ast = ts.get_astack(aimp);
+        auto &ast = ts.get_astack(aimp);
         ast.push(st);
         ast.flags &= ~IDENT_FLAG_UNKNOWN;
+        aimp->shadow();
     }
 }
 
@@ -28,6 +31,39 @@ static inline void pop_alias(thread_state &ts, ident &id) {
     }
     if (!static_cast<alias &>(id).is_arg()) {
         ts.get_astack(static_cast<alias *>(&id)).pop();
+        static_cast<alias_impl &>(id).unshadow();
+    }
+}
+
+static inline void exec_convert(state &cs, char c, any_value &arg) {
+    switch (c) {
+        case 'i':
+            arg.force_integer();
+            break;
+        case 'f':
+            arg.force_float();
+            break;
+        case 's':
+            arg.force_string(cs);
+            break;
+        case 'c':
+            if (arg.type() == value_type::STRING) {
+                auto str = arg.get_string(cs);
+                if (str.empty()) {
+                    arg.set_integer(0);
+                } else {
+                    arg.force_code(cs);
+                }
+            }
+            break;
+        case 'b':
+            arg.force_code(cs);
+            break;
+        case 'v':
+            arg.force_ident(cs);
+            break;
+        default:
+            break;
     }
 }
 
@@ -35,102 +71,117 @@ void exec_command(
     thread_state &ts, command_impl *id, ident *self, any_value *args,
     any_value &res, std::size_t nargs, bool lookup
 ) {
-    int i = -1, fakeargs = 0, numargs = int(nargs);
-    bool rep = false;
-    auto fmt = id->args();
-    auto set_fake = [](
-        int &idx, int &fargs, bool r, int argn, any_value *argp
-    ) {
-        if (++idx >= argn) {
-            if (r) {
-                return false;
-            }
-            argp[idx].set_none();
-            ++fargs;
-            return false;
+    auto &cs = *ts.pstate;
+    char const *fmt = id->p_cargs.data();
+    std::size_t nfixed = id->p_nfixed, nrep = id->p_nrep;
+    /* the repeated conversions apply to as many complete groups as needed */
+    std::size_t nconv = nfixed, ncall = nfixed;
+    if (id->p_variadic) {
+        if (nrep && (nargs > nfixed)) {
+            nconv = nargs;
+            ncall = nfixed + (nargs - nfixed + nrep - 1) / nrep * nrep;
+        } else {
+            ncall = std::max(nfixed, nargs);
         }
-        return true;
-    };
-    for (auto it = fmt.begin(); it != fmt.end(); ++it) {
-        switch (*it) {
-            case 'i':
-                if (set_fake(i, fakeargs, rep, numargs, args)) {
-                    args[i].force_integer();
-                }
-                break;
-            case 'f':
-                if (set_fake(i, fakeargs, rep, numargs, args)) {
-                    args[i].force_float();
-                }
-                break;
-            case 's':
-                if (set_fake(i, fakeargs, rep, numargs, args)) {
-                    args[i].force_string(*ts.pstate);
-                }
-                break;
-            case 'a':
-                set_fake(i, fakeargs, rep, numargs, args);
-                break;
-            case 'c':
-                if (set_fake(i, fakeargs, rep, numargs, args)) {
-                    if (args[i].type() == value_type::STRING) {
-                        auto str = args[i].get_string(*ts.pstate);
-                        if (str.empty()) {
-                            args[i].set_integer(0);
+    }
+    auto nset = std::min(nconv, nargs);
+    switch (id->p_shape) {
+        case 'i':
+            for (std::size_t i = 0; i < nset; ++i) {
+                args[i].force_integer();
+            }
+            break;
+        case 'f':
+            for (std::size_t i = 0; i < nset; ++i) {
+                args[i].force_float();
+            }
+            break;
+        case 's':
+            for (std::size_t i = 0; i < nset; ++i) {
+                args[i].force_string(cs);
+            }
+            break;
+        case 'a':
+            break;
+        default: {
+            std::size_t fakeargs = 0;
+            for (std::size_t i = 0; i < nfixed; ++i) {
+                switch (fmt[i]) {
+                    case '$':
+                        args[i].set_ident(*self);
+                        break;
+                    case '#':
+                        args[i].set_integer(
+                            integer_type(lookup ? -1 : i - fakeargs)
+                        );
+                        break;
+                    default:
+                        if (i >= nargs) {
+                            args[i].set_none();
+                            ++fakeargs;
                         } else {
-                            args[i].force_code(*ts.pstate);
+                            exec_convert(cs, fmt[i], args[i]);
                         }
-                    }
-                }
-                break;
-            case 'b':
-                if (set_fake(i, fakeargs, rep, numargs, args)) {
-                    args[i].force_code(*ts.pstate);
-                }
-                break;
-            case 'v':
-                if (set_fake(i, fakeargs, rep, numargs, args)) {
-                    args[i].force_ident(*ts.pstate);
-                }
-                break;
-            case '$':
-                i += 1;
-                args[i].set_ident(*self);
-                break;
-            case '#':
-                i += 1;
-                args[i].set_integer(integer_type(lookup ? -1 : i - fakeargs));
-                break;
-            case '.':
-                i = std::max(i + 1, numargs);
-                id->call_id(ts, span_type<any_value>{args, std::size_t(i)}, res);
-                return;
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-                if (i + 1 < numargs) {
-                    it -= *it - '0' + 1;
-                    rep = true;
+                        break;
                 }
-                break;
+            }
+            for (std::size_t i = nfixed; i < nset; ++i) {
+                exec_convert(
+                    cs, fmt[nfixed - nrep + (i - nfixed) % nrep], args[i]
+                );
+            }
+            goto call;
         }
     }
-    ++i;
-    id->call_id(ts, span_type<any_value>{args, std::size_t(i)}, res);
-    res.force_plain();
+    /* missing fixed arguments */
+    for (std::size_t i = nargs; i < nfixed; ++i) {
+        args[i].set_none();
+    }
+call:
+    id->call_id(ts, span_type<any_value>{args, ncall}, res);
+    if (!id->p_variadic) {
+        res.force_plain();
+    }
 }
 
-any_value exec_alias(
-    thread_state &ts, alias *a, any_value *args,
+static void vm_call_leave(thread_state &ts, vm_frame &fr) {
+    auto amask = ts.callstack.back().usedargs;
+    ts.callstack.pop_back();
+    ts.ident_flags = fr.oldflags;
+    std::size_t cargs = fr.nargs;
+    for (std::size_t i = 0; i < cargs; i++) {
+        ts.get_astack(
+            static_cast<alias *>(ts.istate->argmap[i])
+        ).pop();
+        amask[i] = false;
+    }
+    for (; amask.any(); ++cargs) {
+        if (amask[cargs]) {
+            ts.get_astack(
+                static_cast<alias *>(ts.istate->argmap[cargs])
+            ).pop();
+            amask[cargs] = false;
+        }
+    }
+    ts.idstack.resize(fr.itop);
+    ts.istate->ivar_numargs->set_raw_value(
+        *ts.pstate, std::move(fr.oldargs)
+    );
+}
+
+/* sets up an alias call in the given frame, returning the code to run;
+ * if that fails, everything is restored back before throwing
+ */
+static std::uint32_t *vm_call_enter(
+    thread_state &ts, vm_frame &fr, alias *a, any_value *args,
     std::size_t callargs, alias_stack &astack
 ) {
     /* excess arguments get ignored (make error maybe?) */
-    any_value ret;
     callargs = std::min(callargs, MAX_ARGUMENTS);
     builtin_var *anargs = ts.istate->ivar_numargs;
     argset uargs{};
-    std::size_t noff = ts.idstack.size();
+    fr.itop = ts.idstack.size();
+    fr.nargs = callargs;
     for(std::size_t i = 0; i < callargs; i++) {
         auto &ast = ts.get_astack(
             static_cast<alias *>(ts.istate->argmap[i])
@@ -140,8 +191,8 @@ any_value exec_alias(
         st.val_s = std::move(args[i]);
         uargs[i] = true;
     }
-    auto oldargs = anargs->value();
-    auto oldflags = ts.ident_flags;
+    fr.oldargs = anargs->value();
+    fr.oldflags = ts.ident_flags;
     ts.ident_flags = astack.flags;
     any_value cv;
     cv.set_integer(integer_type(callargs));
@@ -154,43 +205,60 @@ any_value exec_alias(
             gs.gen_main(astack.node->val_s.get_string(*ts.pstate));
             astack.node->code = gs.steal_ref();
         } catch (...) {
-            ts.callstack.pop_back();
+            vm_call_leave(ts, fr);
             throw;
         }
     }
-    bcode_ref coderef = astack.node->code;
-    auto cleanup = [](
-        auto &tss, std::size_t cargs, std::size_t nids, auto oflags
-    ) {
-        auto amask = tss.callstack.back().usedargs;
-        tss.callstack.pop_back();
-        tss.ident_flags = oflags;
-        for (std::size_t i = 0; i < cargs; i++) {
-            tss.get_astack(
-                static_cast<alias *>(tss.istate->argmap[i])
-            ).pop();
-            amask[i] = false;
-        }
-        for (; amask.any(); ++cargs) {
-            if (amask[cargs]) {
-                tss.get_astack(
-                    static_cast<alias *>(tss.istate->argmap[cargs])
-                ).pop();
-                amask[cargs] = false;
+    fr.code = astack.node->code;
+    return bcode_p{fr.code}.get()->raw();
+}
+
+any_value lookup_value(thread_state &ts, ident &id) {
+    switch(id.type()) {
+        case ident_type::ALIAS: {
+            auto *a = static_cast<alias_impl *>(&id);
+            auto &ast = ts.get_astack(a);
+            if (ast.flags & IDENT_FLAG_UNKNOWN) {
+                break;
+            }
+            if (a->is_arg() && !ident_is_used_arg(a, ts)) {
+                return any_value{};
             }
+            return ast.node->val_s.get_plain();
         }
-        tss.idstack.resize(nids);
-    };
+        case ident_type::VAR:
+            return static_cast<builtin_var &>(id).value();
+        case ident_type::COMMAND: {
+            any_value val{};
+            auto *cimpl = static_cast<command_impl *>(&id);
+            vmstack_scope sc{ts};
+            /* pad with as many empty values as we need */
+            sc.args.resize(cimpl->p_nfixed);
+            exec_command(ts, cimpl, cimpl, sc.args.data(), val, 0, true);
+            return val;
+        }
+        default:
+            return any_value{};
+    }
+    throw error_p::make(
+        *ts.pstate, "unknown alias lookup: %s", id.name().data()
+    );
+}
+
+any_value exec_alias(
+    thread_state &ts, alias *a, any_value *args,
+    std::size_t callargs, alias_stack &astack
+) {
+    vm_frame fr;
+    auto *code = vm_call_enter(ts, fr, a, args, callargs, astack);
     try {
-        vm_exec(ts, bcode_p{coderef}.get()->raw(), ret);
+        vm_exec(ts, code, fr.val);
     } catch (...) {
-        cleanup(ts, callargs, noff, oldflags);
-        anargs->set_raw_value(*ts.pstate, std::move(oldargs));
+        vm_call_leave(ts, fr);
         throw;
     }
-    cleanup(ts, callargs, noff, oldflags);
-    anargs->set_raw_value(*ts.pstate, std::move(oldargs));
-    return ret;
+    vm_call_leave(ts, fr);
+    return std::move(fr.val);
 }
 
 any_value exec_code_with_args(thread_state &ts, bcode_ref const &body) {
@@ -248,34 +316,459 @@ any_value exec_code_with_args(thread_state &ts, bcode_ref const &body) {
     return ret;
 }
 
-struct vm_guard {
-    vm_guard(thread_state &s): ts{s}, oldtop{s.vmstack.size()} {
-        if (s.max_call_depth && (s.call_depth >= s.max_call_depth)) {
-            throw error{*s.pstate, "exceeded recursion limit"};
+/* the alias lookup of BC_INST_LOOKUP, without applying the type mask */
+static inline void vm_lookup(
+    thread_state &ts, std::uint32_t op, any_value &v
+) {
+    ident *id = ts.istate->lookup_ident(op >> 8);
+    if (static_cast<alias *>(id)->is_arg()) {
+        if (ident_is_used_arg(id, ts)) {
+            v = ts.get_astack(static_cast<alias *>(id)).node->val_s;
+        } else {
+            v.set_none();
         }
-        ++s.call_depth;
+        return;
+    }
+    auto &ast = ts.get_astack(static_cast<alias *>(id));
+    if (ast.flags & IDENT_FLAG_UNKNOWN) {
+        throw error_p::make(
+            *ts.pstate, "unknown alias lookup: %s", id->name().data()
+        );
     }
+    v = ast.node->val_s;
+}
+
+/* the VM may still nest itself through commands, which uses the native
+ * stack and is limited separately from the call depth
+ */
+static constexpr std::size_t MAX_NATIVE_DEPTH = 1024;
+
+static void vm_pop_frame(thread_state &ts, valbuf<any_value> &args) {
+    auto &fr = ts.frames.back();
+    switch (fr.kind) {
+        case VM_FRAME_LOCAL:
+            for (std::size_t i = fr.nargs; i < fr.vtop; ++i) {
+                pop_alias(ts, args[i].get_ident(*ts.pstate));
+            }
+            ts.idstack.resize(fr.itop);
+            break;
+        case VM_FRAME_CALL:
+            vm_call_leave(ts, fr);
+            break;
+        case VM_FRAME_LOOP:
+            for (std::size_t i = fr.nargs; i < fr.vtop; ++i) {
+                auto *a = static_cast<alias_impl *>(
+                    &args[i].get_ident(*ts.pstate)
+                );
+                ts.get_astack(a).pop();
+                a->unshadow();
+            }
+            ts.idstack.resize(fr.itop);
+            args.resize(fr.nargs);
+            --ts.loop_level;
+            ts.loop_native = fr.lnative;
+            ts.loop_frame = fr.lframe;
+            break;
+        case VM_FRAME_INLINE:
+            ts.inline_args = fr.nargs;
+            break;
+        default:
+            break;
+    }
+    ts.frames.pop_back();
+    --ts.call_depth;
+}
+
+static inline vm_frame &vm_push_frame(
+    thread_state &ts, valbuf<any_value> &args, int kind, std::uint32_t op
+) {
+    if (ts.max_call_depth && (ts.call_depth >= ts.max_call_depth)) {
+        throw error{*ts.pstate, "exceeded recursion limit"};
+    }
+    auto &fr = ts.frames.emplace_back();
+    ++ts.call_depth;
+    fr.kind = kind;
+    fr.op = op;
+    fr.vtop = args.size();
+    return fr;
+}
+
+/* checks whether the code after an alias call only exits frames sharing
+ * the result of an enclosing alias call (including inlined calls), with
+ * nothing left to convert; if so, the call is in tail position and that
+ * frame is returned for reuse
+ */
+static vm_frame *vm_tail_frame(
+    thread_state &ts, std::size_t fbase, std::uint32_t op,
+    std::uint32_t const *code
+) {
+    if (op & BC_INST_RET_MASK) {
+        return nullptr;
+    }
+    for (std::size_t nfr = ts.frames.size(); nfr > fbase;) {
+        op = *code++;
+        switch (op & BC_INST_OP_MASK) {
+            case BC_INST_JUMP:
+                code += op >> 8;
+                continue;
+            case BC_INST_EXIT:
+                break;
+            default:
+                return nullptr;
+        }
+        if (op & BC_INST_RET_MASK) {
+            return nullptr;
+        }
+        auto &fr = ts.frames[--nfr];
+        switch (fr.kind) {
+            case VM_FRAME_CALL:
+                return &fr;
+            case VM_FRAME_RESULT:
+                break;
+            case VM_FRAME_INLINE:
+                /* continues after the fallback call */
+                code = fr.ret;
+                break;
+            default:
+                return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+/* runs a call in tail position in the frame of the enclosing call, which
+ * is left first; the arguments stay on the VM stack until they are bound,
+ * so the stack is only cut down to the frame once the call is set up
+ */
+static std::uint32_t *vm_tail_call(
+    thread_state &ts, valbuf<any_value> &args, vm_frame &fr, alias *a,
+    std::size_t offset, std::size_t callargs, alias_stack &astack
+) {
+    while (&ts.frames.back() != &fr) {
+        vm_pop_frame(ts, args);
+    }
+    vm_call_leave(ts, fr);
+    /* no cleanup for the frame until the call is set up again */
+    fr.kind = VM_FRAME_BLOCK;
+    auto *ncode = vm_call_enter(
+        ts, fr, a, &args[offset], callargs, astack
+    );
+    fr.kind = VM_FRAME_CALL;
+    args.resize(fr.vtop);
+    return ncode;
+}
+
+static inline void vm_arith(
+    state &cs, int op, any_value *args, any_value &res
+) {
+    switch (op) {
+        case MATH_ADD:
+            res.set_integer(args[0].get_integer() + args[1].get_integer());
+            break;
+        case MATH_SUB:
+            res.set_integer(args[0].get_integer() - args[1].get_integer());
+            break;
+        case MATH_MUL:
+            res.set_integer(args[0].get_integer() * args[1].get_integer());
+            break;
+        case MATH_DIV:
+            res.set_integer(math_div<integer_type>{}(
+                args[0].get_integer(), args[1].get_integer()
+            ));
+            break;
+        case MATH_MOD:
+            res.set_integer(math_mod{}(
+                args[0].get_integer(), args[1].get_integer()
+            ));
+            break;
+        case MATH_ADDF:
+            res.set_float(args[0].get_float() + args[1].get_float());
+            break;
+        case MATH_SUBF:
+            res.set_float(args[0].get_float() - args[1].get_float());
+            break;
+        case MATH_MULF:
+            res.set_float(args[0].get_float() * args[1].get_float());
+            break;
+        case MATH_DIVF:
+            res.set_float(math_div<float_type>{}(
+                args[0].get_float(), args[1].get_float()
+            ));
+            break;
+        case MATH_MODF:
+            res.set_float(math_modf{}(
+                args[0].get_float(), args[1].get_float()
+            ));
+            break;
+        case MATH_EQ:
+            res.set_integer(args[0].get_integer() == args[1].get_integer());
+            break;
+        case MATH_NE:
+            res.set_integer(args[0].get_integer() != args[1].get_integer());
+            break;
+        case MATH_LT:
+            res.set_integer(args[0].get_integer() < args[1].get_integer());
+            break;
+        case MATH_GT:
+            res.set_integer(args[0].get_integer() > args[1].get_integer());
+            break;
+        case MATH_LE:
+            res.set_integer(args[0].get_integer() <= args[1].get_integer());
+            break;
+        case MATH_GE:
+            res.set_integer(args[0].get_integer() >= args[1].get_integer());
+            break;
+        case MATH_EQF:
+            res.set_integer(args[0].get_float() == args[1].get_float());
+            break;
+        case MATH_NEF:
+            res.set_integer(args[0].get_float() != args[1].get_float());
+            break;
+        case MATH_LTF:
+            res.set_integer(args[0].get_float() < args[1].get_float());
+            break;
+        case MATH_GTF:
+            res.set_integer(args[0].get_float() > args[1].get_float());
+            break;
+        case MATH_LEF:
+            res.set_integer(args[0].get_float() <= args[1].get_float());
+            break;
+        case MATH_GEF:
+            res.set_integer(args[0].get_float() >= args[1].get_float());
+            break;
+        default: {
+            auto sa = args[0].get_string(cs), sb = args[1].get_string(cs);
+            std::string_view a = sa.view(), b = sb.view();
+            bool val;
+            switch (op) {
+                case MATH_EQS: val = (a == b); break;
+                case MATH_NES: val = (a != b); break;
+                case MATH_LTS: val = (a < b); break;
+                case MATH_GTS: val = (a > b); break;
+                case MATH_LES: val = (a <= b); break;
+                default: val = (a >= b); break;
+            }
+            res.set_integer(val);
+            break;
+        }
+    }
+}
+
+/* the inline caches of the dynamic name instructions, see cs_bcode.hh;
+ * the index is published with release semantics, so whoever sees it also
+ * sees the ident it refers to
+ */
+static inline ident *vm_cache_get(
+    thread_state &ts, std::uint32_t const *cache, char const *name
+) {
+    auto idx = atomic_word_acquire(cache) & BC_CACHE_MASK;
+    if (idx) {
+        ident *id = ts.istate->lookup_ident(idx - 1);
+        if (id->name().data() == name) {
+            return id;
+        }
+    }
+    return nullptr;
+}
+
+static inline void vm_cache_set(std::uint32_t *cache, ident *id) {
+    atomic_word_release(cache, (atomic_word_load(cache) & BC_CACHE_LITERAL) | (
+        std::uint32_t(id->index()) + 1
+    ));
+}
+
+/* loops compiled inline, see BC_INST_LOOP; like with local, the loop
+ * idents stay on the VM stack while the frame is alive, and the loop becomes
+ * the innermost one for break and continue in its body
+ */
+
+/* sets the idents for the next iteration, returns false once done */
+static bool vm_loop_step(thread_state &ts, vm_frame &fr) {
+    auto nvars = (fr.ldesc >> BC_LOOP_VARS) & 3;
+    if (fr.ldesc & BC_LOOP_LIST) {
+        auto &cs = *ts.pstate;
+        auto lstr = fr.oldargs.get_string(cs);
+        std::string_view lv = lstr.view();
+        list_parser p{cs, lv.substr(std::size_t(fr.lval))};
+        if (!p.parse()) {
+            return false;
+        }
+        ts.idstack[fr.itop].val_s.set_string(p.get_item());
+        for (std::size_t i = 1; i < nvars; ++i) {
+            auto &v = ts.idstack[fr.itop + i].val_s;
+            if (p.parse()) {
+                v.set_string(p.get_item());
+            } else {
+                v.set_string("", cs);
+            }
+        }
+        fr.lval = integer_type(p.input().data() - lv.data());
+    } else if (nvars) {
+        if (fr.lleft-- <= 0) {
+            return false;
+        }
+        ts.idstack[fr.itop].val_s.set_integer(fr.lval);
+        fr.lval += fr.lstep;
+    }
+    return true;
+}
+
+/* pops the loop arguments and pushes the loop frame; code is at the
+ * descriptor, returns false if the loop is not to run at all
+ */
+static bool vm_loop_enter(
+    thread_state &ts, valbuf<any_value> &args, std::uint32_t op,
+    std::uint32_t *code
+) {
+    auto &cs = *ts.pstate;
+    auto desc = *code;
+    std::size_t nvars = (desc >> BC_LOOP_VARS) & 3, nvals = 0;
+    integer_type offset = 0, count = 0, step = 1;
+    if (desc & BC_LOOP_LIST) {
+        nvals = 1;
+    } else if (nvars) {
+        std::size_t opos = (desc >> BC_LOOP_OFFSET) & 3;
+        std::size_t cpos = (desc >> BC_LOOP_COUNT) & 3;
+        std::size_t spos = (desc >> BC_LOOP_STEP) & 3;
+        nvals = std::max(opos, std::max(cpos, spos));
+        auto vbase = args.size() - nvals - 1;
+        count = args[vbase + cpos].get_integer();
+        if (count <= 0) {
+            args.resize(vbase);
+            return false;
+        }
+        if (opos) {
+            offset = args[vbase + opos].get_integer();
+        }
+        if (spos) {
+            step = args[vbase + spos].get_integer();
+        }
+    }
+    auto base = args.size() - nvals - nvars;
+    for (std::size_t i = base; i < (base + nvars); ++i) {
+        auto &id = args[i].get_ident(cs);
+        if (id.type() != ident_type::ALIAS) {
+            throw error_p::make(
+                cs, "ident '%s' is not an alias", id.name().data()
+            );
+        }
+    }
+    any_value lst{};
+    if (desc & BC_LOOP_LIST) {
+        lst.set_string(args.back().get_string(cs));
+    }
+    args.resize(base + nvars);
+    auto &fr = vm_push_frame(ts, args, VM_FRAME_LOOP, op);
+    fr.res = &fr.val;
+    fr.ret = code + (op >> 8) + 1;
+    fr.nargs = base;
+    fr.itop = ts.idstack.size();
+    fr.oldargs = std::move(lst);
+    fr.ldesc = desc;
+    fr.lval = offset;
+    fr.lstep = step;
+    fr.lleft = count;
+    for (std::size_t i = base; i < fr.vtop; ++i) {
+        auto *a = static_cast<alias_impl *>(&args[i].get_ident(cs));
+        auto &ast = ts.get_astack(a);
+        ast.push(ts.idstack.emplace_back());
+        ast.flags &= ~IDENT_FLAG_UNKNOWN;
+        a->shadow();
+    }
+    fr.lnative = ts.loop_native;
+    fr.lframe = ts.loop_frame;
+    ++ts.loop_level;
+    ts.loop_native = ts.native_depth;
+    ts.loop_frame = ts.frames.size();
+    if (!vm_loop_step(ts, fr)) {
+        vm_pop_frame(ts, args);
+        return false;
+    }
+    return true;
+}
+
+/* leaves whatever the innermost loop's code is in the middle of */
+static void vm_loop_unwind(thread_state &ts, valbuf<any_value> &args) {
+    while (ts.frames.size() > ts.loop_frame) {
+        args.resize(ts.frames.back().vtop);
+        vm_pop_frame(ts, args);
+    }
+    args.resize(ts.frames.back().vtop);
+}
+
+/* leaves the innermost loop, returning the code following it */
+static std::uint32_t *vm_loop_leave(
+    thread_state &ts, valbuf<any_value> &args
+) {
+    vm_loop_unwind(ts, args);
+    auto *code = ts.frames.back().ret + 1;
+    vm_pop_frame(ts, args);
+    return code;
+}
+
+struct vm_guard {
+    vm_guard(thread_state &s):
+        ts{s}, fbase{s.frames.size()}, args{vm_enter(s)}
+    {}
 
     ~vm_guard() {
+        /* frames are left behind when unwinding from an error, or when
+         * leaving a loop body early
+         */
+        while (ts.frames.size() > fbase) {
+            vm_pop_frame(ts, args);
+        }
         --ts.call_depth;
-        ts.vmstack.resize(oldtop);
+        ts.leave_vmstack();
+    }
+
+    static valbuf<any_value> &vm_enter(thread_state &s) {
+        if (
+            (s.max_call_depth && (s.call_depth >= s.max_call_depth)) ||
+            (s.native_depth >= MAX_NATIVE_DEPTH)
+        ) {
+            throw error{*s.pstate, "exceeded recursion limit"};
+        }
+        ++s.call_depth;
+        return s.enter_vmstack();
     }
 
     thread_state &ts;
-    std::size_t oldtop;
+    std::size_t fbase;
+    valbuf<any_value> &args;
 };
 
-std::uint32_t *vm_exec(
-    thread_state &ts, std::uint32_t *code, any_value &result
+/* the dispatch loop can be built in two ways; the portable one is a plain
+ * switch inside a loop, while compilers supporting labels as values can
+ * use threaded code, where every handler jumps straight to the next one
+ * through a table instead of going back to a single indirect branch
+ */
+#if defined(LIBCUBESCRIPT_THREADED_DISPATCH) && defined(__GNUC__)
+/* computed gotos do not run destructors of objects going out of scope,
+ * so handlers must leave any scope holding such objects before VM_NEXT
+ */
+#  define VM_THREADED 1
+#  define VM_CASE(o) vm_op_##o
+#  define VM_NEXT() do { op = *code++; goto *dispatch[op & 0xFF]; } while (0)
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#  define VM_THREADED 0
+#  define VM_CASE(o) case o
+#  define VM_NEXT() continue
+#endif
+
+static std::uint32_t *vm_run(
+    thread_state &ts, vm_guard &scope, std::uint32_t *code, any_value &result
 ) {
-    result.set_none();
     auto &cs = *ts.pstate;
-    vm_guard scope{ts}; /* keep track of recursion depth + manage stack */
-    auto &args = ts.vmstack;
-    auto &chook = cs.call_hook();
-    if (chook) {
-        chook(cs);
+    auto &args = scope.args;
+    /* the result of the current frame */
+    any_value *res = &result;
+    if (ts.frames.size() > scope.fbase) {
+        res = ts.frames.back().res;
     }
+    auto &chook = cs.call_hook();
     auto force_val = [](state &s, any_value &v, int opn) {
         switch (opn & BC_INST_RET_MASK) {
             case BC_RET_STRING:
@@ -289,196 +782,281 @@ std::uint32_t *vm_exec(
                 break;
         }
     };
+    std::uint32_t op;
+#if VM_THREADED
+    /* the table is indexed by the opcode together with its type bits,
+     * laid out as one row of 64 opcodes per BC_RET_* value; that way the
+     * typed variants of value pushes get their own handlers and do not
+     * have to switch on the type mask again
+     */
+    static_assert(BC_INST_ARG == 51, "dispatch table out of date");
+#define VM_ROW(val, val_int) \
+        &&VM_CASE(BC_INST_START), &&VM_CASE(BC_INST_OFFSET), \
+        &&VM_CASE(BC_INST_NULL), &&VM_CASE(BC_INST_TRUE), \
+        &&VM_CASE(BC_INST_FALSE), &&VM_CASE(BC_INST_NOT), \
+        &&VM_CASE(BC_INST_POP), &&VM_CASE(BC_INST_ENTER), \
+        &&VM_CASE(BC_INST_ENTER_RESULT), &&VM_CASE(BC_INST_EXIT), \
+        &&VM_CASE(BC_INST_RESULT), &&VM_CASE(BC_INST_RESULT_ARG), \
+        &&VM_CASE(BC_INST_FORCE), &&VM_CASE(BC_INST_DUP), \
+        &&val, &&val_int, \
+        &&VM_CASE(BC_INST_LOCAL), &&VM_CASE(BC_INST_DO), \
+        &&VM_CASE(BC_INST_DO_ARGS), &&VM_CASE(BC_INST_JUMP), \
+        &&VM_CASE(BC_INST_JUMP_B), &&VM_CASE(BC_INST_JUMP_RESULT), \
+        &&VM_CASE(BC_INST_BREAK), &&VM_CASE(BC_INST_BLOCK), \
+        &&VM_CASE(BC_INST_EMPTY), &&VM_CASE(BC_INST_COMPILE), \
+        &&VM_CASE(BC_INST_COND), &&VM_CASE(BC_INST_IDENT), \
+        &&VM_CASE(BC_INST_IDENT_U), &&VM_CASE(BC_INST_LOOKUP), \
+        &&VM_CASE(BC_INST_LOOKUP_U), &&VM_CASE(BC_INST_CONC), \
+        &&VM_CASE(BC_INST_CONC_W), &&VM_CASE(BC_INST_VAR), \
+        &&VM_CASE(BC_INST_ALIAS), &&VM_CASE(BC_INST_ALIAS_U), \
+        &&VM_CASE(BC_INST_CALL), &&VM_CASE(BC_INST_CALL_U), \
+        &&VM_CASE(BC_INST_COM), &&VM_CASE(BC_INST_COM_V), \
+        &&VM_CASE(BC_INST_LOOKUP_RESULT), &&VM_CASE(BC_INST_VAL_ALIAS), \
+        &&VM_CASE(BC_INST_VAL_COM), &&VM_CASE(BC_INST_VAL_COM_V), \
+        &&VM_CASE(BC_INST_LOOKUP_VAL_COM_V), &&VM_CASE(BC_INST_CALL_Q), \
+        &&VM_CASE(BC_INST_ARITH), &&VM_CASE(BC_INST_LOOP), \
+        &&VM_CASE(BC_INST_LOOP_COND), &&VM_CASE(BC_INST_LOOP_NEXT), \
+        &&VM_CASE(BC_INST_INLINE), &&VM_CASE(BC_INST_ARG), \
+        VM_UNUSED8, \
+        VM_UNUSED, VM_UNUSED, VM_UNUSED, VM_UNUSED
+#define VM_UNUSED &&VM_CASE(BC_INST_START)
+#define VM_UNUSED8 \
+        VM_UNUSED, VM_UNUSED, VM_UNUSED, VM_UNUSED, \
+        VM_UNUSED, VM_UNUSED, VM_UNUSED, VM_UNUSED
+    static void *const dispatch[] = {
+        VM_ROW(VM_CASE(BC_INST_VAL), VM_CASE(BC_INST_VAL_INT)),
+        VM_ROW(vm_val_int, vm_val_int_int),
+        VM_ROW(vm_val_float, vm_val_int_float),
+        VM_ROW(vm_val_string, vm_val_int_string)
+    };
+#undef VM_UNUSED8
+#undef VM_UNUSED
+#undef VM_ROW
+    static_assert(
+        sizeof(dispatch) / sizeof(*dispatch) == 256,
+        "dispatch table size mismatch"
+    );
+    VM_NEXT();
+#else
     for (;;) {
-        std::uint32_t op = *code++;
+        op = *code++;
         switch (op & BC_INST_OP_MASK) {
-            case BC_INST_START:
-            case BC_INST_OFFSET:
-                continue;
+#endif
+            VM_CASE(BC_INST_START):
+            VM_CASE(BC_INST_OFFSET):
+                VM_NEXT();
 
-            case BC_INST_NULL:
-                result.set_none();
+            VM_CASE(BC_INST_NULL):
+                res->set_none();
                 goto use_result;
 
-            case BC_INST_FALSE:
-                result.set_integer(0);
+            VM_CASE(BC_INST_FALSE):
+                res->set_integer(0);
                 goto use_result;
 
-            case BC_INST_TRUE:
-                result.set_integer(1);
+            VM_CASE(BC_INST_TRUE):
+                res->set_integer(1);
                 goto use_result;
 
-            case BC_INST_NOT:
-                result.set_integer(!args.back().get_bool());
+            VM_CASE(BC_INST_NOT):
+                res->set_integer(!args.back().get_bool());
                 args.pop_back();
                 goto use_result;
 
-            case BC_INST_POP:
+            VM_CASE(BC_INST_POP):
                 args.pop_back();
-                continue;
+                VM_NEXT();
 
-            case BC_INST_ENTER:
-                code = vm_exec(ts, code, args.emplace_back());
-                continue;
+            VM_CASE(BC_INST_ENTER): {
+                auto &fr = vm_push_frame(ts, args, VM_FRAME_BLOCK, op);
+                res = fr.res = &fr.val;
+                goto use_frame;
+            }
 
-            case BC_INST_ENTER_RESULT:
-                code = vm_exec(ts, code, result);
-                continue;
+            VM_CASE(BC_INST_ENTER_RESULT):
+                vm_push_frame(ts, args, VM_FRAME_RESULT, op).res = res;
+                res->set_none();
+                goto use_frame;
 
-            case BC_INST_EXIT:
+            VM_CASE(BC_INST_EXIT):
                 goto use_exit;
 
-            case BC_INST_RESULT:
-                result = std::move(args.back());
+            VM_CASE(BC_INST_RESULT):
+                *res = std::move(args.back());
                 args.pop_back();
                 goto use_result;
 
-            case BC_INST_RESULT_ARG:
-                args.emplace_back(std::move(result));
+            VM_CASE(BC_INST_RESULT_ARG):
+                args.emplace_back(std::move(*res));
                 goto use_top;
 
-            case BC_INST_FORCE:
+            VM_CASE(BC_INST_FORCE):
                 goto use_top;
 
-            case BC_INST_DUP: {
+            VM_CASE(BC_INST_DUP): {
                 auto &v = args.back();
                 args.emplace_back() = v;
                 goto use_top;
             }
 
-            case BC_INST_VAL:
+            VM_CASE(BC_INST_VAL):
+#if !VM_THREADED
                 switch (op & BC_INST_RET_MASK) {
-                    case BC_RET_STRING: {
-                        auto len = op >> 8;
-                        char const *str;
-                        std::memcpy(&str, &code, sizeof(str));
-                        std::string_view sv{str, len};
-                        args.emplace_back().set_string(sv, cs);
-                        code += len / sizeof(std::uint32_t) + 1;
-                        continue;
-                    }
-                    case BC_RET_INT: {
-                        integer_type i;
-                        std::memcpy(&i, code, sizeof(i));
-                        args.emplace_back().set_integer(i);
-                        code += bc_store_size<integer_type>;
-                        continue;
-                    }
-                    case BC_RET_FLOAT: {
-                        float_type f;
-                        std::memcpy(&f, code, sizeof(f));
-                        args.emplace_back().set_float(f);
-                        code += bc_store_size<float_type>;
-                        continue;
-                    }
+                    case BC_RET_STRING:
+                        goto vm_val_string;
+                    case BC_RET_INT:
+                        goto vm_val_int;
+                    case BC_RET_FLOAT:
+                        goto vm_val_float;
                     default:
                         break;
                 }
+#endif
                 args.emplace_back().set_none();
-                continue;
+                VM_NEXT();
+            vm_val_string: {
+                char const *str;
+                std::memcpy(&str, code, sizeof(str));
+                any_value_p{args.emplace_back()}.set_managed(str);
+                code += bc_store_size<char const *>;
+                VM_NEXT();
+            }
+            vm_val_int: {
+                integer_type i;
+                std::memcpy(&i, code, sizeof(i));
+                args.emplace_back().set_integer(i);
+                code += bc_store_size<integer_type>;
+                VM_NEXT();
+            }
+            vm_val_float: {
+                float_type f;
+                std::memcpy(&f, code, sizeof(f));
+                args.emplace_back().set_float(f);
+                code += bc_store_size<float_type>;
+                VM_NEXT();
+            }
 
-            case BC_INST_VAL_INT:
+            VM_CASE(BC_INST_VAL_INT):
+#if !VM_THREADED
                 switch (op & BC_INST_RET_MASK) {
-                    case BC_RET_STRING: {
-                        char s[4] = {
-                            char((op >> 8) & 0xFF),
-                            char((op >> 16) & 0xFF),
-                            char((op >> 24) & 0xFF), '\0'
-                        };
-                        /* gotta cast or r.size() == potentially 3 */
-                        args.emplace_back().set_string(s, cs);
-                        continue;
-                    }
+                    case BC_RET_STRING:
+                        goto vm_val_int_string;
                     case BC_RET_INT:
-                        args.emplace_back().set_integer(integer_type(op) >> 8);
-                        continue;
+                        goto vm_val_int_int;
                     case BC_RET_FLOAT:
-                        args.emplace_back().set_float(
-                            float_type(integer_type(op) >> 8)
-                        );
-                        continue;
+                        goto vm_val_int_float;
                     default:
                         break;
                 }
+#endif
                 args.emplace_back().set_none();
-                continue;
+                VM_NEXT();
+            vm_val_int_string: {
+                char s[4] = {
+                    char((op >> 8) & 0xFF),
+                    char((op >> 16) & 0xFF),
+                    char((op >> 24) & 0xFF), '\0'
+                };
+                /* gotta cast or r.size() == potentially 3 */
+                args.emplace_back().set_string(s, cs);
+                VM_NEXT();
+            }
+            vm_val_int_int:
+                args.emplace_back().set_integer(integer_type(op) >> 8);
+                VM_NEXT();
+            vm_val_int_float:
+                args.emplace_back().set_float(
+                    float_type(integer_type(op) >> 8)
+                );
+                VM_NEXT();
 
-            case BC_INST_LOCAL: {
-                std::size_t numlocals = op >> 8;
-                std::size_t offset = args.size() - numlocals;
-                std::size_t idstsz = ts.idstack.size();
-                for (std::size_t i = 0; i < numlocals; ++i) {
+            VM_CASE(BC_INST_LOCAL): {
+                auto &fr = vm_push_frame(ts, args, VM_FRAME_LOCAL, op);
+                fr.res = res;
+                fr.nargs = fr.vtop - (op >> 8);
+                fr.itop = ts.idstack.size();
+                for (std::size_t i = fr.nargs; i < fr.vtop; ++i) {
                     push_alias(
-                        ts, args[offset + i].get_ident(cs),
-                        ts.idstack.emplace_back()
+                        ts, args[i].get_ident(cs), ts.idstack.emplace_back()
                     );
                 }
-                auto cleanup = [](
-                    auto &css, std::size_t off, std::size_t isz, auto &av
-                ) {
-                    for (std::size_t i = off; i < av.size(); ++i) {
-                        pop_alias(state_p{css}.ts(), av[i].get_ident(css));
-                    }
-                    state_p{css}.ts().idstack.resize(isz);
-                };
-                try {
-                    code = vm_exec(ts, code, result);
-                } catch (...) {
-                    cleanup(cs, offset, idstsz, args);
-                    throw;
-                }
-                cleanup(cs, offset, idstsz, args);
-                return code;
+                res->set_none();
+                goto use_frame;
             }
 
-            case BC_INST_DO_ARGS: {
+            VM_CASE(BC_INST_DO_ARGS): {
                 auto v = std::move(args.back());
                 args.pop_back();
-                result = exec_code_with_args(ts, v.get_code());
+                *res = exec_code_with_args(ts, v.get_code());
                 goto use_result;
             }
 
-            case BC_INST_DO: {
-                auto v = std::move(args.back());
+            VM_CASE(BC_INST_DO): {
+                auto &fr = vm_push_frame(ts, args, VM_FRAME_DO, op);
+                fr.code = args.back().get_code();
                 args.pop_back();
-                result = v.get_code().call(cs);
-                goto use_result;
+                fr.vtop = args.size();
+                fr.ret = code;
+                res = fr.res = &fr.val;
+                code = bcode_p{fr.code}.get()->raw();
+                goto use_frame;
             }
 
-            case BC_INST_JUMP: {
+            VM_CASE(BC_INST_JUMP): {
                 std::uint32_t len = op >> 8;
                 code += len;
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_JUMP_B: {
+            VM_CASE(BC_INST_JUMP_B): {
                 std::uint32_t len = op >> 8;
                 /* BC_INST_FLAG_TRUE/FALSE */
                 if (args.back().get_bool() == !!(op & BC_INST_RET_MASK)) {
                     code += len;
                 }
                 args.pop_back();
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_JUMP_RESULT: {
+            VM_CASE(BC_INST_JUMP_RESULT): {
                 std::uint32_t len = op >> 8;
-                auto v = std::move(args.back());
+                *res = std::move(args.back());
                 args.pop_back();
-                if (v.type() == value_type::CODE) {
-                    result = v.get_code().call(cs);
-                } else {
-                    result = std::move(v);
+                if (res->type() == value_type::CODE) {
+                    *res = res->get_code().call(cs);
                 }
                 /* BC_INST_FLAG_TRUE/FALSE */
-                if (result.get_bool() == !!(op & BC_INST_RET_MASK)) {
+                if (res->get_bool() == !!(op & BC_INST_RET_MASK)) {
                     code += len;
                 }
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_BREAK:
+            VM_CASE(BC_INST_BREAK):
+            vm_break:
                 if (ts.loop_level) {
+                    /* directly in the loop body, so just leave it and let
+                     * the loop pick up the signal; nested code run by some
+                     * command has to unwind back to the loop instead
+                     */
+                    if (ts.native_depth == ts.loop_native) {
+                        /* compiled inline, so it is in this very VM */
+                        if (ts.loop_frame) {
+                            if (op & BC_INST_RET_MASK) {
+                                vm_loop_unwind(ts, args);
+                                code = ts.frames.back().ret;
+                            } else {
+                                code = vm_loop_leave(ts, args);
+                            }
+                            goto use_frame_res;
+                        }
+                        if (op & BC_INST_RET_MASK) {
+                            ts.loop_signal = loop_state::CONTINUE;
+                        } else {
+                            ts.loop_signal = loop_state::BREAK;
+                        }
+                        return code;
+                    }
                     if (op & BC_INST_RET_MASK) {
                         throw continue_exception{};
                     } else {
@@ -491,46 +1069,47 @@ std::uint32_t *vm_exec(
                         throw error{cs, "no loop to break"};
                     }
                 }
-                break;
 
-            case BC_INST_BLOCK: {
+            VM_CASE(BC_INST_BLOCK): {
                 std::uint32_t len = op >> 8;
                 bcode *b;
                 code += 1;
                 std::memcpy(&b, &code, sizeof(b));
                 args.emplace_back().set_code(bcode_p::make_ref(b));
                 code += len - 1;
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_EMPTY:
+            VM_CASE(BC_INST_EMPTY):
                 args.emplace_back().set_code(bcode_p::make_ref(
                     bcode_get_empty(ts.istate->empty, op & BC_INST_RET_MASK)
                 ));
-                break;
+                VM_NEXT();
 
-            case BC_INST_COMPILE: {
+            VM_CASE(BC_INST_COMPILE): {
                 any_value &arg = args.back();
-                gen_state gs{ts};
-                switch (arg.type()) {
-                    case value_type::INTEGER:
-                        gs.gen_main_integer(arg.get_integer());
-                        break;
-                    case value_type::FLOAT:
-                        gs.gen_main_float(arg.get_float());
-                        break;
-                    case value_type::STRING:
-                        gs.gen_main(arg.get_string(cs));
-                        break;
-                    default:
-                        gs.gen_main_null();
-                        break;
+                {
+                    gen_state gs{ts};
+                    switch (arg.type()) {
+                        case value_type::INTEGER:
+                            gs.gen_main_integer(arg.get_integer());
+                            break;
+                        case value_type::FLOAT:
+                            gs.gen_main_float(arg.get_float());
+                            break;
+                        case value_type::STRING:
+                            gs.gen_main(arg.get_string(cs));
+                            break;
+                        default:
+                            gs.gen_main_null();
+                            break;
+                    }
+                    arg.set_code(gs.steal_ref());
                 }
-                arg.set_code(gs.steal_ref());
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_COND: {
+            VM_CASE(BC_INST_COND): {
                 any_value &arg = args.back();
                 switch (arg.type()) {
                     case value_type::STRING: {
@@ -547,10 +1126,10 @@ std::uint32_t *vm_exec(
                     default:
                         break;
                 }
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_IDENT: {
+            VM_CASE(BC_INST_IDENT): {
                 alias *a = static_cast<alias *>(
                     ts.istate->lookup_ident(op >> 8)
                 );
@@ -559,51 +1138,57 @@ std::uint32_t *vm_exec(
                     ts.callstack.back().usedargs[a->index()] = true;
                 }
                 args.emplace_back().set_ident(*a);
-                continue;
+                VM_NEXT();
             }
-            case BC_INST_IDENT_U: {
+            VM_CASE(BC_INST_IDENT_U): {
                 any_value &arg = args.back();
                 ident *id = ts.istate->id_dummy;
                 if (arg.type() == value_type::STRING) {
-                    id = &ts.istate->new_ident(
-                        cs, arg.get_string(cs), IDENT_FLAG_UNKNOWN
-                    );
+                    auto idn = arg.get_string(cs);
+                    id = vm_cache_get(ts, code, idn.data());
+                    if (!id) {
+                        id = &ts.istate->new_ident(
+                            cs, idn, IDENT_FLAG_UNKNOWN
+                        );
+                        vm_cache_set(code, id);
+                    }
                 }
+                ++code;
                 alias *a = static_cast<alias *>(id);
                 if (a->is_arg() && !ident_is_used_arg(id, ts)) {
                     ts.get_astack(a).push(ts.idstack.emplace_back());
                     ts.callstack.back().usedargs[id->index()] = true;
                 }
                 arg.set_ident(*id);
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_LOOKUP_U:
-                args.back() = cs.lookup_value(args.back().get_string(cs));
-                goto use_top;
-
-            case BC_INST_LOOKUP: {
-                ident *id = ts.istate->lookup_ident(op >> 8);
-                if (static_cast<alias *>(id)->is_arg()) {
-                    auto &v = args.emplace_back();
-                    if (ident_is_used_arg(id, ts)) {
-                        v = ts.get_astack(static_cast<alias *>(id)).node->val_s;
+            VM_CASE(BC_INST_LOOKUP_U): {
+                ident *id;
+                {
+                    auto idn = args.back().get_string(cs);
+                    id = vm_cache_get(ts, code, idn.data());
+                    if (!id) {
+                        id = ts.istate->get_ident(idn);
+                        if (!id) {
+                            throw error_p::make(
+                                cs, "unknown alias lookup: %s", idn.data()
+                            );
+                        }
+                        vm_cache_set(code, id);
                     }
-                    goto use_top;
-                }
-                auto &ast = ts.get_astack(static_cast<alias *>(id));
-                if (ast.flags & IDENT_FLAG_UNKNOWN) {
-                    throw error_p::make(
-                        *ts.pstate, "unknown alias lookup: %s",
-                        id->name().data()
-                    );
                 }
-                args.emplace_back() = ast.node->val_s;
+                ++code;
+                args.back() = lookup_value(ts, *id);
                 goto use_top;
             }
 
-            case BC_INST_CONC:
-            case BC_INST_CONC_W: {
+            VM_CASE(BC_INST_LOOKUP):
+                vm_lookup(ts, op, args.emplace_back());
+                goto use_top;
+
+            VM_CASE(BC_INST_CONC):
+            VM_CASE(BC_INST_CONC_W): {
                 std::size_t numconc = op >> 8;
                 auto buf = concat_values(
                     cs, span_type<any_value>{
@@ -615,13 +1200,14 @@ std::uint32_t *vm_exec(
                 goto use_top;
             }
 
-            case BC_INST_VAR:
+            VM_CASE(BC_INST_VAR):
                 args.emplace_back() = static_cast<builtin_var *>(
                     ts.istate->lookup_ident(op >> 8)
                 )->value();
                 goto use_top;
 
-            case BC_INST_ALIAS: {
+            VM_CASE(BC_INST_ALIAS):
+            vm_alias: {
                 auto *a = static_cast<alias *>(
                     ts.istate->lookup_ident(op >> 8)
                 );
@@ -632,19 +1218,33 @@ std::uint32_t *vm_exec(
                     ast.set_alias(a, ts, args.back());
                 }
                 args.pop_back();
-                continue;
+                VM_NEXT();
             }
 
-            case BC_INST_ALIAS_U: {
-                auto v = std::move(args.back());
-                args.pop_back();
-                cs.assign_value(args.back().get_string(cs), std::move(v));
-                args.pop_back();
-                continue;
+            VM_CASE(BC_INST_ALIAS_U): {
+                {
+                    auto &v = args.back();
+                    auto idn = args[args.size() - 2].get_string(cs);
+                    ident *id = vm_cache_get(ts, code, idn.data());
+                    if (!id) {
+                        id = ts.istate->get_ident(idn);
+                        if (id) {
+                            vm_cache_set(code, id);
+                        }
+                    }
+                    if (id && (id->type() == ident_type::ALIAS)) {
+                        static_cast<alias *>(id)->set_value(cs, std::move(v));
+                    } else {
+                        cs.assign_value(idn, std::move(v));
+                    }
+                }
+                ++code;
+                args.resize(args.size() - 2);
+                VM_NEXT();
             }
 
-            case BC_INST_CALL: {
-                result.force_none();
+            VM_CASE(BC_INST_CALL): {
+                res->force_none();
                 ident *id = ts.istate->lookup_ident(op >> 8);
                 std::size_t callargs = *code++;
                 std::size_t offset = args.size() - callargs;
@@ -661,150 +1261,384 @@ std::uint32_t *vm_exec(
                         cs, "unknown command: %s", id->name().data()
                     );
                 }
-                result = exec_alias(ts, imp, &args[offset], callargs, ast);
+                /* argument aliases are rebound when leaving the caller */
+                if (auto *tfr = imp->is_arg() ? nullptr : vm_tail_frame(
+                    ts, scope.fbase, op, code
+                )) {
+                    code = vm_tail_call(
+                        ts, args, *tfr, imp, offset, callargs, ast
+                    );
+                    res = tfr->res;
+                    goto use_frame;
+                }
+                /* no cleanup for the frame until the call is set up */
+                auto &fr = vm_push_frame(ts, args, VM_FRAME_BLOCK, op);
+                auto *ncode = vm_call_enter(
+                    ts, fr, imp, &args[offset], callargs, ast
+                );
+                fr.kind = VM_FRAME_CALL;
                 args.resize(offset);
-                goto use_result;
+                fr.vtop = offset;
+                fr.ret = code;
+                res = fr.res = &fr.val;
+                code = ncode;
+                goto use_frame;
             }
 
-            case BC_INST_CALL_U: {
+            VM_CASE(BC_INST_CALL_U):
+            VM_CASE(BC_INST_CALL_Q): {
                 std::size_t callargs = op >> 8;
                 std::size_t offset = args.size() - callargs;
                 any_value &idarg = args[offset - 1];
-                if (idarg.type() != value_type::STRING) {
-litval:
-                    result = std::move(idarg);
-                    args.resize(offset - 1);
-                    goto use_result;
+                std::uint32_t *cache = code++;
+                ident *id = nullptr;
+                if ((op & BC_INST_OP_MASK) == BC_INST_CALL_Q) {
+                    auto idx = atomic_word_acquire(cache) & BC_CACHE_MASK;
+                    if (idx) {
+                        id = ts.istate->lookup_ident(idx - 1);
+                    }
                 }
-                auto idn = idarg.get_string(cs);
-                auto id = cs.get_ident(idn);
                 if (!id) {
-noid:
-                    if (!is_valid_name(idn)) {
-                        goto litval;
+                    if (idarg.type() != value_type::STRING) {
+litval:
+                        *res = std::move(idarg);
+                        args.resize(offset - 1);
+                        goto use_result;
+                    }
+                    auto idn = idarg.get_string(cs);
+                    id = vm_cache_get(ts, cache, idn.data());
+                    if (!id) {
+                        id = ts.istate->get_ident(idn);
+                        if (!id) {
+                            if (!is_valid_name(idn)) {
+                                goto litval;
+                            }
+                            throw error_p::make(
+                                cs, "unknown command: %s", idn.data()
+                            );
+                        }
+                        vm_cache_set(cache, id);
+                        /* literal names never change, no need to check */
+                        if (atomic_word_load(cache) & BC_CACHE_LITERAL) {
+                            atomic_word_store(
+                                cache - 1, (op & ~BC_INST_OP_MASK) |
+                                BC_INST_CALL_Q
+                            );
+                        }
                     }
-                    std::string_view ids{idn};
-                    throw error_p::make(
-                        cs, "unknown command: %s", ids.data()
-                    );
                 }
-                result.force_none();
-                switch (ident_p{id->get()}.impl().p_type) {
+                res->force_none();
+                switch (ident_p{*id}.impl().p_type) {
                     default:
-                        if (!ident_is_callable(&id->get())) {
+                        if (!ident_is_callable(id)) {
                             args.resize(offset - 1);
                             goto use_result;
                         }
                     /* fallthrough */
                     case ID_COMMAND: {
-                        auto *cimp = static_cast<command_impl *>(&id->get());
+                        auto *cimp = static_cast<command_impl *>(id);
                         args.resize(offset + std::max(
-                            std::size_t(cimp->arg_count()), callargs
+                            cimp->p_nfixed, callargs
                         ));
                         exec_command(
-                            ts, cimp, cimp, &args[offset], result, callargs
+                            ts, cimp, cimp, &args[offset], *res, callargs
                         );
                         args.resize(offset - 1);
                         goto use_result;
                     }
+                    case ID_BREAK:
+                        op = BC_INST_BREAK | BC_INST_FLAG_FALSE;
+                        goto vm_break;
+                    case ID_CONTINUE:
+                        op = BC_INST_BREAK | BC_INST_FLAG_TRUE;
+                        goto vm_break;
                     case ID_LOCAL: {
-                        std::size_t idstsz = ts.idstack.size();
-                        for (std::size_t j = 0; j < callargs; ++j) {
+                        auto &fr = vm_push_frame(ts, args, VM_FRAME_LOCAL, op);
+                        fr.res = res;
+                        fr.nargs = offset;
+                        fr.itop = ts.idstack.size();
+                        for (std::size_t j = offset; j < fr.vtop; ++j) {
                             push_alias(
-                                ts, args[offset + j].force_ident(cs),
+                                ts, args[j].force_ident(cs),
                                 ts.idstack.emplace_back()
                             );
                         }
-                        try {
-                            code = vm_exec(ts, code, result);
-                        } catch (...) {
-                            for (std::size_t j = 0; j < callargs; ++j) {
-                                pop_alias(ts, args[offset + j].get_ident(cs));
-                            }
-                            ts.idstack.resize(idstsz);
-                            throw;
-                        }
-                        for (std::size_t j = 0; j < callargs; ++j) {
-                            pop_alias(ts, args[offset + j].get_ident(cs));
-                        }
-                        ts.idstack.resize(idstsz);
-                        return code;
+                        res->set_none();
+                        goto use_frame;
                     }
                     case ID_VAR: {
-                        auto *hid = static_cast<var_impl &>(
-                            id->get()
-                        ).get_setter(ts);
+                        auto *hid = static_cast<var_impl *>(
+                            id
+                        )->get_setter(ts);
                         auto *cimp = static_cast<command_impl *>(hid);
                         /* the $ argument */
                         args.insert(offset, any_value{});
                         args.resize(offset + std::max(
-                            std::size_t(cimp->arg_count()), callargs
+                            cimp->p_nfixed, callargs
                         ));
                         exec_command(
-                            ts, cimp, &id->get(), &args[offset],
-                            result, callargs
+                            ts, cimp, id, &args[offset],
+                            *res, callargs
                         );
                         args.resize(offset - 1);
                         goto use_result;
                     }
                     case ID_ALIAS: {
-                        alias *a = static_cast<alias *>(&id->get());
+                        alias *a = static_cast<alias *>(id);
                         if (a->is_arg() && !ident_is_used_arg(a, ts)) {
                             args.resize(offset - 1);
                             goto use_result;
                         }
                         auto &ast = ts.get_astack(a);
                         if (ast.node->val_s.type() == value_type::NONE) {
-                            goto noid;
+                            if (!is_valid_name(id->name())) {
+                                goto litval;
+                            }
+                            throw error_p::make(
+                                cs, "unknown command: %s", id->name().data()
+                            );
                         }
-                        result = exec_alias(
-                            ts, a, &args[offset], callargs, ast
+                        if (auto *tfr = a->is_arg() ? nullptr : vm_tail_frame(
+                            ts, scope.fbase, op, code
+                        )) {
+                            code = vm_tail_call(
+                                ts, args, *tfr, a, offset, callargs, ast
+                            );
+                            res = tfr->res;
+                            goto use_frame;
+                        }
+                        auto &fr = vm_push_frame(ts, args, VM_FRAME_BLOCK, op);
+                        auto *ncode = vm_call_enter(
+                            ts, fr, a, &args[offset], callargs, ast
                         );
+                        fr.kind = VM_FRAME_CALL;
                         args.resize(offset - 1);
-                        goto use_result;
+                        fr.vtop = offset - 1;
+                        fr.ret = code;
+                        res = fr.res = &fr.val;
+                        code = ncode;
+                        goto use_frame;
                     }
                 }
             }
 
-            case BC_INST_COM: {
+            VM_CASE(BC_INST_COM):
+            vm_com: {
                 command_impl *id = static_cast<command_impl *>(
                     ts.istate->lookup_ident(op >> 8)
                 );
                 std::size_t offset = args.size() - id->arg_count();
-                result.force_none();
+                res->force_none();
                 id->call_id(ts, span_type<any_value>{
                     &args[offset], std::size_t(id->arg_count())
-                }, result);
+                }, *res);
                 args.resize(offset);
                 goto use_result;
             }
 
-            case BC_INST_COM_V: {
+            VM_CASE(BC_INST_COM_V):
+            vm_com_v: {
                 command_impl *id = static_cast<command_impl *>(
                     ts.istate->lookup_ident(op >> 8)
                 );
                 std::size_t callargs = *code++;
                 std::size_t offset = args.size() - callargs;
-                result.force_none();
+                res->force_none();
                 id->call_id(
-                    ts, span_type<any_value>{&args[offset], callargs}, result
+                    ts, span_type<any_value>{&args[offset], callargs}, *res
                 );
                 args.resize(offset);
                 goto use_result;
             }
+
+            VM_CASE(BC_INST_ARITH):
+                vm_arith(cs, int(op >> 8), &args[args.size() - 2], *res);
+                args.resize(args.size() - 2);
+                goto use_result;
+
+            VM_CASE(BC_INST_LOOP):
+                if (!vm_loop_enter(ts, args, op, code)) {
+                    code += (op >> 8) + 2;
+                    VM_NEXT();
+                }
+                res = &ts.frames.back().val;
+                code += 1;
+                goto use_frame;
+
+            VM_CASE(BC_INST_LOOP_COND):
+                force_val(cs, *res, op);
+                vm_loop_unwind(ts, args);
+                if (ts.frames.back().val.get_bool()) {
+                    code += 2;
+                    VM_NEXT();
+                }
+                code = vm_loop_leave(ts, args);
+                goto use_frame_res;
+
+            VM_CASE(BC_INST_LOOP_NEXT):
+                vm_loop_unwind(ts, args);
+                if (vm_loop_step(ts, ts.frames.back())) {
+                    res = &ts.frames.back().val;
+                    res->set_none();
+                    code -= (op >> 8) + 1;
+                    goto use_frame;
+                }
+                vm_pop_frame(ts, args);
+                goto use_frame_res;
+
+            VM_CASE(BC_INST_INLINE): {
+                /* the fallback call carries the alias and argument count */
+                std::uint32_t *call = code + (op >> 8) + 1;
+                auto *a = static_cast<alias_impl *>(
+                    ts.istate->lookup_ident(*call >> 8)
+                );
+                if ((a->p_gen != *code) || ts.ident_flags) {
+                    code = call;
+                    VM_NEXT();
+                }
+                res->force_none();
+                auto &fr = vm_push_frame(ts, args, VM_FRAME_INLINE, op);
+                fr.res = res;
+                fr.vtop -= call[1];
+                fr.nargs = ts.inline_args;
+                fr.ret = call + 2;
+                ts.inline_args = fr.vtop;
+                code += 1;
+                goto use_frame;
+            }
+
+            VM_CASE(BC_INST_ARG):
+                args.emplace_back();
+                args.back() = args[ts.inline_args + (op >> 8)];
+                goto use_top;
+
+            VM_CASE(BC_INST_LOOKUP_RESULT):
+                vm_lookup(ts, op, *res);
+                goto use_result;
+
+            VM_CASE(BC_INST_VAL_ALIAS):
+                code = vm_get_val(cs, code, args.emplace_back());
+                goto vm_alias;
+
+            VM_CASE(BC_INST_VAL_COM):
+                code = vm_get_val(cs, code, args.emplace_back());
+                goto vm_com;
+
+            VM_CASE(BC_INST_VAL_COM_V):
+                code = vm_get_val(cs, code, args.emplace_back());
+                goto vm_com_v;
+
+            VM_CASE(BC_INST_LOOKUP_VAL_COM_V):
+                vm_lookup(ts, *code, args.emplace_back());
+                force_val(cs, args.back(), *code++);
+                code = vm_get_val(cs, code, args.emplace_back());
+                goto vm_com_v;
+#if !VM_THREADED
+            default:
+                VM_NEXT();
         }
-        continue;
+#endif
 use_result:
-        force_val(cs, result, op);
-        continue;
+        force_val(cs, *res, op);
+        VM_NEXT();
 use_top:
         force_val(cs, args.back(), op);
-        continue;
-use_exit:
-        force_val(cs, result, op);
-        break;
+        VM_NEXT();
+use_frame:
+        if (chook) {
+            chook(cs);
+        }
+        VM_NEXT();
+use_frame_res:
+        /* frames were left outside of an exit */
+        if (ts.frames.size() > scope.fbase) {
+            res = ts.frames.back().res;
+        } else {
+            res = &result;
+        }
+        VM_NEXT();
+use_exit: {
+        force_val(cs, *res, op);
+        int kind;
+        /* local idents are left together with their enclosing frame */
+        do {
+            if (ts.frames.size() == scope.fbase) {
+                return code;
+            }
+            auto &fr = ts.frames.back();
+            kind = fr.kind;
+            args.resize(fr.vtop);
+            switch (kind) {
+                case VM_FRAME_BLOCK:
+                    args.emplace_back(std::move(fr.val));
+                    break;
+                case VM_FRAME_DO:
+                case VM_FRAME_CALL:
+                    if (ts.frames.size() > (scope.fbase + 1)) {
+                        *ts.frames[ts.frames.size() - 2].res = std::move(
+                            fr.val
+                        );
+                    } else {
+                        result = std::move(fr.val);
+                    }
+                    op = fr.op;
+                    code = fr.ret;
+                    break;
+                case VM_FRAME_INLINE:
+                    code = fr.ret;
+                    break;
+                default:
+                    break;
+            }
+            vm_pop_frame(ts, args);
+        } while (kind == VM_FRAME_LOCAL);
+        if (ts.frames.size() > scope.fbase) {
+            res = ts.frames.back().res;
+        } else {
+            res = &result;
+        }
+        if ((kind == VM_FRAME_DO) || (kind == VM_FRAME_CALL)) {
+            goto use_result;
+        }
+        VM_NEXT();
+    }
+#if !VM_THREADED
+    }
+#endif
+}
+
+#if VM_THREADED
+#  pragma GCC diagnostic pop
+#endif
+
+std::uint32_t *vm_exec(
+    thread_state &ts, std::uint32_t *code, any_value &result
+) {
+    result.set_none();
+    vm_guard scope{ts}; /* keep track of recursion depth + manage stack */
+    auto &chook = ts.pstate->call_hook();
+    if (chook) {
+        chook(*ts.pstate);
+    }
+    /* break and continue unwinding out of nested native code end up here,
+     * to be handled if the innermost loop was compiled inline in this VM
+     */
+    for (;;) {
+        try {
+            return vm_run(ts, scope, code, result);
+        } catch (break_exception) {
+            if (!ts.loop_frame || (ts.native_depth != ts.loop_native)) {
+                throw;
+            }
+            code = vm_loop_leave(ts, scope.args);
+        } catch (continue_exception) {
+            if (!ts.loop_frame || (ts.native_depth != ts.loop_native)) {
+                throw;
+            }
+            vm_loop_unwind(ts, scope.args);
+            code = ts.frames.back().ret;
+        }
     }
-    return code;
 }
 
 } /* namespace cubescript */
@@ -6,7 +6,10 @@
 #include "cs_std.hh"
 #include "cs_ident.hh"
 #include "cs_thread.hh"
+#include "cs_bcode.hh"
+#include "cs_strman.hh"
 
+#include <cstring>
 #include <utility>
 
 namespace cubescript {
@@ -27,8 +30,68 @@ any_value exec_alias(
     std::size_t callargs, alias_stack &astack
 );
 
+any_value lookup_value(thread_state &ts, ident &id);
+
 any_value exec_code_with_args(thread_state &ts, bcode_ref const &body);
 
+/* decodes the value pushed by the BC_INST_VAL or BC_INST_VAL_INT at code;
+ * superinstructions carry the instructions they were fused from, and the
+ * compiler uses it when folding constants; returns the position after the
+ * instruction
+ */
+inline std::uint32_t *vm_get_val(
+    state &cs, std::uint32_t *code, any_value &v
+) {
+    std::uint32_t op = *code++;
+    if ((op & BC_INST_OP_MASK) == BC_INST_VAL_INT) {
+        switch (op & BC_INST_RET_MASK) {
+            case BC_RET_STRING: {
+                char s[4] = {
+                    char((op >> 8) & 0xFF),
+                    char((op >> 16) & 0xFF),
+                    char((op >> 24) & 0xFF), '\0'
+                };
+                v.set_string(s, cs);
+                break;
+            }
+            case BC_RET_INT:
+                v.set_integer(integer_type(op) >> 8);
+                break;
+            case BC_RET_FLOAT:
+                v.set_float(float_type(integer_type(op) >> 8));
+                break;
+            default:
+                v.set_none();
+                break;
+        }
+        return code;
+    }
+    switch (op & BC_INST_RET_MASK) {
+        case BC_RET_STRING: {
+            char const *str;
+            std::memcpy(&str, code, sizeof(str));
+            any_value_p{v}.set_managed(str);
+            return code + bc_store_size<char const *>;
+        }
+        case BC_RET_INT: {
+            integer_type i;
+            std::memcpy(&i, code, sizeof(i));
+            v.set_integer(i);
+            return code + bc_store_size<integer_type>;
+        }
+        case BC_RET_FLOAT: {
+            float_type f;
+            std::memcpy(&f, code, sizeof(f));
+            v.set_float(f);
+            return code + bc_store_size<float_type>;
+        }
+        default:
+            break;
+    }
+    v.set_none();
+    return code;
+}
+
 std::uint32_t *vm_exec(
     thread_state &ts, std::uint32_t *code, any_value &result
 );
@@ -4,8 +4,10 @@
 
 #include "cs_std.hh"
 #include "cs_ident.hh"
+#include "cs_bcode.hh"
 #include "cs_thread.hh"
 #include "cs_error.hh"
+#include "cs_strman.hh"
 
 namespace cubescript {
 
@@ -61,10 +63,12 @@ static inline void do_loop_conc(
         s.append(v.get_string(cs));
     }
 end:
-    res.set_string(s.str(), cs);
+    set_transient_string(cs, res, s.str());
 }
 
 LIBCUBESCRIPT_EXPORT void std_init_base(state &gcs) {
+    command *cmd;
+
     new_cmd_quiet(gcs, "error", "s", [](auto &cs, auto args, auto &) {
         throw error{cs, args[0].get_string(cs)};
     });
@@ -197,57 +201,87 @@ LIBCUBESCRIPT_EXPORT void std_init_base(state &gcs) {
         }
     });
 
-    new_cmd_quiet(gcs, "loop", "vab", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loop", "vab", [](auto &cs, auto args, auto &) {
         do_loop(
             cs, args[0].get_ident(cs), 0, args[1].get_integer(), 1,
             bcode_ref{}, args[2].get_code()
         );
     });
+    loop_builtin(cmd, (1 << BC_LOOP_VARS) | (1 << BC_LOOP_COUNT));
 
-    new_cmd_quiet(gcs, "loop+", "viib", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loop+", "viib", [](auto &cs, auto args, auto &) {
         do_loop(
             cs, args[0].get_ident(cs), args[1].get_integer(),
             args[2].get_integer(), 1, bcode_ref{}, args[3].get_code()
         );
     });
+    loop_builtin(cmd,
+        (1 << BC_LOOP_VARS) | (1 << BC_LOOP_OFFSET) | (2 << BC_LOOP_COUNT)
+    );
 
-    new_cmd_quiet(gcs, "loop*", "viib", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loop*", "viib", [](auto &cs, auto args, auto &) {
         do_loop(
             cs, args[0].get_ident(cs), 0, args[1].get_integer(),
             args[2].get_integer(), bcode_ref{}, args[3].get_code()
         );
     });
+    loop_builtin(cmd,
+        (1 << BC_LOOP_VARS) | (1 << BC_LOOP_COUNT) | (2 << BC_LOOP_STEP)
+    );
 
-    new_cmd_quiet(gcs, "loop+*", "viiib", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loop+*", "viiib", [](
+        auto &cs, auto args, auto &
+    ) {
         do_loop(
             cs, args[0].get_ident(cs), args[1].get_integer(),
             args[3].get_integer(), args[2].get_integer(),
             bcode_ref{}, args[4].get_code()
         );
     });
+    loop_builtin(cmd,
+        (1 << BC_LOOP_VARS) | (1 << BC_LOOP_OFFSET) | (2 << BC_LOOP_STEP) |
+        (3 << BC_LOOP_COUNT)
+    );
 
-    new_cmd_quiet(gcs, "loopwhile", "vibb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loopwhile", "vibb", [](
+        auto &cs, auto args, auto &
+    ) {
         do_loop(
             cs, args[0].get_ident(cs), 0, args[1].get_integer(), 1,
             args[2].get_code(), args[3].get_code()
         );
     });
+    loop_builtin(cmd,
+        BC_LOOP_COND | (1 << BC_LOOP_VARS) | (1 << BC_LOOP_COUNT)
+    );
 
-    new_cmd_quiet(gcs, "loopwhile+", "viibb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loopwhile+", "viibb", [](
+        auto &cs, auto args, auto &
+    ) {
         do_loop(
             cs, args[0].get_ident(cs), args[1].get_integer(),
             args[2].get_integer(), 1, args[3].get_code(), args[4].get_code()
         );
     });
+    loop_builtin(cmd,
+        BC_LOOP_COND | (1 << BC_LOOP_VARS) | (1 << BC_LOOP_OFFSET) |
+        (2 << BC_LOOP_COUNT)
+    );
 
-    new_cmd_quiet(gcs, "loopwhile*", "viibb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "loopwhile*", "viibb", [](
+        auto &cs, auto args, auto &
+    ) {
         do_loop(
             cs, args[0].get_ident(cs), 0, args[2].get_integer(),
             args[1].get_integer(), args[3].get_code(), args[4].get_code()
         );
     });
+    loop_builtin(cmd,
+        BC_LOOP_COND | (1 << BC_LOOP_VARS) | (1 << BC_LOOP_STEP) |
+        (2 << BC_LOOP_COUNT)
+    );
 
-    new_cmd_quiet(gcs, "loopwhile+*", "viiibb", [](
+    cmd = new_cmd_quiet(gcs, "loopwhile+*", "viiibb", [](
         auto &cs, auto args, auto &
     ) {
         do_loop(
@@ -256,8 +290,12 @@ LIBCUBESCRIPT_EXPORT void std_init_base(state &gcs) {
             args[5].get_code()
         );
     });
+    loop_builtin(cmd,
+        BC_LOOP_COND | (1 << BC_LOOP_VARS) | (1 << BC_LOOP_OFFSET) |
+        (2 << BC_LOOP_STEP) | (3 << BC_LOOP_COUNT)
+    );
 
-    new_cmd_quiet(gcs, "while", "bb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "while", "bb", [](auto &cs, auto args, auto &) {
         auto cond = args[0].get_code();
         auto body = args[1].get_code();
         while (cond.call(cs).get_bool()) {
@@ -271,6 +309,7 @@ LIBCUBESCRIPT_EXPORT void std_init_base(state &gcs) {
 end:
         return;
     });
+    loop_builtin(cmd, BC_LOOP_COND);
 
     new_cmd_quiet(gcs, "loopconcat", "vib", [](
         auto &cs, auto args, auto &res
@@ -355,19 +394,26 @@ end:
         res = args[2].get_code().call(cs);
     });
 
-    new_cmd_quiet(gcs, "resetvar", "s", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "resetvar", "s", [](auto &cs, auto args, auto &) {
         cs.reset_value(args[0].get_string(cs));
     });
+    byname_builtin(cmd);
 
-    new_cmd_quiet(gcs, "alias", "sa", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "alias", "sa", [](auto &cs, auto args, auto &) {
         cs.assign_value(args[0].get_string(cs), args[1]);
     });
+    byname_builtin(cmd);
 
-    new_cmd_quiet(gcs, "identexists", "s", [](auto &cs, auto args, auto &res) {
+    cmd = new_cmd_quiet(gcs, "identexists", "s", [](
+        auto &cs, auto args, auto &res
+    ) {
         res.set_integer(cs.get_ident(args[0].get_string(cs)) != std::nullopt);
     });
+    byname_builtin(cmd);
 
-    new_cmd_quiet(gcs, "getalias", "s", [](auto &cs, auto args, auto &res) {
+    cmd = new_cmd_quiet(gcs, "getalias", "s", [](
+        auto &cs, auto args, auto &res
+    ) {
         auto &id = cs.new_ident(args[0].get_string(cs));
         if (id.type() != ident_type::ALIAS) {
             throw error_p::make(cs, "'%s' is not an alias", id.name().data());
@@ -377,6 +423,7 @@ end:
         }
         res = static_cast<alias &>(id).value(cs);
     });
+    byname_builtin(cmd);
 }
 
 } /* namespace cubescript */
@@ -3,8 +3,11 @@
 
 #include <cubescript/cubescript.hh>
 #include "cs_std.hh"
+#include "cs_ident.hh"
+#include "cs_bcode.hh"
 #include "cs_parser.hh"
 #include "cs_thread.hh"
+#include "cs_strman.hh"
 
 namespace cubescript {
 
@@ -98,7 +101,7 @@ static void loop_list_conc(
         r.append(v.get_string(cs));
     }
 end:
-    res.set_string(r.str(), cs);
+    set_transient_string(cs, res, r.str());
 }
 
 int list_includes(
@@ -141,6 +144,8 @@ static inline void list_merge(
 static void init_lib_list_sort(state &cs);
 
 LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
+    command *cmd;
+
     new_cmd_quiet(gcs, "listlen", "s", [](auto &cs, auto args, auto &res) {
         res.set_integer(
             integer_type(list_parser{cs, args[0].get_string(cs)}.count())
@@ -284,7 +289,9 @@ LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
         );
     });
 
-    new_cmd_quiet(gcs, "looplist", "vsb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "looplist", "vsb", [](
+        auto &cs, auto args, auto &
+    ) {
         alias_local st{cs, args[0]};
         any_value idv{};
         auto body = args[2].get_code();
@@ -299,8 +306,11 @@ LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
             }
         }
     });
+    loop_builtin(cmd, BC_LOOP_LIST | (1 << BC_LOOP_VARS));
 
-    new_cmd_quiet(gcs, "looplist2", "vvsb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "looplist2", "vvsb", [](
+        auto &cs, auto args, auto &
+    ) {
         alias_local st1{cs, args[0]};
         alias_local st2{cs, args[1]};
         any_value idv{};
@@ -322,8 +332,11 @@ LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
             }
         }
     });
+    loop_builtin(cmd, BC_LOOP_LIST | (2 << BC_LOOP_VARS));
 
-    new_cmd_quiet(gcs, "looplist3", "vvvsb", [](auto &cs, auto args, auto &) {
+    cmd = new_cmd_quiet(gcs, "looplist3", "vvvsb", [](
+        auto &cs, auto args, auto &
+    ) {
         alias_local st1{cs, args[0]};
         alias_local st2{cs, args[1]};
         alias_local st3{cs, args[2]};
@@ -352,6 +365,7 @@ LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
             }
         }
     });
+    loop_builtin(cmd, BC_LOOP_LIST | (3 << BC_LOOP_VARS));
 
     new_cmd_quiet(gcs, "looplistconcat", "vsb", [](
         auto &cs, auto args, auto &res
@@ -431,7 +445,7 @@ LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
                 buf.push_back(' ');
             }
         }
-        res.set_string(buf.str(), cs);
+        set_transient_string(cs, res, buf.str());
     });
 
     new_cmd_quiet(gcs, "indexof", "ss", [](auto &cs, auto args, auto &res) {
@@ -497,7 +511,7 @@ LIBCUBESCRIPT_EXPORT void std_init_list(state &gcs) {
                     break;
             }
         }
-        res.set_string(buf.str(), cs);
+        set_transient_string(cs, res, buf.str());
     });
 
     init_lib_list_sort(gcs);
@@ -7,6 +7,7 @@
 #include "cs_std.hh"
 #include "cs_strman.hh"
 #include "cs_thread.hh"
+#include "cs_math.hh"
 
 namespace cubescript {
 
@@ -30,6 +31,8 @@ static inline void str_cmp_by(
 }
 
 LIBCUBESCRIPT_EXPORT void std_init_string(state &cs) {
+    command *cmd;
+
     new_cmd_quiet(cs, "strstr", "ss", [](auto &ccs, auto args, auto &res) {
         std::string_view a = args[0].get_string(ccs);
         std::string_view b = args[1].get_string(ccs);
@@ -109,10 +112,8 @@ LIBCUBESCRIPT_EXPORT void std_init_string(state &cs) {
         std::string_view f{fs};
         for (auto it = f.begin(); it != f.end(); ++it) {
             char c = *it;
-            ++it;
-            if ((c == '%') && (it != f.end())) {
-                char ic = *it;
-                ++it;
+            if ((c == '%') && ((it + 1) != f.end())) {
+                char ic = *++it;
                 if ((ic >= '1') && (ic <= '9')) {
                     int i = ic - '0';
                     if (std::size_t(i) < args.size()) {
@@ -125,7 +126,7 @@ LIBCUBESCRIPT_EXPORT void std_init_string(state &cs) {
                 s.push_back(c);
             }
         }
-        res.set_string(s.str(), ccs);
+        set_transient_string(ccs, res, s.str());
     });
 
     new_cmd_quiet(cs, "tohex", "ii", [](auto &ccs, auto args, auto &res) {
@@ -167,27 +168,33 @@ LIBCUBESCRIPT_EXPORT void std_init_string(state &cs) {
         }, ccs);
     });
 
-    new_cmd_quiet(cs, "strcmp", "s1...", [](auto &ccs, auto args, auto &res) {
+    new_cmd_pure(cs, "strcmp", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::equal_to<std::string_view>());
     });
-    new_cmd_quiet(cs, "=s", "s1...", [](auto &ccs, auto args, auto &res) {
+    cmd = new_cmd_pure(cs, "=s", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::equal_to<std::string_view>());
     });
-    new_cmd_quiet(cs, "!=s", "s1...", [](auto &ccs, auto args, auto &res) {
+    math_builtin(cmd, MATH_EQS);
+    cmd = new_cmd_pure(cs, "!=s", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::not_equal_to<std::string_view>());
     });
-    new_cmd_quiet(cs, "<s", "s1...", [](auto &ccs, auto args, auto &res) {
+    math_builtin(cmd, MATH_NES);
+    cmd = new_cmd_pure(cs, "<s", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::less<std::string_view>());
     });
-    new_cmd_quiet(cs, ">s", "s1...", [](auto &ccs, auto args, auto &res) {
+    math_builtin(cmd, MATH_LTS);
+    cmd = new_cmd_pure(cs, ">s", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::greater<std::string_view>());
     });
-    new_cmd_quiet(cs, "<=s", "s1...", [](auto &ccs, auto args, auto &res) {
+    math_builtin(cmd, MATH_GTS);
+    cmd = new_cmd_pure(cs, "<=s", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::less_equal<std::string_view>());
     });
-    new_cmd_quiet(cs, ">=s", "s1...", [](auto &ccs, auto args, auto &res) {
+    math_builtin(cmd, MATH_LES);
+    cmd = new_cmd_pure(cs, ">=s", "s1...", [](auto &ccs, auto args, auto &res) {
         str_cmp_by(ccs, args, res, std::greater_equal<std::string_view>());
     });
+    math_builtin(cmd, MATH_GES);
 
     new_cmd_quiet(cs, "strreplace", "ssss", [](
         auto &ccs, auto args, auto &res
@@ -208,15 +215,12 @@ LIBCUBESCRIPT_EXPORT void std_init_string(state &cs) {
             auto p = s.find(oldval);
             if (p == s.npos) {
                 buf.append(s);
-                res.set_string(s, ccs);
+                set_transient_string(ccs, res, buf.str());
                 return;
             }
             buf.append(s.substr(0, p));
             buf.append((i & 1) ? newval2 : newval);
-            buf.append(s.substr(
-                p + oldval.size(),
-                s.size() - p - oldval.size()
-            ));
+            s = s.substr(p + oldval.size(), s.size() - p - oldval.size());
         }
     });
 
@@ -238,7 +242,7 @@ LIBCUBESCRIPT_EXPORT void std_init_string(state &cs) {
         if ((offset + len) < integer_type(s.size())) {
             p.append(s.substr(offset + len, s.size() - offset - len));
         }
-        res.set_string(p.str(), ccs);
+        set_transient_string(ccs, res, p.str());
     });
 }
 
@@ -0,0 +1,86 @@
+/* tests for batch compilation: the results come back in order no matter
+ * which thread compiled them, aliases first seen by several threads at
+ * once are created only once, and the earliest error is the one reported
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lib_test.hh"
+
+static constexpr std::size_t NINPUTS = 64;
+
+int main() {
+    std::vector<std::string> srcs;
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < NINPUTS; ++i) {
+        auto n = std::to_string(i);
+        /* every input refers to the same aliases, plus one of its own */
+        srcs.push_back(
+            "counter (+ $counter 1); shared_b = [x]; shared_a = $shared_b; "
+            "own" + n + " = " + n + "; result (concat $own" + n +
+            " (+ " + n + " 1))"
+        );
+        names.push_back("input" + n);
+    }
+    std::vector<cs::compile_input> inputs;
+    for (std::size_t i = 0; i < NINPUTS; ++i) {
+        inputs.push_back(cs::compile_input{srcs[i], names[i]});
+    }
+
+    for (std::size_t nthr: {std::size_t(1), std::size_t(4), std::size_t(0)}) {
+        cs::state gcs;
+        init_state(gcs);
+        gcs.new_var("counter", 0);
+        auto nids = gcs.ident_count();
+        std::vector<cs::bcode_ref> ret(NINPUTS);
+        gcs.compile_all(inputs, ret, nthr);
+        /* shared_a, shared_b and one alias per input */
+        check(gcs.ident_count() == (nids + NINPUTS + 2), "ident count");
+        for (std::size_t i = 0; i < gcs.ident_count(); ++i) {
+            auto &id = gcs.get_ident(i);
+            auto found = gcs.get_ident(id.name());
+            check(found && (&found->get() == &id), "ident map");
+        }
+        bool ok = true;
+        for (std::size_t i = 0; i < NINPUTS; ++i) {
+            auto n = std::to_string(i);
+            auto res = ret[i].call(gcs).get_string(gcs);
+            ok = ok && (res.view() == (n + " " + std::to_string(i + 1)));
+        }
+        check(ok, "results in order");
+        check(
+            run(gcs, "result $counter") == std::to_string(NINPUTS),
+            "shared var"
+        );
+    }
+
+    {
+        /* inputs 10 and 40 are broken, 10 is the one reported */
+        auto bsrcs = srcs;
+        bsrcs[10] = "echo [unfinished";
+        bsrcs[40] = "echo (unfinished";
+        std::vector<cs::compile_input> binputs;
+        for (std::size_t i = 0; i < NINPUTS; ++i) {
+            binputs.push_back(cs::compile_input{bsrcs[i], names[i]});
+        }
+        cs::state gcs;
+        init_state(gcs);
+        std::vector<cs::bcode_ref> ret(NINPUTS);
+        bool thrown = false;
+        try {
+            gcs.compile_all(binputs, ret, 4);
+        } catch (cs::error const &e) {
+            thrown = true;
+            check(
+                e.what().find("input10") != std::string_view::npos,
+                "earliest error"
+            );
+        }
+        check(thrown, "error thrown");
+        /* the others are still compiled */
+        check(!!ret[0] && !!ret[63] && !ret[10], "rest compiled");
+    }
+    return test_result();
+}
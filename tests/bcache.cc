@@ -0,0 +1,151 @@
+/* tests for bytecode images: saving compiled code and loading it into
+ * a fresh state, as well as the cases where the image must be refused
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "lib_test.hh"
+
+/* where the checksum is kept in the header of an image and where the data
+ * it sums up starts, see bcode_image_hdr
+ */
+static constexpr std::size_t hdr_sum = 32;
+static constexpr std::size_t hdr_size = 56;
+
+static std::uint64_t fnv(std::string_view v) {
+    std::uint64_t h = 0xCBF29CE484222325ULL;
+    for (unsigned char c: v) {
+        h ^= c;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* helpers defined before compiling, so that calls to them are inlined */
+static char const *helpers = "sq = [* $arg1 $arg1]; pfx = \"item_\"";
+
+static char const *source = R"(
+    total = 0
+    loop i 10 [total = (+ $total (sq $i))]
+    names = ""
+    looplist n "alpha beta gamma delta" [
+        names = (concat $names (concatword $pfx $n))
+    ]
+    f = 0.5
+    body = [concatword "in block: " $arg1]
+    result (concat $total (body "a long enough string constant") $names (*f $f 4) $maxfps)
+)";
+
+static void init(cs::state &cs) {
+    init_state(cs);
+    run(cs, helpers);
+}
+
+int main() {
+    std::string image;
+    std::string expected;
+    {
+        cs::state gcs;
+        init(gcs);
+        auto code = gcs.compile(source);
+        expected = code.call(gcs).get_string(gcs).view();
+        image = gcs.save_code(code, source).view();
+        /* running the code fills in its caches, which must not matter */
+        check(code.call(gcs).get_string(gcs).view() == expected, "rerun");
+        check(gcs.save_code(code, source).view() == image, "deterministic");
+        /* nested blocks are saved with the code around them */
+        cs::bcode_ref blk;
+        gcs.new_command("grab", "b", [&blk](auto &, auto args, auto &) {
+            blk = args[0].get_code();
+        });
+        run(gcs, "grab [result nested]");
+        auto bimg = std::string{gcs.save_code(blk, "blk").view()};
+        auto lblk = gcs.load_code(bimg, "blk");
+        check(!!lblk, "nested load");
+        check(
+            lblk && (lblk.call(gcs).get_string(gcs).view() == "nested"),
+            "nested result"
+        );
+    }
+    {
+        /* a fresh state with the same commands */
+        cs::state gcs;
+        init(gcs);
+        auto code = gcs.load_code(image, source);
+        check(!!code, "load");
+        if (code) {
+            auto res = code.call(gcs).get_string(gcs);
+            check(res.view() == expected, "loaded result");
+            /* inlined bodies are only saved as current if they are */
+            check(
+                gcs.save_code(code, source).view() == image, "save loaded"
+            );
+        }
+        /* stale images */
+        std::string other = source;
+        other += " ";
+        check(!gcs.load_code(image, other), "source changed");
+        auto bad = image;
+        bad[bad.size() / 2] ^= 0x55;
+        check(!gcs.load_code(bad, source), "damaged");
+        check(!gcs.load_code(image.substr(0, 40), source), "truncated");
+        check(!gcs.load_code("", source), "empty");
+        /* a new command may be compiled differently */
+        gcs.new_command("sq2", "i", [](auto &, auto, auto &) {});
+        check(!gcs.load_code(image, source), "commands changed");
+    }
+    {
+        /* an alias with a different body than the one inlined in the image
+         * must be called rather than running the saved copy
+         */
+        cs::state gcs;
+        init(gcs);
+        run(gcs, "sq = [+ $arg1 $arg1]");
+        auto code = gcs.load_code(image, source);
+        check(!!code, "load with changed alias");
+        auto ref = run(gcs, source);
+        check(ref != expected, "changed alias result");
+        check(
+            code && (code.call(gcs).get_string(gcs).view() == ref),
+            "changed alias not inlined"
+        );
+    }
+    {
+        /* idents changing type are detected */
+        cs::state gcs;
+        init_state(gcs);
+        gcs.new_var("total", 5);
+        run(gcs, helpers);
+        check(!gcs.load_code(image, source), "ident type changed");
+    }
+    {
+        /* instructions are checked against the kind of the idents they use;
+         * here a command call is made to refer to an alias, with the image
+         * being otherwise consistent
+         */
+        cs::state gcs;
+        init(gcs);
+        std::string_view src = "strlen abcdefgh";
+        auto img = std::string{gcs.save_code(gcs.compile(src), src).view()};
+        std::uint64_t sum;
+        std::memcpy(&sum, &img[hdr_sum], sizeof(sum));
+        check(sum == fnv(std::string_view{img}.substr(hdr_size)), "layout");
+        std::uint32_t len = 6;
+        std::string name(sizeof(len), '\0');
+        std::memcpy(name.data(), &len, sizeof(len));
+        auto pos = img.find(name + "strlen");
+        check(pos != std::string::npos, "relocation");
+        if (pos != std::string::npos) {
+            /* the type comes two words before the name */
+            auto tp = std::uint32_t(cs::ident_type::ALIAS);
+            std::memcpy(&img[pos - 2 * sizeof(tp)], &tp, sizeof(tp));
+            img.replace(pos + sizeof(len), 6, "strlex");
+            sum = fnv(std::string_view{img}.substr(hdr_size));
+            std::memcpy(&img[hdr_sum], &sum, sizeof(sum));
+            check(!gcs.load_code(img, src), "command turned into alias");
+        }
+    }
+    return test_result();
+}
@@ -0,0 +1,41 @@
+/* shared scaffolding for the tests using the library directly; they
+ * check a number of conditions, report the ones that do not hold, and
+ * fail at the end if any did not
+ */
+
+#ifndef LIBCUBESCRIPT_TESTS_LIB_TEST_HH
+#define LIBCUBESCRIPT_TESTS_LIB_TEST_HH
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#include <cubescript/cubescript.hh>
+
+namespace cs = cubescript;
+
+static int failed = 0;
+
+static inline void check(bool cond, char const *what) {
+    if (!cond) {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        ++failed;
+    }
+}
+
+static inline int test_result() {
+    return failed ? 1 : 0;
+}
+
+/* the standard library plus a var, like a host would set the state up */
+static inline void init_state(cs::state &cs) {
+    cs::std_init_all(cs);
+    cs.new_var("maxfps", 200);
+}
+
+/* compiles and runs the code, returning a copy of the result */
+static inline std::string run(cs::state &cs, std::string_view code) {
+    return std::string{cs.compile(code).call(cs).get_string(cs).view()};
+}
+
+#endif
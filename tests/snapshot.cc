@@ -0,0 +1,82 @@
+/* tests for state snapshots: saving a state set up by scripts and loading
+ * it into a fresh state with the same commands, as well as the cases where
+ * the snapshot must be refused without touching the state
+ */
+
+#include <string>
+
+#include "lib_test.hh"
+
+static char const *setup = R"(
+    sq = [* $arg1 $arg1]
+    greeting = "hello"
+    ratio = 0.25
+    count = 42
+    body = [concatword "called with " $arg1]
+    maxfps 120
+    name "player"
+    sq 5
+    body y
+)";
+
+static void init(cs::state &cs) {
+    init_state(cs);
+    cs.new_var("name", "unnamed");
+    cs.new_var("gamma", 1.0f, false, cs::var_type::OVERRIDABLE);
+}
+
+int main() {
+    std::string image;
+    {
+        cs::state gcs;
+        init(gcs);
+        run(gcs, setup);
+        run(gcs, "gamma 2.0; newvar = 3");
+        image = gcs.save_snapshot().view();
+        check(gcs.save_snapshot().view() == image, "deterministic");
+    }
+    {
+        cs::state gcs;
+        init(gcs);
+        check(gcs.load_snapshot(image), "load");
+        check(run(gcs, "sq 7") == "49", "alias call");
+        check(run(gcs, "result $greeting") == "hello", "string alias");
+        check(run(gcs, "result $ratio") == "0.25", "float alias");
+        check(run(gcs, "result $count") == "42", "integer alias");
+        check(
+            run(gcs, "body x") == "called with x", "code alias"
+        );
+        check(run(gcs, "result $maxfps") == "120", "integer var");
+        check(run(gcs, "result $name") == "player", "string var");
+        check(run(gcs, "result $gamma") == "2.0", "overridden var");
+        check(run(gcs, "result $newvar") == "3", "new alias");
+        gcs.clear_overrides();
+        check(run(gcs, "result $gamma") == "1.0", "override restored");
+        /* loading again over the same idents works too */
+        check(gcs.load_snapshot(image), "reload");
+        check(run(gcs, "result $gamma") == "2.0", "overridden again");
+    }
+    {
+        cs::state gcs;
+        init(gcs);
+        run(gcs, "count = 5");
+        auto bad = image;
+        bad[bad.size() / 2] ^= 0x55;
+        check(!gcs.load_snapshot(bad), "damaged");
+        check(!gcs.load_snapshot(image.substr(0, 40)), "truncated");
+        check(!gcs.load_snapshot(""), "empty");
+        /* an ident that has a different type now */
+        gcs.new_var("ratio", 1);
+        check(!gcs.load_snapshot(image), "ident type changed");
+        check(run(gcs, "result $count") == "5", "left alone");
+        check(run(gcs, "result $maxfps") == "200", "var left alone");
+    }
+    {
+        /* the commands must match */
+        cs::state gcs;
+        init(gcs);
+        gcs.new_command("extra", "i", [](auto &, auto, auto &) {});
+        check(!gcs.load_snapshot(image), "commands changed");
+    }
+    return test_result();
+}
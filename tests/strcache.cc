@@ -0,0 +1,83 @@
+/* tests for the dead string cache: dropped strings made again are reused
+ * and counted as hits, the limits are never exceeded, the least recently
+ * dropped strings go first, and zero limits turn the cache off
+ */
+
+#include <string>
+
+#include "lib_test.hh"
+
+/* creates and immediately drops a bunch of distinct strings */
+static void drop_strings(cs::state &cs, char const *pfx, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+        cs::string_ref{cs, std::string{pfx} + std::to_string(i)};
+    }
+}
+
+/* whether making the string again revives it from the cache */
+static bool is_cached(cs::state &cs, char const *str) {
+    auto hits = cs.string_cache().hits;
+    cs::string_ref{cs, str};
+    return cs.string_cache().hits == (hits + 1);
+}
+
+int main() {
+    cs::state gcs;
+
+    auto info = gcs.string_cache();
+    check(info.max_entries == 1024, "default entry limit");
+    check(info.max_bytes == (64 * 1024), "default byte limit");
+
+    {
+        cs::string_ref{gcs, "a string to be dropped"};
+        auto before = gcs.string_cache();
+        cs::string_ref{gcs, "a string to be dropped"};
+        auto after = gcs.string_cache();
+        check(after.hits == (before.hits + 1), "hit on reuse");
+        check(after.misses == before.misses, "no miss on reuse");
+        cs::string_ref{gcs, "a string never seen before"};
+        check(gcs.string_cache().misses == (after.misses + 1), "miss");
+        /* a live string is not in the cache, so this is neither */
+        cs::string_ref live{gcs, "a string kept alive"};
+        before = gcs.string_cache();
+        cs::string_ref{gcs, "a string kept alive"};
+        after = gcs.string_cache();
+        check(after.hits == before.hits, "live string is no hit");
+        check(after.misses == before.misses, "live string is no miss");
+    }
+
+    /* limits that are not a multiple of the number of shards */
+    gcs.string_cache(100, 1 << 20);
+    info = gcs.string_cache();
+    check(info.max_entries == 100, "set entry limit");
+    check((info.entries == 0) && (info.bytes == 0), "emptied on set");
+    drop_strings(gcs, "entry limit ", 2000);
+    info = gcs.string_cache();
+    check(info.entries <= 100, "entry limit");
+    check(info.entries >= 50, "filled up to the entry limit");
+
+    gcs.string_cache(1000, 3000);
+    drop_strings(gcs, "byte limit ", 2000);
+    info = gcs.string_cache();
+    check(info.bytes <= 3000, "byte limit");
+    check(info.entries < 1000, "byte limit before entry limit");
+    check(info.entries > 0, "filled up to the byte limit");
+
+    /* least recently dropped strings are evicted first */
+    gcs.string_cache(256, 1 << 20);
+    cs::string_ref{gcs, "the oldest dropped string"};
+    drop_strings(gcs, "newer string ", 4096);
+    check(!is_cached(gcs, "the oldest dropped string"), "oldest evicted");
+    check(is_cached(gcs, "newer string 4095"), "newest kept");
+
+    /* either limit set to zero disables the cache */
+    gcs.string_cache(0, 1 << 20);
+    info = gcs.string_cache();
+    check((info.max_entries == 0) && (info.max_bytes == 0), "disabled");
+    check((info.entries == 0) && (info.bytes == 0), "emptied on disable");
+    drop_strings(gcs, "uncached ", 100);
+    check(gcs.string_cache().entries == 0, "nothing kept");
+    check(!is_cached(gcs, "uncached 99"), "no hit when disabled");
+
+    return test_result();
+}